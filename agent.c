@@ -2,6 +2,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
+#include <limits.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/un.h>
@@ -10,157 +12,1779 @@
 #include <fcntl.h>
 #include <sys/syscall.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <signal.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <search.h>
+#include <pthread.h>
 #include "protocol.h"
+#include "spawn.h"
+#include "config.h"
+#include "cgroup.h"
+#include "pool.h"
+#include "stats.h"
+#include "fdstore.h"
+#ifdef HOLDEN_IO_URING
+#include "uring.h"
+#endif
 
-// Signal handler for SIGCHLD to reap zombie children
-void sigchld_handler(int sig) {
-    (void)sig; // Unused parameter
-    int status;
+#define DEFAULT_MAX_CONNECTIONS 256
+#define MAX_EVENTS 64
+// Requests handled per connection per wakeup, so one busy client can't
+// starve the others
+#define MAX_REQUESTS_PER_WAKEUP 16
+
+typedef enum {
+    CONN_READING,          // waiting for (the rest of) a request
+    CONN_SPAWNING,         // waiting for the execs of the request
+    CONN_WRITING           // flushing the response and its pidfds
+} connection_state_t;
+
+// Besides the listener (NULL) and the stats socket, epoll events point
+// to a connection, a pending spawn or a child; all start with their kind
+typedef enum {
+    EVENT_CONNECTION,
+    EVENT_SPAWN,
+    EVENT_CHILD
+} event_kind_t;
+
+struct connection;
+
+// A process of the current request whose exec hasn't reported yet
+typedef struct {
+    event_kind_t kind;
+    struct connection *conn;
+    int status_fd;         // see spawn_process_async()
+    uint32_t index;        // entry of the request
+    uint64_t started;      // when the child was created
+    int status;            // read from status_fd by the io_uring loop
+} pending_spawn_t;
+
+// Per-client state; requests on a connection are served in order
+typedef struct connection {
+    event_kind_t kind;
+    int fd;
+    connection_state_t state;
+    uint32_t interest;     // events the socket is watched for
+    int closed;            // freed at the end of the wakeup
+    struct connection *next_closed;
+    message_t request;
+    size_t request_offset;
+    int request_fds[MAX_FDS_PER_MESSAGE];
+    int request_fd_count;
+    message_t response;
+    size_t response_offset;
+    int response_fds[MAX_FDS_PER_MESSAGE];  // pidfds sent with the response
+    int response_fd_count;
+    // Outcome of each entry of the request; pidfd is -1 if it failed
+    batch_result_t batch_results[MAX_BATCH_SIZE];
+    int entry_pidfds[MAX_BATCH_SIZE];
+    pending_spawn_t spawns[MAX_BATCH_SIZE];
+    int spawn_count;
+    int pending;           // spawns still waiting for their exec
+    // Exits to report (SPAWN_OPT_NOTIFY_EXIT), sent between responses
+    process_exited_msg_t *exits;
+    int exit_head;
+    int exit_count;
+    int exit_capacity;
+    int watched;           // children reporting their exit here
+    // Timestamps of the request in progress, for the stage histograms
+    uint64_t recv_start;   // first bytes seen
+    uint64_t request_read;
+    uint64_t response_ready;
+    int reporting;         // the response is an exit report
+    stats_text_t stats_text;  // MSG_STATS payload
+    // MSG_STORED_FDS payload: copies of the entries, whose names and
+    // metadata live in store_snapshot
+    stored_fds_t stored_entries[MAX_BATCH_SIZE];
+    void *store_snapshot;
+    int inflight;          // io_uring operations for it still in flight
+#ifdef HOLDEN_IO_URING
+    // The io_uring loop keeps a receive in flight except while spawning,
+    // and a send while writing; a request that arrives while the previous
+    // response is still going out waits in request_ready
+    int receiving;
+    int request_ready;
+    struct msghdr recv_msg;
+    struct iovec recv_iov;
+    fd_control_t recv_control;
+    struct msghdr send_msg;
+    struct iovec send_iov;
+    fd_control_t send_control;
+#endif
+} connection_t;
+
+// Where a request spends its time: reading it, creating each process,
+// waiting for each exec, sending the reply, and all of it together
+typedef enum {
+    STAGE_RECV,
+    STAGE_FORK,
+    STAGE_EXEC,
+    STAGE_REPLY,
+    STAGE_REQUEST,
+    STAGE_COUNT
+} stage_t;
+
+static const char *const stage_names[STAGE_COUNT] = {
+    "recv", "fork", "exec", "reply", "request",
+};
+
+// Request path instrumentation, served by MSG_GET_STATS and the stats
+// socket
+static struct {
+    uint64_t connections_accepted;
+    uint64_t connections_closed;
+    uint64_t accept_pauses;        // times the connection cap was reached
+    uint64_t requests;
+    uint64_t request_errors;       // error replies, spawn failures included
+    uint64_t spawns;
+    uint64_t spawn_failures;       // before or at exec
+    uint64_t exits_reported;
+    uint64_t pending_spawns;       // gauge
+    // Connections accepted per wakeup of the listener: how deep the
+    // accept queue had grown
+    stats_histogram_t accept_batch;
+    stats_histogram_t stages[STAGE_COUNT];
+} agent_stats;
+
+// Per-process cgroups, with ENABLE_CGROUPS in agent.conf. cgroup v2
+// can't rename cgroups, so each is named by a serial number.
+static int cgroup_base_fd = -1;
+static unsigned int cgroup_serial = 0;
+
+// A child of the agent. The worker that started it watches a duplicate
+// of its pidfd and reaps it once it has exited, then removes its cgroup
+// and reports its exit to the client that asked for it, if any.
+typedef struct {
+    event_kind_t kind;
     pid_t pid;
+    int pidfd;              // -1 until watched
+    int has_cgroup;
+    unsigned int serial;    // of the cgroup
+    connection_t *notify;   // NULL once the client is gone
+} child_t;
 
-    // Reap all available zombie children
-    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
-        // Child reaped, no action needed since caller manages processes via pidfds
-    }
+// A worker thread, with its own epoll instance (or io_uring),
+// connections and children. Every worker watches the listening socket
+// with EPOLLEXCLUSIVE (or keeps an accept in flight on it), so a new
+// client wakes one idle worker, which serves it from then on; workers
+// share nothing else but the pools and the statistics.
+typedef struct {
+    pthread_t thread;
+    int epfd;
+    int uring;             // served by run_uring_loop() rather than epoll
+#ifdef HOLDEN_IO_URING
+    uring_t ring;
+    int multishot;         // multishot accept and poll (Linux 5.19)
+    int accept_armed;      // an accept is in flight on the listener
+#endif
+    int listenfd;
+    int statsfd;
+    int max_connections;   // this worker's share
+    int nconnections;
+    int accepting;
+    void *children;        // tsearch() tree of child_t keyed by pid
+    // Events of this wakeup may still point to a closed connection or
+    // its spawns, so it's only freed once they've been handled
+    connection_t *closed_connections;
+    stats_text_t stats_text;  // for the stats socket
+} worker_t;
+
+int compare_children(const void *a, const void *b) {
+    pid_t pa = ((const child_t *)a)->pid;
+    pid_t pb = ((const child_t *)b)->pid;
+    return (pa > pb) - (pa < pb);
 }
 
+void cgroup_name(char *name, size_t size, unsigned int serial) {
+    snprintf(name, size, "%d-%u", getpid(), serial);
+}
+
+#define DEFAULT_CGROUP_BASE "/sys/fs/cgroup/holden"
+
+typedef struct {
+    int enable_cgroups;
+    long workers;            // 0: one per CPU
+    char cgroup_base[256];
+    char stats_socket[108];  // sun_path; empty for none
+    long fd_store_max;       // 0: no descriptor store
+} agent_config_t;
+
+// Prestarted process pools, one per [profile] section of agent.conf,
+// shared by the workers
+static pool_t *pools = NULL;
+static int pool_count = 0;
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Descriptors clients deposit to get back after a restart, shared by the
+// workers
+static fdstore_t fd_store;
+static pthread_mutex_t fd_store_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static const char *current_socket_path = NULL;
+static const char *current_stats_path = NULL;
 
-// pidfd_open system call wrapper
-int pidfd_open(pid_t pid, unsigned int flags) {
-    return syscall(SYS_pidfd_open, pid, flags);
+// Name of what a request starts, for messages
+const char *request_name(const start_process_msg_t *req) {
+    return req->options & SPAWN_OPT_PROFILE ? req->profile : req->argv[0];
 }
 
-// Send file descriptor over Unix socket
-int send_fd(int socket, int fd) {
-    struct msghdr msg = {0};
-    struct cmsghdr *cmsg;
-    char buf[CMSG_SPACE(sizeof(int))];
-    char data = 'x';
-    struct iovec iov = {.iov_base = &data, .iov_len = 1};
+pool_t *find_pool(const char *name) {
+    for (int i = 0; i < pool_count; i++) {
+        if (strcmp(pools[i].name, name) == 0) {
+            return &pools[i];
+        }
+    }
+    return NULL;
+}
 
-    msg.msg_iov = &iov;
-    msg.msg_iovlen = 1;
-    msg.msg_control = buf;
-    msg.msg_controllen = sizeof(buf);
+// How often parked processes are checked for having died
+#define POOL_PRUNE_INTERVAL_US 1000000
 
-    cmsg = CMSG_FIRSTHDR(&msg);
-    cmsg->cmsg_level = SOL_SOCKET;
-    cmsg->cmsg_type = SCM_RIGHTS;
-    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
-    *(int*)CMSG_DATA(cmsg) = fd;
+// Bring every pool back to its size. Runs after the replies of a
+// wakeup have been sent, so refilling stays off the request path; a
+// worker finding another one refilling leaves it to it.
+void refill_pools(void) {
+    static uint64_t last_prune = 0;
+    if (pool_count == 0 || pthread_mutex_trylock(&pools_lock) != 0) {
+        return;
+    }
+    uint64_t now = stats_now_us();
+    int prune = now - last_prune >= POOL_PRUNE_INTERVAL_US;
+    if (prune) {
+        last_prune = now;
+    }
+    for (int i = 0; i < pool_count; i++) {
+        if (prune) {
+            pool_prune(&pools[i]);
+        }
+        if (pools[i].count < pools[i].size) {
+            pool_fill(&pools[i]);
+        }
+    }
+    pthread_mutex_unlock(&pools_lock);
+}
 
-    return sendmsg(socket, &msg, 0);
+// Translate the process setup options of req into attr, using rlimits
+// and affinity as storage. Returns 0, or -1 with errno set if a value
+// is out of range.
+int request_setup(const start_process_msg_t *req, spawn_attr_t *attr,
+                  spawn_rlimit_t *rlimits, cpu_set_t *affinity) {
+    if (req->options & SPAWN_OPT_ENV) {
+        attr->envp = req->envp;
+    }
+    if (req->options & SPAWN_OPT_CWD) {
+        attr->cwd = req->cwd;
+    }
+    if (req->options & SPAWN_OPT_CREDENTIALS) {
+        attr->flags |= SPAWN_CREDENTIALS;
+        attr->uid = req->uid;
+        attr->gid = req->gid;
+    }
+    if (req->options & SPAWN_OPT_RLIMITS) {
+        for (uint32_t i = 0; i < req->rlimit_count; i++) {
+            rlimits[i].resource = req->rlimits[i].resource;
+            rlimits[i].limit.rlim_cur = req->rlimits[i].soft;
+            rlimits[i].limit.rlim_max = req->rlimits[i].hard;
+        }
+        attr->rlimits = rlimits;
+        attr->rlimit_count = req->rlimit_count;
+    }
+    if (req->options & SPAWN_OPT_NICE) {
+        attr->flags |= SPAWN_NICE;
+        attr->nice = req->nice;
+    }
+    if (req->options & SPAWN_OPT_IOPRIO) {
+        attr->flags |= SPAWN_IOPRIO;
+        attr->ioprio = req->ioprio;
+    }
+    if (req->options & SPAWN_OPT_AFFINITY) {
+        CPU_ZERO(affinity);
+        for (uint32_t i = 0; i < req->cpu_count; i++) {
+            if (req->cpus[i] >= CPU_SETSIZE) {
+                errno = EINVAL;
+                return -1;
+            }
+            CPU_SET(req->cpus[i], affinity);
+        }
+        attr->affinity = affinity;
+    }
+    if (req->options & SPAWN_OPT_LISTEN_FDS) {
+        attr->listen_fds = req->listen_fds;
+    }
+    return 0;
 }
 
-int start_process(int sockfd, const start_process_msg_t *req, message_t *response) {
-    pid_t pid = fork();
+// Spawn one process, fds holding the descriptors announced in req.
+// Requests with resource limits get a cgroup of their own, removed
+// when the process has exited. Returns its pidfd, or -1 with errno set.
+// Unless *status_fd is -1, the exec is still in flight and reports on
+// it, see spawn_status().
+int spawn_request(worker_t *worker, const start_process_msg_t *req, const int *fds,
+                  pid_t *pid, int *status_fd) {
+    *status_fd = -1;
+    if (req->options & SPAWN_OPT_PROFILE) {
+        // A pooled process is already running: nothing to install in it
+        pool_t *pool = find_pool(req->profile);
+        if (pool == NULL) {
+            errno = ENOENT;
+            return -1;
+        }
+        if (req->fd_count > 0 ||
+            (req->options & ~(SPAWN_OPT_PROFILE | SPAWN_OPT_NOTIFY_EXIT))) {
+            errno = EINVAL;
+            return -1;
+        }
+        pthread_mutex_lock(&pools_lock);
+        int pidfd = pool_take(pool, pid);
+        int saved_errno = errno;
+        pthread_mutex_unlock(&pools_lock);
+        errno = saved_errno;
+        return pidfd;
+    }
 
-    if (pid == -1) {
-        response->header.type = MSG_PROCESS_ERROR;
-        response->header.length = sizeof(process_error_msg_t);
-        snprintf(response->data.process_error.error, MAX_ERROR_MSG,
-                "Failed to fork: %s", strerror(errno));
-        return 0;
+    spawn_fd_t child_fds[MAX_PASSED_FDS];
+    for (uint32_t i = 0; i < req->fd_count; i++) {
+        if (req->fd_targets[i] < 0) {
+            errno = EBADF;
+            return -1;
+        }
+        child_fds[i].fd = fds[i];
+        child_fds[i].target = req->fd_targets[i];
     }
 
-    if (pid == 0) {
-        // Child process: close inherited file descriptors and exec
-        for (int fd = 3; fd < 1024; fd++) {
-            close(fd);
+    spawn_attr_t attr = {
+        .file = req->argv[0],
+        .argv = req->argv,
+        .fds = child_fds,
+        .fd_count = req->fd_count,
+    };
+
+    spawn_rlimit_t rlimits[MAX_SPAWN_RLIMITS];
+    cpu_set_t affinity;
+    if (request_setup(req, &attr, rlimits, &affinity) == -1) {
+        return -1;
+    }
+
+    child_t *child = NULL;
+    char name[32];
+    if (req->options & (SPAWN_OPT_MEMORY_MAX | SPAWN_OPT_CPU_MAX | SPAWN_OPT_PIDS_MAX)) {
+        if (cgroup_base_fd == -1) {
+            errno = EOPNOTSUPP;  // ENABLE_CGROUPS is off
+            return -1;
+        }
+        cgroup_limits_t limits = {0};
+        if (req->options & SPAWN_OPT_MEMORY_MAX) {
+            limits.memory_max = req->memory_max;
+        }
+        if (req->options & SPAWN_OPT_CPU_MAX) {
+            limits.cpu_quota = req->cpu_quota;
+            limits.cpu_period = req->cpu_period;
+        }
+        if (req->options & SPAWN_OPT_PIDS_MAX) {
+            limits.pids_max = req->pids_max;
         }
 
-        char *args[MAX_ARGS + 2];
-        args[0] = (char*)req->name;
+        child = calloc(1, sizeof(*child));
+        if (child == NULL) {
+            return -1;
+        }
+        child->kind = EVENT_CHILD;
+        child->pidfd = -1;
+        child->has_cgroup = 1;
+        child->serial = __atomic_fetch_add(&cgroup_serial, 1, __ATOMIC_RELAXED);
+        cgroup_name(name, sizeof(name), child->serial);
+        attr.cgroup_fd = cgroup_create(cgroup_base_fd, name, &limits);
+        if (attr.cgroup_fd == -1) {
+            int saved_errno = errno;
+            fprintf(stderr, "Failed to set up cgroup for %s: %s\n", request_name(req),
+                    strerror(errno));
+            free(child);
+            errno = saved_errno;
+            return -1;
+        }
+        attr.flags |= SPAWN_CGROUP;
+    }
 
-        for (int i = 0; i < req->arg_count && i < MAX_ARGS; i++) {
-            args[i + 1] = (char*)req->args[i];
+    int pidfd = spawn_process_async(&attr, pid, status_fd);
+    if (child != NULL) {
+        int saved_errno = errno;
+        close(attr.cgroup_fd);
+        if (pidfd == -1) {
+            cgroup_remove(cgroup_base_fd, name);
+            free(child);
+        } else {
+            child->pid = *pid;
+            if (tsearch(child, &worker->children, compare_children) == NULL) {
+                free(child);  // can't track it, the cgroup will stay behind
+            }
         }
-        args[req->arg_count + 1] = NULL;
+        errno = saved_errno;
+    }
+    return pidfd;
+}
+
+void set_error(message_t *response, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+void set_error(message_t *response, const char *format, ...) {
+    va_list ap;
 
-        execvp(req->name, args);
-        fprintf(stderr, "Failed to exec %s: %s\n", req->name, strerror(errno));
-        _exit(1);
+    response->header.type = MSG_PROCESS_ERROR;
+    va_start(ap, format);
+    vsnprintf(response->data.process_error.error, MAX_ERROR_MSG, format, ap);
+    va_end(ap);
+}
+
+#ifdef HOLDEN_IO_URING
+// Submission entries of a worker's ring
+#define URING_ENTRIES 256
+
+// io_uring user_data is the connection, pending spawn or child an
+// operation is for, told apart by their kind, with URING_SEND set on a
+// connection's sends. Accepts, the stats socket's poll and cancellations
+// carry the address of the worker's listenfd, statsfd and ring.
+#define URING_SEND 1
+
+struct io_uring_sqe *uring_sqe(worker_t *worker, int opcode, int fd, uint64_t user_data) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&worker->ring);
+    if (sqe == NULL) {
+        perror("io_uring");
+        return NULL;
     }
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = user_data;
+    return sqe;
+}
 
-    // Parent: get pidfd for the child
-    int pidfd = pidfd_open(pid, 0);
-    if (pidfd == -1) {
-        response->header.type = MSG_PROCESS_ERROR;
-        response->header.length = sizeof(process_error_msg_t);
-        snprintf(response->data.process_error.error, MAX_ERROR_MSG,
-                "Failed to open pidfd for process %d: %s", pid, strerror(errno));
-        return 0;
+// Poll fd for input, once or, with multishot, until cancelled
+int uring_poll(worker_t *worker, int fd, uint64_t user_data, int multishot) {
+    struct io_uring_sqe *sqe = uring_sqe(worker, IORING_OP_POLL_ADD, fd, user_data);
+    if (sqe == NULL) {
+        return -1;
     }
+    sqe->poll32_events = POLLIN;
+    sqe->len = multishot ? IORING_POLL_ADD_MULTI : 0;
+    return 0;
+}
 
-    // Prepare success response first
-    response->header.type = MSG_PROCESS_STARTED;
-    response->header.length = sizeof(process_started_msg_t);
-    response->data.process_started.host_pid = pid;
-    response->data.process_started.container_pid = pid;
+// Read the exec outcome of a pending spawn into spawn->status
+int uring_read_status(worker_t *worker, pending_spawn_t *spawn) {
+    struct io_uring_sqe *sqe = uring_sqe(worker, IORING_OP_READ, spawn->status_fd,
+                                         (uintptr_t)spawn);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->addr = (uintptr_t)&spawn->status;
+    sqe->len = sizeof(spawn->status);
+    sqe->off = (uint64_t)-1;
+    spawn->conn->inflight++;
+    return 0;
+}
 
-    // Send the response first
-    if (send_message(sockfd, response) == -1) {
-        close(pidfd);
-        response->header.type = MSG_PROCESS_ERROR;
-        response->header.length = sizeof(process_error_msg_t);
-        snprintf(response->data.process_error.error, MAX_ERROR_MSG,
-                "Failed to send response: %s", strerror(errno));
-        return 0;
+// Receive the rest of the request the connection is reading
+int uring_recv(worker_t *worker, connection_t *conn) {
+    if (message_recv_prepare(&conn->request, conn->request_offset, &conn->recv_msg,
+                             &conn->recv_iov, &conn->recv_control) == -1) {
+        return -1;
+    }
+    struct io_uring_sqe *sqe = uring_sqe(worker, IORING_OP_RECVMSG, conn->fd,
+                                         (uintptr_t)conn);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->addr = (uintptr_t)&conn->recv_msg;
+    sqe->msg_flags = MSG_CMSG_CLOEXEC;
+    conn->receiving = 1;
+    conn->inflight++;
+    return 0;
+}
+
+// Send the rest of the response, its pidfds with the first byte
+int uring_send(worker_t *worker, connection_t *conn) {
+    if (message_send_prepare(&conn->response, conn->response_offset, conn->response_fds,
+                             conn->response_fd_count, &conn->send_msg, &conn->send_iov,
+                             &conn->send_control) == -1) {
+        return -1;
+    }
+    struct io_uring_sqe *sqe = uring_sqe(worker, IORING_OP_SENDMSG, conn->fd,
+                                         (uintptr_t)conn | URING_SEND);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->addr = (uintptr_t)&conn->send_msg;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    conn->inflight++;
+    return 0;
+}
+
+// Send the response that is ready, and unless a request is already
+// waiting, have the next one received in the same submission
+int uring_respond(worker_t *worker, connection_t *conn) {
+    if (uring_send(worker, conn) == -1) {
+        return -1;
+    }
+    if (!conn->receiving && !conn->request_ready) {
+        return uring_recv(worker, conn);
+    }
+    return 0;
+}
+#endif
+
+// Watch fd for input, with events pointing to ptr: registered with
+// epoll, or as a one-shot poll on the worker's ring
+int watch_input(worker_t *worker, int fd, void *ptr) {
+#ifdef HOLDEN_IO_URING
+    if (worker->uring) {
+        return uring_poll(worker, fd, (uintptr_t)ptr, 0);
+    }
+#endif
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN;
+    ev.data.ptr = ptr;
+    return epoll_ctl(worker->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+// Stop watching fd. io_uring operations end by themselves.
+void unwatch_fd(worker_t *worker, int fd) {
+    if (!worker->uring) {
+        epoll_ctl(worker->epfd, EPOLL_CTL_DEL, fd, NULL);
+    }
+}
+
+// Learn the exec outcome of a pending spawn: when epoll reports its
+// status pipe readable, or straight from a read on the ring
+int watch_spawn(worker_t *worker, pending_spawn_t *spawn) {
+#ifdef HOLDEN_IO_URING
+    if (worker->uring) {
+        return uring_read_status(worker, spawn);
+    }
+#endif
+    return watch_input(worker, spawn->status_fd, spawn);
+}
+
+// Watch a new child through a duplicate of its pidfd, so that the
+// worker reaps it once it has exited. It may already have a record, if
+// it has a cgroup. Returns the record, or NULL if the child can't be
+// watched; it then stays a zombie until the agent exits.
+child_t *watch_child(worker_t *worker, pid_t pid, int pidfd) {
+    child_t key = {.pid = pid};
+    child_t **found = tfind(&key, &worker->children, compare_children);
+    child_t *child = found != NULL ? *found : calloc(1, sizeof(*child));
+    if (child == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    if (found == NULL) {
+        child->kind = EVENT_CHILD;
+        child->pid = pid;
+        if (tsearch(child, &worker->children, compare_children) == NULL) {
+            perror("tsearch");
+            free(child);
+            return NULL;
+        }
+    }
+
+    child->pidfd = fcntl(pidfd, F_DUPFD_CLOEXEC, 0);
+    if (child->pidfd == -1 || watch_input(worker, child->pidfd, child) == -1) {
+        perror("watch_child");
+        if (child->pidfd != -1) {
+            close(child->pidfd);
+            child->pidfd = -1;
+        }
+        return NULL;
+    }
+    return child;
+}
+
+void unwatch_exit(worker_t *worker, connection_t *conn, pid_t pid) {
+    child_t key = {.pid = pid};
+    child_t **found = tfind(&key, &worker->children, compare_children);
+    if (found != NULL && (*found)->notify == conn) {
+        (*found)->notify = NULL;
+        conn->watched--;
+    }
+}
+
+// Start entry index of the current request. Its outcome is final
+// unless the exec is still in flight, then it's settled by
+// spawn_finished().
+void start_entry(worker_t *worker, connection_t *conn, uint32_t index,
+                 const start_process_msg_t *req, const int *fds) {
+    batch_result_t *result = &conn->batch_results[index];
+    pid_t pid = 0;
+    int status_fd;
+    uint64_t start = stats_now_us();
+    int pidfd = spawn_request(worker, req, fds, &pid, &status_fd);
+    uint64_t spawned = stats_now_us();
+
+    stats_observe(&agent_stats.stages[STAGE_FORK], spawned - start);
+    result->error = pidfd == -1 ? errno : 0;
+    result->host_pid = pid;
+    result->container_pid = pid;
+    conn->entry_pidfds[index] = pidfd;
+    child_t *child = pidfd != -1 ? watch_child(worker, pid, pidfd) : NULL;
+    if (child != NULL && (req->options & SPAWN_OPT_NOTIFY_EXIT)) {
+        child->notify = conn;
+        conn->watched++;
+    }
+    if (status_fd == -1) {
+        stats_add(pidfd == -1 ? &agent_stats.spawn_failures : &agent_stats.spawns, 1);
+        return;
+    }
+
+    pending_spawn_t *spawn = &conn->spawns[conn->spawn_count];
+    spawn->kind = EVENT_SPAWN;
+    spawn->conn = conn;
+    spawn->status_fd = status_fd;
+    spawn->index = index;
+    spawn->started = spawned;
+    if (watch_spawn(worker, spawn) == 0) {
+        conn->spawn_count++;
+        conn->pending++;
+        stats_add(&agent_stats.pending_spawns, 1);
+        return;
     }
 
-    // Then send the pidfd via fd passing
-    if (send_fd(sockfd, pidfd) == -1) {
+    // Can't watch it: wait for the exec here
+    perror("watch_spawn");
+    int error;
+    struct pollfd pfd = {.fd = status_fd, .events = POLLIN};
+    while (poll(&pfd, 1, -1) == -1 && errno == EINTR) {
+    }
+    if (spawn_status(status_fd, &error) != 1) {
+        error = errno;
+    }
+    close(status_fd);
+    stats_observe(&agent_stats.stages[STAGE_EXEC], stats_now_us() - spawned);
+    if (error != 0) {
         close(pidfd);
-        // Can't send error response now since we already sent success
-        // The orchestrator will get an error when trying to recv_fd
+        conn->entry_pidfds[index] = -1;
+        result->error = error;
+        unwatch_exit(worker, conn, pid);
+    }
+    stats_add(error != 0 ? &agent_stats.spawn_failures : &agent_stats.spawns, 1);
+}
+
+// Build the response once every entry of the request has its outcome:
+// the process and its pidfd, or for a batch all outcomes in one reply
+// with the pidfds of the entries that started
+void finish_request(connection_t *conn) {
+    const message_t *request = &conn->request;
+    message_t *response = &conn->response;
+
+    conn->spawn_count = 0;
+    if (request->header.type == MSG_START_PROCESS) {
+        const batch_result_t *result = &conn->batch_results[0];
+        if (result->error != 0) {
+            set_error(response, "Failed to spawn %s: %s",
+                      request_name(&request->data.start_process), strerror(result->error));
+            return;
+        }
+        response->header.type = MSG_PROCESS_STARTED;
+        response->data.process_started.host_pid = result->host_pid;
+        response->data.process_started.container_pid = result->container_pid;
+        conn->response_fds[conn->response_fd_count++] = conn->entry_pidfds[0];
+        return;
+    }
+
+    batch_started_msg_t *reply = &response->data.batch_started;
+    response->header.type = MSG_BATCH_STARTED;
+    reply->count = request->data.start_batch.count;
+    reply->results = conn->batch_results;
+    for (uint32_t i = 0; i < reply->count; i++) {
+        if (conn->entry_pidfds[i] != -1) {
+            conn->response_fds[conn->response_fd_count++] = conn->entry_pidfds[i];
+        }
+    }
+}
+
+// Render agent_stats in the Prometheus text format. Returns 0, or -1 if
+// out of memory.
+int format_stats(stats_text_t *text) {
+    static const struct {
+        const char *name;
+        const char *help;
+        uint64_t *value;
+    } counters[] = {
+        {"holden_agent_connections_accepted_total", "Client connections accepted",
+         &agent_stats.connections_accepted},
+        {"holden_agent_connections_closed_total", "Client connections closed",
+         &agent_stats.connections_closed},
+        {"holden_agent_accept_pauses_total",
+         "Times accepting stopped at the connection limit", &agent_stats.accept_pauses},
+        {"holden_agent_requests_total", "Requests received", &agent_stats.requests},
+        {"holden_agent_request_errors_total", "Requests answered with an error",
+         &agent_stats.request_errors},
+        {"holden_agent_spawns_total", "Processes started", &agent_stats.spawns},
+        {"holden_agent_spawn_failures_total",
+         "Processes that failed to start, exec failures included",
+         &agent_stats.spawn_failures},
+        {"holden_agent_exits_reported_total", "Exit reports queued to clients",
+         &agent_stats.exits_reported},
+    };
+
+    text->length = 0;
+    for (size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); i++) {
+        if (stats_put_header(text, counters[i].name, "counter", counters[i].help) == -1 ||
+            stats_put_value(text, counters[i].name, NULL, stats_read(counters[i].value)) == -1) {
+            return -1;
+        }
+    }
+
+    uint64_t open = stats_read(&agent_stats.connections_accepted) -
+                    stats_read(&agent_stats.connections_closed);
+    if (stats_put_header(text, "holden_agent_connections", "gauge",
+                         "Client connections open") == -1 ||
+        stats_put_value(text, "holden_agent_connections", NULL, open) == -1 ||
+        stats_put_header(text, "holden_agent_pending_spawns", "gauge",
+                         "Processes whose exec hasn't reported yet") == -1 ||
+        stats_put_value(text, "holden_agent_pending_spawns", NULL,
+                        stats_read(&agent_stats.pending_spawns)) == -1 ||
+        stats_put_header(text, "holden_agent_accept_batch", "histogram",
+                         "Connections accepted per wakeup of the listener") == -1 ||
+        stats_put_histogram(text, "holden_agent_accept_batch", NULL,
+                            &agent_stats.accept_batch, 1) == -1 ||
+        stats_put_header(text, "holden_agent_stage_seconds", "histogram",
+                         "Time spent per request stage") == -1) {
         return -1;
     }
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        char labels[32];
+        snprintf(labels, sizeof(labels), "stage=\"%s\"", stage_names[i]);
+        if (stats_put_histogram(text, "holden_agent_stage_seconds", labels,
+                                &agent_stats.stages[i], 1e-6) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
 
-    close(pidfd); // We've passed it, don't need our copy
+// MSG_STORE_FDS: the store takes over the descriptors of the request
+void store_fds(connection_t *conn) {
+    const stored_fds_t *entry = &conn->request.data.store_fds;
+    message_t *response = &conn->response;
 
-    // Return 1 to indicate we already sent the response
-    return 1;
+    pthread_mutex_lock(&fd_store_lock);
+    int result = fdstore_put(&fd_store, entry->name, conn->request_fds,
+                             conn->request_fd_count, entry->metadata,
+                             entry->metadata_length);
+    int saved_errno = errno;
+    pthread_mutex_unlock(&fd_store_lock);
+    conn->request_fd_count = 0;
+
+    if (result == -1) {
+        set_error(response, "Failed to store descriptors for %s: %s", entry->name,
+                  saved_errno == ENOSPC ? "the descriptor store is full or disabled" :
+                  strerror(saved_errno));
+        return;
+    }
+    response->header.type = MSG_ACK;
+}
+
+// MSG_RETRIEVE_FDS: as many entries from the requested one on as one
+// reply can carry
+void retrieve_fds(connection_t *conn) {
+    message_t *response = &conn->response;
+    stored_fds_msg_t *reply = &response->data.stored_fds;
+
+    free(conn->store_snapshot);
+    conn->store_snapshot = NULL;
+    pthread_mutex_lock(&fd_store_lock);
+    int max = fd_store.max;
+    int total = fd_store.count;
+    int count = 0;
+    if (conn->request.data.retrieve_fds.first < (uint32_t)total) {
+        count = fdstore_get(&fd_store, conn->request.data.retrieve_fds.first,
+                            conn->stored_entries, MAX_BATCH_SIZE, conn->response_fds,
+                            MAX_FDS_PER_MESSAGE, &conn->store_snapshot);
+    }
+    int saved_errno = errno;
+    pthread_mutex_unlock(&fd_store_lock);
+
+    if (max == 0) {
+        set_error(response, "The descriptor store is disabled");
+        return;
+    }
+    if (count == -1) {
+        set_error(response, "Failed to retrieve descriptors: %s", strerror(saved_errno));
+        return;
+    }
+    response->header.type = MSG_STORED_FDS;
+    reply->total = total;
+    reply->count = count;
+    reply->entries = conn->stored_entries;
+    for (int i = 0; i < count; i++) {
+        conn->response_fd_count += conn->stored_entries[i].fd_count;
+    }
 }
 
-int handle_message(int sockfd, const message_t *request) {
-    message_t response = {0};
+// Build the response for the request just read into conn. Spawns
+// leave the connection CONN_SPAWNING until their execs have reported.
+void handle_message(worker_t *worker, connection_t *conn) {
+    const message_t *request = &conn->request;
+    message_t *response = &conn->response;
+
+    memset(&response->header, 0, sizeof(response->header));
+    memset(&response->data, 0, sizeof(response->data));
+    response->header.request_id = request->header.request_id;
+    conn->response_fd_count = 0;
 
     switch (request->header.type) {
-        case MSG_START_PROCESS: {
-            int result = start_process(sockfd, &request->data.start_process, &response);
-            if (result == 1) {
-                // start_process already sent the response, don't send again
-                return 0;
-            } else if (result == -1) {
-                // Error occurred after response was sent
-                return -1;
+        case MSG_START_PROCESS:
+            start_entry(worker, conn, 0, &request->data.start_process, conn->request_fds);
+            break;
+
+        case MSG_START_BATCH: {
+            const start_batch_msg_t *batch = &request->data.start_batch;
+            const int *fds = conn->request_fds;
+            for (uint32_t i = 0; i < batch->count; i++) {
+                start_entry(worker, conn, i, &batch->processes[i], fds);
+                fds += batch->processes[i].fd_count;
             }
-            // result == 0: error response prepared, send it below
             break;
         }
 
         case MSG_PING:
-            response.header.type = MSG_PONG;
-            response.header.length = 0;
+            response->header.type = MSG_PONG;
+            return;
+
+        case MSG_GET_STATS:
+            if (format_stats(&conn->stats_text) == -1) {
+                set_error(response, "Failed to format statistics: %s", strerror(errno));
+                return;
+            }
+            response->header.type = MSG_STATS;
+            response->data.stats.text = conn->stats_text.data;
+            return;
+
+        case MSG_STORE_FDS:
+            store_fds(conn);
+            return;
+
+        case MSG_RETRIEVE_FDS:
+            retrieve_fds(conn);
+            return;
+
+        default:
+            set_error(response, "Unknown message type: %d", request->header.type);
+            return;
+    }
+
+    if (conn->pending > 0) {
+        conn->state = CONN_SPAWNING;
+    } else {
+        finish_request(conn);
+    }
+}
+
+void close_response_fds(connection_t *conn) {
+    for (int i = 0; i < conn->response_fd_count; i++) {
+        close(conn->response_fds[i]);
+    }
+    conn->response_fd_count = 0;
+}
+
+// The response and its pidfds are out
+void response_sent(connection_t *conn) {
+    close_response_fds(conn); // We've passed them, don't need our copies
+    conn->state = CONN_READING;
+    if (!conn->reporting) {
+        uint64_t now = stats_now_us();
+        stats_observe(&agent_stats.stages[STAGE_REPLY], now - conn->response_ready);
+        stats_observe(&agent_stats.stages[STAGE_REQUEST], now - conn->recv_start);
+    }
+}
+
+// Push the pending response and its pidfds out. Returns 1 when
+// everything has been written, 0 if the socket would block, -1 on error.
+int flush_response(connection_t *conn) {
+    int result = send_message_nb(conn->fd, &conn->response, conn->response_fds,
+                                 conn->response_fd_count, &conn->response_offset);
+    if (result == 1) {
+        response_sent(conn);
+    }
+    return result;
+}
+
+// A whole request has been read
+void request_received(connection_t *conn) {
+    conn->request_offset = 0;
+    conn->request_read = stats_now_us();
+    stats_observe(&agent_stats.stages[STAGE_RECV], conn->request_read - conn->recv_start);
+    stats_add(&agent_stats.requests, 1);
+}
+
+// Read the next request and the descriptors that came with it. Returns
+// 1 once a complete request is available, 0 if the socket would block,
+// -1 on error or EOF.
+int read_request(connection_t *conn) {
+    uint64_t now = stats_now_us();
+    if (conn->request_offset == 0) {
+        conn->recv_start = now;
+    }
+    int result = recv_message_nb(conn->fd, &conn->request, conn->request_fds,
+                                 &conn->request_fd_count, &conn->request_offset);
+    if (result == 1) {
+        request_received(conn);
+    }
+    return result;
+}
+
+void close_request_fds(connection_t *conn) {
+    for (int i = 0; i < conn->request_fd_count; i++) {
+        close(conn->request_fds[i]);
+    }
+    conn->request_fd_count = 0;
+}
+
+// Events the socket should be watched for in the connection's state;
+// while spawning, only hangups until the response is ready
+uint32_t wanted_events(const connection_t *conn) {
+    switch (conn->state) {
+        case CONN_WRITING:
+            return EPOLLOUT;
+        case CONN_SPAWNING:
+            return 0;
+        default:
+            return conn->exit_count > 0 ? EPOLLIN | EPOLLOUT : EPOLLIN;
+    }
+}
+
+int update_interest(worker_t *worker, connection_t *conn) {
+    uint32_t events = wanted_events(conn);
+    if (events == conn->interest) {
+        return 0;
+    }
+
+    struct epoll_event ev = {0};
+    ev.events = events;
+    ev.data.ptr = conn;
+    conn->interest = events;
+    return epoll_ctl(worker->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+// twalk_r() action dropping the exit reports meant for a connection
+void forget_connection(const void *node, VISIT visit, void *conn) {
+    child_t *child = *(child_t *const *)node;
+    if ((visit == postorder || visit == leaf) && child->notify == conn) {
+        child->notify = NULL;
+    }
+}
+
+void close_connection(worker_t *worker, connection_t *conn) {
+#ifdef HOLDEN_IO_URING
+    if (worker->uring) {
+        // Operations still queued get hold of the socket before it's
+        // closed, and all of them fail once it's shut down
+        uring_submit(&worker->ring, 0);
+        shutdown(conn->fd, SHUT_RDWR);
+    }
+#endif
+    unwatch_fd(worker, conn->fd);
+    close(conn->fd);
+    for (int i = 0; i < conn->spawn_count; i++) {
+        pending_spawn_t *spawn = &conn->spawns[i];
+        if (spawn->status_fd != -1) {
+            unwatch_fd(worker, spawn->status_fd);
+            close(spawn->status_fd);
+            stats_add(&agent_stats.pending_spawns, (uint64_t)-1);
+        }
+    }
+    if (conn->state == CONN_SPAWNING) {
+        // Nobody to hand the processes to; the reaper collects them
+        const message_t *request = &conn->request;
+        uint32_t count = request->header.type == MSG_START_BATCH
+                         ? request->data.start_batch.count : 1;
+        for (uint32_t i = 0; i < count; i++) {
+            if (conn->entry_pidfds[i] != -1) {
+                close(conn->entry_pidfds[i]);
+            }
+        }
+    }
+    if (conn->watched > 0) {
+        twalk_r(worker->children, forget_connection, conn);
+    }
+    close_response_fds(conn);
+    close_request_fds(conn);
+    message_free(&conn->request);
+    message_free(&conn->response);
+    free(conn->exits);
+    free(conn->stats_text.data);
+    free(conn->store_snapshot);
+    conn->closed = 1;
+    stats_add(&agent_stats.connections_closed, 1);
+    conn->next_closed = worker->closed_connections;
+    worker->closed_connections = conn;
+    worker->nconnections--;
+}
+
+// The response to the current request is built: send it next
+void response_ready(connection_t *conn) {
+    conn->response_ready = stats_now_us();
+    conn->reporting = 0;
+    conn->response_offset = 0;
+    conn->state = CONN_WRITING;
+    if (conn->response.header.type == MSG_PROCESS_ERROR) {
+        stats_add(&agent_stats.request_errors, 1);
+    }
+}
+
+// Make the oldest queued exit the response to send
+void next_exit_report(connection_t *conn) {
+    message_t *response = &conn->response;
+    memset(&response->header, 0, sizeof(response->header));
+    response->header.type = MSG_PROCESS_EXITED;
+    response->data.process_exited = conn->exits[conn->exit_head++];
+    conn->reporting = 1;
+    if (--conn->exit_count == 0) {
+        conn->exit_head = 0;
+    }
+    conn->response_fd_count = 0;
+    conn->response_offset = 0;
+    conn->state = CONN_WRITING;
+}
+
+// Free the connections closed during this wakeup, except those that
+// io_uring operations still point to
+void free_closed_connections(worker_t *worker) {
+    connection_t **link = &worker->closed_connections;
+    while (*link != NULL) {
+        connection_t *conn = *link;
+        if (conn->inflight > 0) {
+            link = &conn->next_closed;
+            continue;
+        }
+        *link = conn->next_closed;
+        free(conn);
+    }
+}
+
+// Flush the pending response, then read and answer requests until the
+// socket would block, a request waits for its execs, or the per-wakeup
+// limit is reached. Returns -1 when the connection should be closed.
+int serve_requests(worker_t *worker, connection_t *conn) {
+    int handled = 0;
+    while (1) {
+        if (conn->state == CONN_WRITING) {
+            int result = flush_response(conn);
+            if (result != 1) {
+                return result;
+            }
+        }
+
+        // Exits go out between responses, so always after the reply
+        // that started the process
+        if (conn->exit_count > 0) {
+            next_exit_report(conn);
+            continue;
+        }
+
+        if (handled++ == MAX_REQUESTS_PER_WAKEUP) {
+            return 0;
+        }
+        int result = read_request(conn);
+        if (result != 1) {
+            return result;
+        }
+
+        handle_message(worker, conn);
+        close_request_fds(conn);  // the children have their copies
+        if (conn->state == CONN_SPAWNING) {
+            return 0;
+        }
+        response_ready(conn);
+    }
+}
+
+// Drive a connection's read/write state machine. Returns -1 when the
+// connection should be closed.
+int handle_connection_event(worker_t *worker, connection_t *conn, uint32_t events) {
+    if (conn->state == CONN_SPAWNING) {
+        return events & (EPOLLHUP | EPOLLERR) ? -1 : 0;
+    }
+    if (conn->state == CONN_READING && !(events & EPOLLIN) &&
+        (events & (EPOLLHUP | EPOLLERR))) {
+        return -1;
+    }
+
+    if (serve_requests(worker, conn) == -1) {
+        return -1;
+    }
+    return update_interest(worker, conn);
+}
+
+// The exec of a pending spawn has reported error (0 if it succeeded).
+// Returns 1 once the last one of the request has, with the response
+// ready to go out.
+int spawn_reported(worker_t *worker, pending_spawn_t *spawn, int error) {
+    connection_t *conn = spawn->conn;
+    close(spawn->status_fd);
+    spawn->status_fd = -1;
+    stats_add(&agent_stats.pending_spawns, (uint64_t)-1);
+    stats_observe(&agent_stats.stages[STAGE_EXEC], stats_now_us() - spawn->started);
+    if (error != 0) {
+        // The child exits with 127 and is reaped like any other, but the
+        // client never learns about it
+        batch_result_t *result = &conn->batch_results[spawn->index];
+        close(conn->entry_pidfds[spawn->index]);
+        conn->entry_pidfds[spawn->index] = -1;
+        result->error = error;
+        unwatch_exit(worker, conn, result->host_pid);
+    }
+    stats_add(error != 0 ? &agent_stats.spawn_failures : &agent_stats.spawns, 1);
+    if (--conn->pending > 0) {
+        return 0;
+    }
+
+    finish_request(conn);
+    response_ready(conn);
+    return 1;
+}
+
+// The status pipe of a pending spawn became readable. Once the last
+// exec of the request has reported, the response goes out and the
+// connection moves on. Returns -1 when the connection should be closed.
+int spawn_finished(worker_t *worker, pending_spawn_t *spawn) {
+    connection_t *conn = spawn->conn;
+    int error;
+    int result = spawn_status(spawn->status_fd, &error);
+    if (result == 0) {
+        return 0;
+    }
+    if (result == -1) {
+        error = errno;
+    }
+
+    epoll_ctl(worker->epfd, EPOLL_CTL_DEL, spawn->status_fd, NULL);
+    if (!spawn_reported(worker, spawn, error)) {
+        return 0;
+    }
+    if (serve_requests(worker, conn) == -1) {
+        return -1;
+    }
+    return update_interest(worker, conn);
+}
+
+// State for a client just accepted, or NULL if out of memory
+connection_t *new_connection(int clientfd) {
+    connection_t *conn = calloc(1, sizeof(*conn));
+    if (conn == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+    conn->kind = EVENT_CONNECTION;
+    conn->fd = clientfd;
+    conn->state = CONN_READING;
+    conn->interest = EPOLLIN;
+    return conn;
+}
+
+// Accept as many pending clients as the worker's share of the
+// connection cap allows
+void accept_connections(worker_t *worker) {
+    int accepted = 0;
+    while (worker->nconnections < worker->max_connections) {
+        int clientfd = accept4(worker->listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (clientfd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("accept");
+            }
             break;
+        }
+
+        connection_t *conn = new_connection(clientfd);
+        if (conn == NULL) {
+            close(clientfd);
+            continue;
+        }
+
+        struct epoll_event ev = {0};
+        ev.events = EPOLLIN;
+        ev.data.ptr = conn;
+        if (epoll_ctl(worker->epfd, EPOLL_CTL_ADD, clientfd, &ev) == -1) {
+            perror("epoll_ctl");
+            close(clientfd);
+            free(conn);
+            continue;
+        }
+        worker->nconnections++;
+        accepted++;
+    }
+    stats_add(&agent_stats.connections_accepted, accepted);
+    stats_observe(&agent_stats.accept_batch, accepted);
+}
+
+uint64_t timeval_us(const struct timeval *tv) {
+    return (uint64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+// Queue the exit of a watched child for its connection
+void queue_exit(worker_t *worker, connection_t *conn, pid_t pid, int status,
+                const struct rusage *usage) {
+    if (conn->exit_head + conn->exit_count == conn->exit_capacity) {
+        int capacity = conn->exit_capacity ? conn->exit_capacity * 2 : 16;
+        process_exited_msg_t *exits = realloc(conn->exits, capacity * sizeof(*exits));
+        if (exits == NULL) {
+            perror("realloc");
+            return;
+        }
+        conn->exits = exits;
+        conn->exit_capacity = capacity;
+    }
+
+    process_exited_msg_t *exited = &conn->exits[conn->exit_head + conn->exit_count++];
+    exited->pid = pid;
+    exited->status = status;
+    exited->utime_us = timeval_us(&usage->ru_utime);
+    exited->stime_us = timeval_us(&usage->ru_stime);
+    exited->maxrss_kb = usage->ru_maxrss;
+    stats_add(&agent_stats.exits_reported, 1);
+#ifdef HOLDEN_IO_URING
+    if (worker->uring) {
+        // An idle connection sends it right away, others once they're done
+        if (conn->state == CONN_READING) {
+            next_exit_report(conn);
+            if (uring_respond(worker, conn) == -1) {
+                close_connection(worker, conn);
+            }
+        }
+        return;
+    }
+#endif
+    update_interest(worker, conn);
+}
+
+// A child's pidfd became readable: reap it, remove its cgroup and
+// report its exit with its resource usage to the client that asked for
+// it. Only this child is waited for, so workers never reap each other's.
+void reap_child(worker_t *worker, child_t *child) {
+    // waitid() only returns the resource usage through the raw system call
+    siginfo_t info = {0};
+    struct rusage usage;
+    if (syscall(SYS_waitid, P_PIDFD, child->pidfd, &info, WEXITED | WNOHANG,
+                &usage) == -1) {
+        perror("waitid");
+    } else if (info.si_pid == 0) {
+        // Not exited after all; io_uring polls are one-shot
+        if (worker->uring && watch_input(worker, child->pidfd, child) == -1) {
+            perror("watch_input");
+        }
+        return;
+    }
+
+    if (child->has_cgroup) {
+        char name[32];
+        cgroup_name(name, sizeof(name), child->serial);
+        if (cgroup_remove(cgroup_base_fd, name) == -1) {
+            fprintf(stderr, "Failed to remove cgroup %s: %s\n", name,
+                    strerror(errno));
+        }
+    }
+    if (child->notify != NULL && info.si_pid != 0) {
+        int status = info.si_code == CLD_EXITED ? (info.si_status & 0xff) << 8 :
+                     (info.si_status & 0x7f) | (info.si_code == CLD_DUMPED ? 0x80 : 0);
+        child->notify->watched--;
+        queue_exit(worker, child->notify, child->pid, status, &usage);
+    }
+    unwatch_fd(worker, child->pidfd);
+    close(child->pidfd);
+    tdelete(child, &worker->children, compare_children);
+    free(child);
+}
+
+// Each client of the stats socket gets the current statistics and is
+// disconnected. The dump fits in the socket buffer, so it is written in
+// one go or not at all.
+void serve_stats(worker_t *worker) {
+    stats_text_t *text = &worker->stats_text;
+    int clientfd;
+    while ((clientfd = accept4(worker->statsfd, NULL, NULL,
+                               SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+        if (format_stats(text) == 0 &&
+            send(clientfd, text->data, text->length, MSG_NOSIGNAL) != (ssize_t)text->length) {
+            fprintf(stderr, "Failed to send statistics\n");
+        }
+        close(clientfd);
+    }
+}
+
+// Watch the listening socket (ptr NULL) or the stats socket, shared by
+// all workers. EPOLLEXCLUSIVE wakes one waiting worker per new client
+// rather than all of them.
+int watch_listener(worker_t *worker, int fd, void *ptr) {
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.ptr = ptr;
+    return epoll_ctl(worker->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+// Serve clients concurrently from the worker's epoll loop. The listening
+// socket is only watched while below the worker's share of the
+// connection cap; further clients go to other workers, or wait in the
+// listen backlog until a slot frees up.
+int run_event_loop(worker_t *worker) {
+    if (watch_listener(worker, worker->listenfd, NULL) == -1 ||
+        (worker->statsfd != -1 &&
+         watch_listener(worker, worker->statsfd, &agent_stats) == -1)) {
+        perror("epoll_ctl");
+        return -1;
+    }
+    worker->accepting = 1;
+
+    struct epoll_event events[MAX_EVENTS];
+
+    while (1) {
+        int n = epoll_wait(worker->epfd, events, MAX_EVENTS, -1);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            void *ptr = events[i].data.ptr;
+            if (ptr == NULL) {
+                accept_connections(worker);
+                continue;
+            }
+            if (ptr == (void *)&agent_stats) {
+                serve_stats(worker);
+                continue;
+            }
+
+            connection_t *conn;
+            int result;
+            switch (*(event_kind_t *)ptr) {
+                case EVENT_CHILD:
+                    reap_child(worker, ptr);
+                    continue;
+                case EVENT_SPAWN: {
+                    pending_spawn_t *spawn = ptr;
+                    conn = spawn->conn;
+                    result = conn->closed ? 0 : spawn_finished(worker, spawn);
+                    break;
+                }
+                default:
+                    conn = ptr;
+                    result = conn->closed ? 0
+                             : handle_connection_event(worker, conn, events[i].events);
+                    break;
+            }
+            if (result == -1) {
+                close_connection(worker, conn);
+            }
+        }
+
+        free_closed_connections(worker);
+        refill_pools();
+
+        // Pause or resume accepting depending on the connection cap
+        if (worker->accepting && worker->nconnections >= worker->max_connections) {
+            epoll_ctl(worker->epfd, EPOLL_CTL_DEL, worker->listenfd, NULL);
+            worker->accepting = 0;
+            stats_add(&agent_stats.accept_pauses, 1);
+        } else if (!worker->accepting && worker->nconnections < worker->max_connections) {
+            if (watch_listener(worker, worker->listenfd, NULL) == 0) {
+                worker->accepting = 1;
+            }
+        }
+    }
+    return -1;
+}
+
+#ifdef HOLDEN_IO_URING
+// A request has been read: answer it, unless it waits for its execs.
+// Returns -1 when the connection should be closed.
+int uring_request(worker_t *worker, connection_t *conn) {
+    handle_message(worker, conn);
+    close_request_fds(conn);  // the children have their copies
+    if (conn->state == CONN_SPAWNING) {
+        return 0;
+    }
+    response_ready(conn);
+    return uring_respond(worker, conn);
+}
+
+// A receive on the connection completed with result
+int uring_received(worker_t *worker, connection_t *conn, int result) {
+    conn->receiving = 0;
+    if (result < 0) {
+        errno = -result;
+        return -1;
+    }
+    if (conn->request_offset == 0) {
+        conn->recv_start = stats_now_us();
+    }
+    result = message_recv_complete(&conn->request, &conn->recv_msg, result,
+                                   &conn->request_offset, conn->request_fds,
+                                   &conn->request_fd_count);
+    if (result != 1) {
+        return result == 0 ? uring_recv(worker, conn) : -1;
+    }
+
+    request_received(conn);
+    if (conn->state == CONN_WRITING) {
+        conn->request_ready = 1;  // answered once the response is out
+        return 0;
+    }
+    return uring_request(worker, conn);
+}
+
+// A send on the connection completed with result. Exits go out between
+// responses, so always after the reply that started the process.
+int uring_sent(worker_t *worker, connection_t *conn, int result) {
+    if (result < 0) {
+        errno = -result;
+        return -1;
+    }
+    if (!message_send_complete(&conn->response, result, &conn->response_offset)) {
+        return uring_send(worker, conn);
+    }
+
+    response_sent(conn);
+    if (conn->exit_count > 0) {
+        next_exit_report(conn);
+        return uring_respond(worker, conn);
+    }
+    if (conn->request_ready) {
+        conn->request_ready = 0;
+        return uring_request(worker, conn);
+    }
+    return 0;
+}
+
+// The read of a pending spawn's status pipe completed with result: 0
+// bytes if it was closed on exec, the errno of the failure otherwise
+int uring_status_read(worker_t *worker, pending_spawn_t *spawn, int result) {
+    int error = result == 0 ? 0 :
+                result == sizeof(spawn->status) ? spawn->status :
+                result < 0 ? -result : EPROTO;
+    if (!spawn_reported(worker, spawn, error)) {
+        return 0;
+    }
+    return uring_respond(worker, spawn->conn);
+}
+
+// The accept on the listening socket completed with result, a new
+// client unless negative
+void uring_accepted(worker_t *worker, int result, unsigned flags, int *accepted) {
+    if (!(flags & IORING_CQE_F_MORE)) {
+        worker->accept_armed = 0;
+    }
+    if (result < 0) {
+        if (result == -EINVAL && worker->multishot) {
+            worker->multishot = 0;  // before Linux 5.19: one accept at a time
+        } else if (result != -ECANCELED && result != -EAGAIN && result != -EINTR) {
+            fprintf(stderr, "accept: %s\n", strerror(-result));
+        }
+        return;
+    }
+
+    connection_t *conn = new_connection(result);
+    if (conn == NULL) {
+        close(result);
+        return;
+    }
+    worker->nconnections++;
+    (*accepted)++;
+    if (uring_recv(worker, conn) == -1) {
+        close_connection(worker, conn);
+    }
+}
+
+// Keep an accept in flight on the listening socket while below the
+// worker's share of the connection cap, cancelling it at the cap
+void uring_update_accepting(worker_t *worker) {
+    if (worker->nconnections >= worker->max_connections) {
+        if (worker->accepting) {
+            struct io_uring_sqe *sqe = uring_sqe(worker, IORING_OP_ASYNC_CANCEL, -1,
+                                                 (uintptr_t)&worker->ring);
+            if (sqe != NULL) {
+                sqe->addr = (uintptr_t)&worker->listenfd;
+            }
+            worker->accepting = 0;
+            stats_add(&agent_stats.accept_pauses, 1);
+        }
+        return;
+    }
+    if (worker->accept_armed) {
+        return;
+    }
+
+    struct io_uring_sqe *sqe = uring_sqe(worker, IORING_OP_ACCEPT, worker->listenfd,
+                                         (uintptr_t)&worker->listenfd);
+    if (sqe != NULL) {
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+        sqe->ioprio = worker->multishot ? IORING_ACCEPT_MULTISHOT : 0;
+        worker->accept_armed = 1;
+        worker->accepting = 1;
+    }
+}
+
+// Dispatch a completion of the worker's ring
+void uring_completed(worker_t *worker, const struct io_uring_cqe *cqe, int *accepted) {
+    if (cqe->user_data == (uintptr_t)&worker->listenfd) {
+        uring_accepted(worker, cqe->res, cqe->flags, accepted);
+        return;
+    }
+    if (cqe->user_data == (uintptr_t)&worker->statsfd) {
+        if (cqe->res == -EINVAL && worker->multishot) {
+            worker->multishot = 0;
+        } else {
+            serve_stats(worker);
+        }
+        if (!(cqe->flags & IORING_CQE_F_MORE) &&
+            uring_poll(worker, worker->statsfd, cqe->user_data, worker->multishot) == -1) {
+            fprintf(stderr, "Failed to watch the stats socket\n");
+        }
+        return;
+    }
+    if (cqe->user_data == (uintptr_t)&worker->ring) {
+        return;  // a cancellation
+    }
 
+    void *ptr = (void *)(uintptr_t)(cqe->user_data & ~(uint64_t)URING_SEND);
+    connection_t *conn;
+    int result;
+    switch (*(event_kind_t *)ptr) {
+        case EVENT_CHILD:
+            reap_child(worker, ptr);
+            return;
+        case EVENT_SPAWN: {
+            pending_spawn_t *spawn = ptr;
+            conn = spawn->conn;
+            conn->inflight--;
+            result = conn->closed ? 0 : uring_status_read(worker, spawn, cqe->res);
+            break;
+        }
         default:
-            response.header.type = MSG_PROCESS_ERROR;
-            response.header.length = sizeof(process_error_msg_t);
-            snprintf(response.data.process_error.error, MAX_ERROR_MSG,
-                    "Unknown message type: %d", request->header.type);
+            conn = ptr;
+            conn->inflight--;
+            if (conn->closed) {
+                return;
+            }
+            result = cqe->user_data & URING_SEND ? uring_sent(worker, conn, cqe->res)
+                     : uring_received(worker, conn, cqe->res);
+            break;
+    }
+    if (result == -1) {
+        close_connection(worker, conn);
+    }
+}
+
+// run_event_loop() on the worker's ring instead of epoll: accepts are
+// multishot, requests and replies (their descriptors included) are
+// received and sent by the kernel as they arrive, exec outcomes are read
+// from the status pipes and children's pidfds are polled, all submitted
+// in batches with a single io_uring_enter() per wakeup that also waits for
+// the next completions.
+int run_uring_loop(worker_t *worker) {
+    if (worker->statsfd != -1 &&
+        uring_poll(worker, worker->statsfd, (uintptr_t)&worker->statsfd,
+                   worker->multishot) == -1) {
+        return -1;
+    }
+
+    while (1) {
+        uring_update_accepting(worker);
+        if (uring_submit(&worker->ring, 1) == -1 &&
+            errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            perror("io_uring_enter");
             break;
+        }
+
+        int accepted = 0;
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek_cqe(&worker->ring)) != NULL) {
+            struct io_uring_cqe completion = *cqe;
+            uring_cqe_seen(&worker->ring);
+            uring_completed(worker, &completion, &accepted);
+        }
+        if (accepted > 0) {
+            stats_add(&agent_stats.connections_accepted, accepted);
+            stats_observe(&agent_stats.accept_batch, accepted);
+        }
+
+        free_closed_connections(worker);
+        refill_pools();
+    }
+    return -1;
+}
+#endif
+
+// Serve the worker's clients from io_uring where the build and the
+// kernel allow it, from epoll otherwise
+int run_worker(worker_t *worker) {
+#ifdef HOLDEN_IO_URING
+    static int reported = 0;
+    if (uring_init(&worker->ring, URING_ENTRIES) == 0) {
+        worker->uring = 1;
+        worker->multishot = 1;
+        if (!__atomic_exchange_n(&reported, 1, __ATOMIC_RELAXED)) {
+            printf("Serving with io_uring\n");
+            fflush(stdout);
+        }
+        return run_uring_loop(worker);
+    }
+    if (!__atomic_exchange_n(&reported, 1, __ATOMIC_RELAXED)) {
+        fprintf(stderr, "io_uring unavailable (%s), serving with epoll\n", strerror(errno));
+    }
+#endif
+    return run_event_loop(worker);
+}
+
+void *worker_thread(void *arg) {
+    run_worker(arg);
+    fprintf(stderr, "Worker stopped\n");
+    return NULL;
+}
+
+// A setting of a [profile] section: COMMAND and POOL_SIZE (default 1)
+int profile_setting(const char *section, const char *key, const char *value,
+                    int line) {
+    pool_t *pool = pool_count > 0 ? &pools[pool_count - 1] : NULL;
+    if (pool == NULL || strcmp(pool->name, section) != 0) {
+        pool_t *grown = realloc(pools, (pool_count + 1) * sizeof(*pools));
+        if (grown == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        pools = grown;
+        pool = &pools[pool_count];
+        memset(pool, 0, sizeof(*pool));
+        pool->size = 1;
+        pool->name = strdup(section);
+        if (pool->name == NULL) {
+            perror("strdup");
+            return -1;
+        }
+        pool_count++;
+    }
+
+    if (strcmp(key, "COMMAND") == 0) {
+        free(pool->argv);
+        pool->argv = split_command(value);
+        if (pool->argv == NULL) {
+            fprintf(stderr, "line %d: invalid command\n", line);
+            return -1;
+        }
+    } else if (strcmp(key, "POOL_SIZE") == 0) {
+        long size;
+        if (config_number(value, &size) == -1 || size == 0 || size > INT_MAX) {
+            fprintf(stderr, "line %d: invalid POOL_SIZE %s\n", line, value);
+            return -1;
+        }
+        pool->size = size;
+    } else {
+        fprintf(stderr, "line %d: unknown profile setting %s\n", line, key);
+        return -1;
+    }
+    return 0;
+}
+
+// config_parse() handler for agent.conf
+int agent_setting(void *ctx, const char *section, const char *key,
+                  const char *value, int line) {
+    agent_config_t *config = ctx;
+
+    if (*section != '\0') {
+        return profile_setting(section, key, value, line);
     }
 
-    return send_message(sockfd, &response);
+    if (strcmp(key, "ENABLE_CGROUPS") == 0) {
+        config->enable_cgroups = config_bool(value);
+        if (config->enable_cgroups == -1) {
+            fprintf(stderr, "line %d: invalid boolean %s\n", line, value);
+            return -1;
+        }
+    } else if (strcmp(key, "CGROUP_BASE") == 0) {
+        if (strlen(value) >= sizeof(config->cgroup_base)) {
+            fprintf(stderr, "line %d: CGROUP_BASE too long\n", line);
+            return -1;
+        }
+        strcpy(config->cgroup_base, value);
+    } else if (strcmp(key, "WORKERS") == 0) {
+        if (config_number(value, &config->workers) == -1 || config->workers > 1024) {
+            fprintf(stderr, "line %d: invalid WORKERS %s\n", line, value);
+            return -1;
+        }
+    } else if (strcmp(key, "STATS_SOCKET") == 0) {
+        if (strlen(value) >= sizeof(config->stats_socket)) {
+            fprintf(stderr, "line %d: STATS_SOCKET too long\n", line);
+            return -1;
+        }
+        strcpy(config->stats_socket, value);
+    } else if (strcmp(key, "FD_STORE_MAX") == 0) {
+        if (config_number(value, &config->fd_store_max) == -1 ||
+            config->fd_store_max > INT_MAX) {
+            fprintf(stderr, "line %d: invalid FD_STORE_MAX %s\n", line, value);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Read agent.conf. A missing file is fine unless HOLDEN_CONFIG points to it.
+int load_agent_config(agent_config_t *config) {
+    const char *path = config_path();
+    if (getenv("HOLDEN_CONFIG") == NULL && access(path, F_OK) == -1) {
+        return 0;
+    }
+    if (config_parse(path, agent_setting, config) != 0) {
+        fprintf(stderr, "Failed to load configuration from %s\n", path);
+        return -1;
+    }
+    for (int i = 0; i < pool_count; i++) {
+        if (pools[i].argv == NULL) {
+            fprintf(stderr, "%s: profile %s has no COMMAND\n", path, pools[i].name);
+            return -1;
+        }
+    }
+    return 0;
 }
 
 void cleanup_socket() {
     if (current_socket_path) {
         unlink(current_socket_path);
     }
+    if (current_stats_path) {
+        unlink(current_stats_path);
+    }
+}
+
+// Create a non-blocking listening socket at path, replacing any stale
+// one. Returns it, or -1 on error.
+int open_listener(const char *path) {
+    int sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sockfd == -1) {
+        perror("socket");
+        return -1;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    unlink(path);
+
+    if (bind(sockfd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+        perror("bind");
+        close(sockfd);
+        return -1;
+    }
+
+    if (listen(sockfd, SOMAXCONN) == -1) {
+        perror("listen");
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
 }
 
 void print_agent_usage(const char *prog_name) {
@@ -174,8 +1798,12 @@ void print_agent_usage(const char *prog_name) {
     printf("\n");
     printf("Environment Variables:\n");
     printf("  HOLDEN_SOCKET_PATH    - Path to agent socket (default: %s)\n", SOCKET_PATH);
+    printf("  HOLDEN_MAX_CONNECTIONS - Maximum concurrent client connections (default: %d)\n",
+           DEFAULT_MAX_CONNECTIONS);
+    printf("  HOLDEN_CONFIG         - Configuration file (default: %s)\n", CONFIG_PATH);
     printf("\n");
-    printf("The agent maintains no state - all process management is handled by the caller.\n");
+    printf("The agent maintains no process state - all process management is handled by the caller.\n");
+    printf("With FD_STORE_MAX set, it keeps descriptors deposited by callers across their restarts.\n");
 }
 
 int main(int argc, char *argv[]) {
@@ -184,22 +1812,35 @@ int main(int argc, char *argv[]) {
         return 0;
     }
 
-    int sockfd, clientfd;
-    struct sockaddr_un addr;
+    int sockfd;
+    int statsfd = -1;
     const char *socket_path;
+    int max_connections = DEFAULT_MAX_CONNECTIONS;
 
     signal(SIGPIPE, SIG_IGN);
     atexit(cleanup_socket);
 
-    // Install SIGCHLD handler to reap zombie children
-    struct sigaction sa;
-    sa.sa_handler = sigchld_handler;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
-    if (sigaction(SIGCHLD, &sa, NULL) == -1) {
-        perror("sigaction");
+    agent_config_t config = {.enable_cgroups = 0};
+    strcpy(config.cgroup_base, DEFAULT_CGROUP_BASE);
+    if (load_agent_config(&config) == -1) {
         return 1;
     }
+    if (config.enable_cgroups) {
+        cgroup_base_fd = cgroup_open_base(config.cgroup_base);
+        if (cgroup_base_fd == -1) {
+            return 1;
+        }
+    }
+
+    fd_store.max = config.fd_store_max;
+    if (fd_store.max > 0) {
+        // Each entry holds a few descriptors: allow as many as we may
+        struct rlimit nofile;
+        if (getrlimit(RLIMIT_NOFILE, &nofile) == 0 && nofile.rlim_cur < nofile.rlim_max) {
+            nofile.rlim_cur = nofile.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &nofile);
+        }
+    }
 
     socket_path = getenv("HOLDEN_SOCKET_PATH");
     if (socket_path == NULL) {
@@ -207,47 +1848,73 @@ int main(int argc, char *argv[]) {
     }
     current_socket_path = socket_path;
 
-    sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    const char *max_env = getenv("HOLDEN_MAX_CONNECTIONS");
+    if (max_env != NULL) {
+        max_connections = atoi(max_env);
+        if (max_connections <= 0) {
+            fprintf(stderr, "Invalid HOLDEN_MAX_CONNECTIONS: %s\n", max_env);
+            return 1;
+        }
+    }
+
+    sockfd = open_listener(socket_path);
     if (sockfd == -1) {
-        perror("socket");
         exit(1);
     }
+    printf("Agent listening on %s\n", socket_path);
 
-    memset(&addr, 0, sizeof(addr));
-    addr.sun_family = AF_UNIX;
-    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
-
-    unlink(socket_path);
-
-    if (bind(sockfd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
-        perror("bind");
-        exit(1);
+    if (config.stats_socket[0] != '\0') {
+        current_stats_path = config.stats_socket;
+        statsfd = open_listener(config.stats_socket);
+        if (statsfd == -1) {
+            exit(1);
+        }
+        printf("Statistics on %s\n", config.stats_socket);
     }
 
-    if (listen(sockfd, 5) == -1) {
-        perror("listen");
+    int nworkers = config.workers;
+    if (nworkers == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nworkers = cpus > 0 ? cpus : 1;
+    }
+    worker_t *workers = calloc(nworkers, sizeof(*workers));
+    if (workers == NULL) {
+        perror("calloc");
         exit(1);
     }
-
-    printf("Agent listening on %s\n", socket_path);
-
-    while (1) {
-        clientfd = accept(sockfd, NULL, NULL);
-        if (clientfd == -1) {
-            perror("accept");
-            continue;
+    for (int i = 0; i < nworkers; i++) {
+        workers[i].epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (workers[i].epfd == -1) {
+            perror("epoll_create1");
+            exit(1);
         }
+        workers[i].listenfd = sockfd;
+        workers[i].statsfd = statsfd;
+        workers[i].max_connections = (max_connections + nworkers - 1) / nworkers;
+    }
 
-        message_t request;
-        while (recv_message(clientfd, &request) == 0) {
-            if (handle_message(clientfd, &request) == -1) {
-                break;
-            }
-        }
+    refill_pools();
 
-        close(clientfd);
+    // The main thread is the first worker
+    for (int i = 1; i < nworkers; i++) {
+        int error = pthread_create(&workers[i].thread, NULL, worker_thread, &workers[i]);
+        if (error != 0) {
+            fprintf(stderr, "Failed to start worker: %s\n", strerror(error));
+            exit(1);
+        }
     }
+    printf("Serving with %d worker%s\n", nworkers, nworkers == 1 ? "" : "s");
+    fflush(stdout);
+    run_worker(&workers[0]);
 
+    for (int i = 0; i < pool_count; i++) {
+        pool_free(&pools[i]);
+    }
+    free(pools);
+    fdstore_free(&fd_store);
     close(sockfd);
-    return 0;
+    if (statsfd != -1) {
+        close(statsfd);
+    }
+    return 1;
 }
\ No newline at end of file
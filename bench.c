@@ -0,0 +1,498 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include "protocol.h"
+#include "client.h"
+#include "spawn.h"
+#include "config.h"
+
+#define DEFAULT_ITERATIONS 1000
+#define DEFAULT_CLIENTS 8
+#define DEFAULT_COMMAND "/bin/true"
+// Large argv scenario: LARGE_ARGC arguments of LARGE_ARG_SIZE bytes
+#define LARGE_ARGC 512
+#define LARGE_ARG_SIZE 128
+
+// Latencies of one scenario, in nanoseconds
+typedef struct {
+    const char *name;
+    uint64_t *samples;
+    size_t count;
+    size_t failures;
+    uint64_t spawned;       // processes started
+    uint64_t elapsed;       // wall time of the whole run
+} result_t;
+
+typedef struct {
+    char **argv;            // command to spawn
+    char **large_argv;      // the same with LARGE_ARGC extra arguments
+    char *large_args;       // storage of the extra arguments
+    long iterations;
+    long clients;
+    int json;
+    int stats;              // print the agent's statistics at the end
+} bench_t;
+
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int compare_samples(const void *a, const void *b) {
+    uint64_t sa = *(const uint64_t *)a;
+    uint64_t sb = *(const uint64_t *)b;
+    return (sa > sb) - (sa < sb);
+}
+
+// Nearest-rank percentile of sorted samples, in microseconds
+double percentile(const result_t *result, double q) {
+    if (result->count == 0) {
+        return 0;
+    }
+    size_t rank = (size_t)(q * result->count + 0.999999);
+    if (rank == 0) {
+        rank = 1;
+    }
+    if (rank > result->count) {
+        rank = result->count;
+    }
+    return result->samples[rank - 1] / 1000.0;
+}
+
+void report(const bench_t *bench, result_t *result) {
+    qsort(result->samples, result->count, sizeof(*result->samples), compare_samples);
+    double rate = result->elapsed > 0 ? result->spawned * 1e9 / result->elapsed : 0;
+    double p50 = percentile(result, 0.50);
+    double p99 = percentile(result, 0.99);
+    double p999 = percentile(result, 0.999);
+    double max = result->count > 0 ? result->samples[result->count - 1] / 1000.0 : 0;
+
+    if (bench->json) {
+        printf("{\"scenario\":\"%s\",\"ops\":%zu,\"failures\":%zu,\"spawned\":%llu,"
+               "\"spawns_per_sec\":%.1f,\"p50_us\":%.1f,\"p99_us\":%.1f,"
+               "\"p999_us\":%.1f,\"max_us\":%.1f}\n",
+               result->name, result->count, result->failures,
+               (unsigned long long)result->spawned, rate, p50, p99, p999, max);
+    } else {
+        printf("%-16s %8zu %8zu %12.1f %10.1f %10.1f %10.1f %10.1f\n",
+               result->name, result->count, result->failures, rate, p50, p99, p999, max);
+    }
+    fflush(stdout);
+}
+
+// Round trip of one request: send it, wait for the reply, close the
+// pidfds that came back. Returns the number of processes started, or -1
+// if the agent could not be reached.
+int agent_round_trip(agent_conn_t *conn, message_t *request) {
+    uint32_t request_id;
+    if (agent_send(conn, request, NULL, 0, &request_id) == -1) {
+        return -1;
+    }
+    agent_reply_t *reply = agent_wait(conn, request_id);
+    if (reply == NULL) {
+        return -1;
+    }
+
+    int started = 0;
+    switch (reply->msg.header.type) {
+        case MSG_PROCESS_STARTED:
+            started = 1;
+            break;
+        case MSG_BATCH_STARTED:
+            started = reply->fd_count;
+            break;
+        case MSG_PONG:
+            break;
+        default:
+            started = -2;  // refused
+            break;
+    }
+    agent_reply_free(reply);  // closes the pidfds
+    return started;
+}
+
+// Send iterations requests one after the other on one connection,
+// recording the latency of each in samples. expected is the number of
+// processes a request should start.
+int run_requests(result_t *result, uint64_t *samples, message_t *request,
+                 long iterations, int expected) {
+    agent_conn_t conn = {.fd = -1};
+    if (agent_connect(&conn) == -1) {
+        return -1;
+    }
+
+    for (long i = 0; i < iterations; i++) {
+        uint64_t start = now_ns();
+        int started = agent_round_trip(&conn, request);
+        samples[i] = now_ns() - start;
+        if (started == -1) {
+            perror("agent");
+            agent_disconnect(&conn);
+            return -1;
+        }
+        if (started != expected) {
+            result->failures++;
+        }
+        if (started > 0) {
+            result->spawned += started;
+        }
+    }
+    result->count += iterations;
+    agent_disconnect(&conn);
+    return 0;
+}
+
+int run_sequential(const char *name, message_t *request, long iterations,
+                   int expected, result_t *result) {
+    memset(result, 0, sizeof(*result));
+    result->name = name;
+    result->samples = calloc(iterations, sizeof(*result->samples));
+    if (result->samples == NULL) {
+        perror("calloc");
+        return -1;
+    }
+
+    uint64_t start = now_ns();
+    int status = run_requests(result, result->samples, request, iterations, expected);
+    result->elapsed = now_ns() - start;
+    return status;
+}
+
+// Per-client tallies in shared memory, written by the client processes
+typedef struct {
+    size_t failures;
+    uint64_t spawned;
+    int error;
+} client_tally_t;
+
+// clients processes with a connection each share the iterations, all
+// starting together
+int run_concurrent(const bench_t *bench, message_t *request, result_t *result) {
+    long per_client = bench->iterations / bench->clients;
+    if (per_client == 0) {
+        per_client = 1;
+    }
+    size_t total = per_client * bench->clients;
+    size_t size = total * sizeof(uint64_t) + bench->clients * sizeof(client_tally_t);
+    void *shared = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    uint64_t *samples = shared;
+    client_tally_t *tallies = (client_tally_t *)(samples + total);
+
+    int go[2];
+    if (pipe(go) == -1) {
+        perror("pipe");
+        munmap(shared, size);
+        return -1;
+    }
+
+    long forked = 0;
+    for (; forked < bench->clients; forked++) {
+        long c = forked;
+        pid_t pid = fork();
+        if (pid == -1) {
+            perror("fork");
+            break;
+        }
+        if (pid == 0) {
+            close(go[1]);
+            char byte;
+            if (read(go[0], &byte, 1) == -1) {  // EOF once all are forked
+                _exit(1);
+            }
+            result_t tally = {0};
+            int status = run_requests(&tally, samples + c * per_client, request,
+                                      per_client, 1);
+            tallies[c].failures = tally.failures;
+            tallies[c].spawned = tally.spawned;
+            tallies[c].error = status == -1;
+            _exit(0);
+        }
+    }
+
+    close(go[0]);
+    uint64_t start = now_ns();
+    close(go[1]);
+    int failed = 0;
+    while (wait(NULL) > 0 || errno == EINTR) {
+    }
+    uint64_t elapsed = now_ns() - start;
+    if (forked < bench->clients) {
+        munmap(shared, size);
+        return -1;
+    }
+
+    memset(result, 0, sizeof(*result));
+    result->name = "concurrent";
+    result->samples = malloc(total * sizeof(*samples));
+    if (result->samples == NULL) {
+        perror("malloc");
+        munmap(shared, size);
+        return -1;
+    }
+    memcpy(result->samples, samples, total * sizeof(*samples));
+    result->count = total;
+    result->elapsed = elapsed;
+    for (long c = 0; c < bench->clients; c++) {
+        result->failures += tallies[c].failures;
+        result->spawned += tallies[c].spawned;
+        failed |= tallies[c].error;
+    }
+    munmap(shared, size);
+    if (failed) {
+        fprintf(stderr, "concurrent: some clients lost the agent\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Spawn locally through the same engine, for comparison with the agent
+int run_local(const bench_t *bench, result_t *result) {
+    memset(result, 0, sizeof(*result));
+    result->name = "local";
+    result->samples = calloc(bench->iterations, sizeof(*result->samples));
+    if (result->samples == NULL) {
+        perror("calloc");
+        return -1;
+    }
+
+    spawn_attr_t attr = {.file = bench->argv[0], .argv = bench->argv};
+    uint64_t run_start = now_ns();
+    for (long i = 0; i < bench->iterations; i++) {
+        pid_t pid;
+        uint64_t start = now_ns();
+        int pidfd = spawn_process(&attr, &pid);
+        result->samples[i] = now_ns() - start;
+        if (pidfd == -1) {
+            result->failures++;
+            continue;
+        }
+        result->spawned++;
+        siginfo_t info;
+        waitid(P_PIDFD, pidfd, &info, WEXITED);
+        close(pidfd);
+    }
+    result->elapsed = now_ns() - run_start;
+    result->count = bench->iterations;
+    return 0;
+}
+
+// argv with LARGE_ARGC arguments of LARGE_ARG_SIZE bytes appended,
+// stored in *args
+char **make_large_argv(char **argv, char **args_out) {
+    int argc = 0;
+    while (argv[argc] != NULL) {
+        argc++;
+    }
+    char **large = calloc(argc + LARGE_ARGC + 1, sizeof(*large));
+    char *args = malloc(LARGE_ARGC * LARGE_ARG_SIZE);
+    if (large == NULL || args == NULL) {
+        free(large);
+        free(args);
+        return NULL;
+    }
+
+    memcpy(large, argv, argc * sizeof(*argv));
+    for (int i = 0; i < LARGE_ARGC; i++) {
+        char *arg = args + i * LARGE_ARG_SIZE;
+        memset(arg, 'a' + i % 26, LARGE_ARG_SIZE - 1);
+        arg[LARGE_ARG_SIZE - 1] = '\0';
+        large[argc + i] = arg;
+    }
+    *args_out = args;
+    return large;
+}
+
+int run_scenario(const bench_t *bench, const char *name) {
+    message_t request = {0};
+    result_t result = {0};
+    int status;
+
+    if (strcmp(name, "ping") == 0) {
+        request.header.type = MSG_PING;
+        status = run_sequential("ping", &request, bench->iterations, 0, &result);
+    } else if (strcmp(name, "sequential") == 0) {
+        request.header.type = MSG_START_PROCESS;
+        request.data.start_process.argv = bench->argv;
+        status = run_sequential("sequential", &request, bench->iterations, 1, &result);
+    } else if (strcmp(name, "large-argv") == 0) {
+        request.header.type = MSG_START_PROCESS;
+        request.data.start_process.argv = bench->large_argv;
+        status = run_sequential("large-argv", &request, bench->iterations, 1, &result);
+    } else if (strcmp(name, "concurrent") == 0) {
+        request.header.type = MSG_START_PROCESS;
+        request.data.start_process.argv = bench->argv;
+        status = run_concurrent(bench, &request, &result);
+    } else if (strncmp(name, "batch-", 6) == 0) {
+        long size;
+        if (config_number(name + 6, &size) == -1 || size == 0 || size > MAX_BATCH_SIZE) {
+            fprintf(stderr, "Batch size must be 1-%d: %s\n", MAX_BATCH_SIZE, name);
+            return -1;
+        }
+        start_process_msg_t *processes = calloc(size, sizeof(*processes));
+        if (processes == NULL) {
+            perror("calloc");
+            return -1;
+        }
+        for (long i = 0; i < size; i++) {
+            processes[i].argv = bench->argv;
+        }
+        request.header.type = MSG_START_BATCH;
+        request.data.start_batch.count = size;
+        request.data.start_batch.processes = processes;
+        long batches = bench->iterations / size > 0 ? bench->iterations / size : 1;
+        status = run_sequential(name, &request, batches, size, &result);
+        free(processes);
+    } else if (strcmp(name, "local") == 0) {
+        status = run_local(bench, &result);
+    } else {
+        fprintf(stderr, "Unknown scenario: %s\n", name);
+        return -1;
+    }
+
+    if (status == 0) {
+        report(bench, &result);
+    }
+    message_free(&request);
+    free(result.samples);
+    return status;
+}
+
+// Fetch the agent's statistics with MSG_GET_STATS and print them
+int print_agent_stats(void) {
+    agent_conn_t conn = {.fd = -1};
+    if (agent_connect(&conn) == -1) {
+        return -1;
+    }
+
+    message_t request = {0};
+    request.header.type = MSG_GET_STATS;
+    uint32_t request_id;
+    agent_reply_t *reply = NULL;
+    if (agent_send(&conn, &request, NULL, 0, &request_id) == 0) {
+        reply = agent_wait(&conn, request_id);
+    }
+    message_free(&request);
+    if (reply == NULL || reply->msg.header.type != MSG_STATS) {
+        fprintf(stderr, "Failed to get agent statistics\n");
+        agent_reply_free(reply);
+        agent_disconnect(&conn);
+        return -1;
+    }
+
+    fputs(reply->msg.data.stats.text, stdout);
+    agent_reply_free(reply);
+    agent_disconnect(&conn);
+    return 0;
+}
+
+static const char *all_scenarios[] = {
+    "ping", "sequential", "concurrent", "batch-1", "batch-10", "batch-50",
+    "batch-250", "large-argv", "local", NULL,
+};
+
+void print_usage(const char *prog_name) {
+    printf("Holden spawn and IPC latency benchmark\n");
+    printf("Usage: %s [options] [scenario...]\n", prog_name);
+    printf("\n");
+    printf("Drives a running agent over the real protocol and reports, per\n");
+    printf("scenario, spawns/sec and p50/p99/p999/max latency in microseconds.\n");
+    printf("\n");
+    printf("Scenarios (default: all):\n");
+    printf("  ping         MSG_PING round trips, no spawn\n");
+    printf("  sequential   one MSG_START_PROCESS at a time\n");
+    printf("  concurrent   the same from several clients at once\n");
+    printf("  batch-N      MSG_START_BATCH of N processes (latency per batch)\n");
+    printf("  large-argv   sequential with %d extra %d-byte arguments\n",
+           LARGE_ARGC, LARGE_ARG_SIZE);
+    printf("  local        spawn_process() in this process, no agent\n");
+    printf("\n");
+    printf("Options:\n");
+    printf("  -n N             Requests per scenario (default: %d)\n", DEFAULT_ITERATIONS);
+    printf("  -c N             Clients for the concurrent scenario (default: %d)\n",
+           DEFAULT_CLIENTS);
+    printf("  --command CMD    Command to spawn (default: %s)\n", DEFAULT_COMMAND);
+    printf("  --json           One JSON object per scenario\n");
+    printf("  --stats          Print the agent's statistics afterwards\n");
+    printf("\n");
+    printf("Environment Variables:\n");
+    printf("  HOLDEN_SOCKET_PATH - Path to agent socket (default: %s)\n", SOCKET_PATH);
+}
+
+int main(int argc, char *argv[]) {
+    bench_t bench = {
+        .iterations = DEFAULT_ITERATIONS,
+        .clients = DEFAULT_CLIENTS,
+    };
+    const char *command = DEFAULT_COMMAND;
+
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "--json") == 0) {
+            bench.json = 1;
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            bench.stats = 1;
+        } else if (strcmp(argv[i], "--command") == 0 && i + 1 < argc) {
+            command = argv[++i];
+        } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            if (config_number(argv[++i], &bench.iterations) == -1 ||
+                bench.iterations == 0) {
+                fprintf(stderr, "Invalid iteration count: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            if (config_number(argv[++i], &bench.clients) == -1 || bench.clients == 0) {
+                fprintf(stderr, "Invalid client count: %s\n", argv[i]);
+                return 1;
+            }
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    bench.argv = split_command(command);
+    if (bench.argv == NULL || bench.argv[0] == NULL) {
+        fprintf(stderr, "Invalid command\n");
+        return 1;
+    }
+    bench.large_argv = make_large_argv(bench.argv, &bench.large_args);
+    if (bench.large_argv == NULL) {
+        perror("malloc");
+        return 1;
+    }
+
+    if (!bench.json) {
+        printf("%-16s %8s %8s %12s %10s %10s %10s %10s\n", "SCENARIO", "OPS",
+               "FAILED", "SPAWNS/S", "P50 US", "P99 US", "P999 US", "MAX US");
+    }
+
+    const char *const *scenarios = i < argc ? (const char *const *)argv + i : all_scenarios;
+    int failed = 0;
+    for (; *scenarios != NULL; scenarios++) {
+        if (run_scenario(&bench, *scenarios) == -1) {
+            failed = 1;
+        }
+    }
+
+    if (bench.stats && print_agent_stats() == -1) {
+        failed = 1;
+    }
+
+    free(bench.large_args);
+    free(bench.large_argv);
+    free(bench.argv);
+    return failed;
+}
@@ -0,0 +1,85 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "cgroup.h"
+
+// Write value to the control file name in the cgroup dirfd
+static int write_control(int dirfd, const char *name, const char *value) {
+    int fd = openat(dirfd, name, O_WRONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    size_t len = strlen(value);
+    ssize_t n = write(fd, value, len);
+    int saved_errno = errno;
+    close(fd);
+    if (n != (ssize_t)len) {
+        errno = n == -1 ? saved_errno : EIO;
+        return -1;
+    }
+    return 0;
+}
+
+int cgroup_open_base(const char *path) {
+    if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+        fprintf(stderr, "Failed to create cgroup %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    int base_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (base_fd == -1) {
+        fprintf(stderr, "Failed to open cgroup %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    static const char *const controllers[] = {"+memory", "+cpu", "+pids"};
+    for (size_t i = 0; i < sizeof(controllers) / sizeof(controllers[0]); i++) {
+        if (write_control(base_fd, "cgroup.subtree_control", controllers[i]) == -1) {
+            fprintf(stderr, "Warning: %s controller unavailable under %s: %s\n",
+                    controllers[i] + 1, path, strerror(errno));
+        }
+    }
+    return base_fd;
+}
+
+int cgroup_create(int base_fd, const char *name, const cgroup_limits_t *limits) {
+    if (mkdirat(base_fd, name, 0755) == -1) {
+        return -1;
+    }
+
+    int fd = openat(base_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    int result = fd == -1 ? -1 : 0;
+    char value[64];
+
+    if (result == 0 && limits->memory_max != 0) {
+        snprintf(value, sizeof(value), "%llu", (unsigned long long)limits->memory_max);
+        result = write_control(fd, "memory.max", value);
+    }
+    if (result == 0 && limits->cpu_quota != 0) {
+        snprintf(value, sizeof(value), "%u %u", limits->cpu_quota, limits->cpu_period);
+        result = write_control(fd, "cpu.max", value);
+    }
+    if (result == 0 && limits->pids_max != 0) {
+        snprintf(value, sizeof(value), "%llu", (unsigned long long)limits->pids_max);
+        result = write_control(fd, "pids.max", value);
+    }
+
+    if (result == -1) {
+        int saved_errno = errno;
+        if (fd != -1) {
+            close(fd);
+        }
+        unlinkat(base_fd, name, AT_REMOVEDIR);
+        errno = saved_errno;
+        return -1;
+    }
+    return fd;
+}
+
+int cgroup_remove(int base_fd, const char *name) {
+    return unlinkat(base_fd, name, AT_REMOVEDIR);
+}
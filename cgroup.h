@@ -0,0 +1,29 @@
+#ifndef CGROUP_H
+#define CGROUP_H
+
+#include <stdint.h>
+
+// Limits of a per-process cgroup; a zero field leaves the default
+typedef struct {
+    uint64_t memory_max;    // memory.max, bytes
+    uint32_t cpu_quota;     // cpu.max, microseconds per cpu_period
+    uint32_t cpu_period;
+    uint64_t pids_max;      // pids.max
+} cgroup_limits_t;
+
+// Open the cgroup v2 directory under which per-process cgroups are
+// created, creating it if needed, and enable the memory, cpu and pids
+// controllers for its children (a warning is printed for those the
+// parent doesn't delegate). Returns a directory fd, or -1 on error.
+int cgroup_open_base(const char *path);
+
+// Create the cgroup name under base_fd and apply limits. Returns a
+// directory fd suitable for CLONE_INTO_CGROUP, or -1 with errno set, in
+// which case the cgroup has been removed again.
+int cgroup_create(int base_fd, const char *name, const cgroup_limits_t *limits);
+
+// Remove an empty cgroup. Returns 0, or -1 with errno set (EBUSY while
+// processes are left in it).
+int cgroup_remove(int base_fd, const char *name);
+
+#endif
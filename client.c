@@ -0,0 +1,148 @@
+#define _GNU_SOURCE
+#include "client.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+int agent_connect(agent_conn_t *conn) {
+    static unsigned int sessions = 0;
+    struct sockaddr_un addr;
+    const char *socket_path;
+
+    memset(conn, 0, sizeof(*conn));
+    conn->fd = -1;
+    conn->session = ++sessions;
+    conn->next_id = 1;
+
+    socket_path = getenv("HOLDEN_SOCKET_PATH");
+    if (socket_path == NULL) {
+        socket_path = SOCKET_PATH;
+    }
+
+    int sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sockfd == -1) {
+        perror("socket");
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+
+    if (connect(sockfd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+        perror("connect to agent");
+        close(sockfd);
+        return -1;
+    }
+
+    conn->fd = sockfd;
+    return 0;
+}
+
+void agent_disconnect(agent_conn_t *conn) {
+    while (conn->queued != NULL) {
+        agent_reply_t *reply = conn->queued;
+        conn->queued = reply->next;
+        agent_reply_free(reply);
+    }
+    if (conn->fd != -1) {
+        close(conn->fd);
+        conn->fd = -1;
+    }
+}
+
+int agent_send(agent_conn_t *conn, message_t *msg, const int *fds, int fd_count,
+               uint32_t *request_id) {
+    msg->header.request_id = conn->next_id++;
+    if (conn->next_id == 0) {
+        conn->next_id = 1;
+    }
+
+    if (send_message_with_fds(conn->fd, msg, fds, fd_count) == -1) {
+        return -1;
+    }
+
+    *request_id = msg->header.request_id;
+    return 0;
+}
+
+void agent_reply_free(agent_reply_t *reply) {
+    if (reply == NULL) {
+        return;
+    }
+    for (int i = 0; i < reply->fd_count; i++) {
+        if (reply->fds[i] != -1) {
+            close(reply->fds[i]);
+        }
+    }
+    message_free(&reply->msg);
+    free(reply);
+}
+
+// Read one reply and its descriptors off the socket
+static agent_reply_t *read_reply(agent_conn_t *conn) {
+    agent_reply_t *reply = calloc(1, sizeof(*reply));
+    if (reply == NULL) {
+        return NULL;
+    }
+
+    if (recv_message_with_fds(conn->fd, &reply->msg, reply->fds,
+                              &reply->fd_count) == -1) {
+        agent_reply_free(reply);
+        return NULL;
+    }
+
+    return reply;
+}
+
+agent_reply_t *agent_next(agent_conn_t *conn) {
+    if (conn->queued != NULL) {
+        agent_reply_t *reply = conn->queued;
+        conn->queued = reply->next;
+        reply->next = NULL;
+        return reply;
+    }
+    return read_reply(conn);
+}
+
+agent_reply_t *agent_poll(agent_conn_t *conn) {
+    if (conn->queued == NULL) {
+        struct pollfd pfd = {.fd = conn->fd, .events = POLLIN};
+        int ready = poll(&pfd, 1, 0);
+        if (ready == 0) {
+            errno = EAGAIN;
+        }
+        if (ready != 1) {
+            return NULL;
+        }
+    }
+    return agent_next(conn);
+}
+
+agent_reply_t *agent_wait(agent_conn_t *conn, uint32_t request_id) {
+    agent_reply_t **link = &conn->queued;
+
+    for (; *link != NULL; link = &(*link)->next) {
+        if ((*link)->msg.header.request_id == request_id) {
+            agent_reply_t *reply = *link;
+            *link = reply->next;
+            reply->next = NULL;
+            return reply;
+        }
+    }
+
+    while (1) {
+        agent_reply_t *reply = read_reply(conn);
+        if (reply == NULL || reply->msg.header.request_id == request_id) {
+            return reply;
+        }
+        // Someone else's reply: keep it, in arrival order
+        *link = reply;
+        link = &reply->next;
+    }
+}
@@ -0,0 +1,53 @@
+#ifndef CLIENT_H
+#define CLIENT_H
+
+#include "protocol.h"
+
+// A reply from the agent together with the descriptors that came with it
+typedef struct agent_reply {
+    message_t msg;
+    int fds[MAX_FDS_PER_MESSAGE];
+    int fd_count;
+    struct agent_reply *next;
+} agent_reply_t;
+
+// A persistent connection to the agent. Requests are tagged with
+// increasing IDs, any number of them may be in flight, and replies are
+// matched back to their request by ID.
+typedef struct {
+    int fd;
+    unsigned int session;   // changes on every connect
+    uint32_t next_id;
+    agent_reply_t *queued;  // replies read while waiting for another one
+} agent_conn_t;
+
+// Connect to the agent at HOLDEN_SOCKET_PATH (or SOCKET_PATH). Returns 0
+// on success, -1 on error.
+int agent_connect(agent_conn_t *conn);
+void agent_disconnect(agent_conn_t *conn);
+
+// Send a request with the descriptors it announces, without waiting for
+// the reply. Stores the request ID in *request_id. Returns 0 on success,
+// -1 on error.
+int agent_send(agent_conn_t *conn, message_t *msg, const int *fds, int fd_count,
+               uint32_t *request_id);
+
+// Wait for the reply to request_id; replies to other requests that
+// arrive first are kept for later. Returns the reply, to be released
+// with agent_reply_free(), or NULL on error.
+agent_reply_t *agent_wait(agent_conn_t *conn, uint32_t request_id);
+
+// Return the next reply to any request, kept ones first, or NULL on
+// error.
+agent_reply_t *agent_next(agent_conn_t *conn);
+
+// Return a kept reply or one that has started to arrive, without
+// waiting for the agent otherwise. Returns NULL with errno EAGAIN if
+// there is none, NULL with another errno on error.
+agent_reply_t *agent_poll(agent_conn_t *conn);
+
+// Release a reply, closing any descriptors still in reply->fds (set an
+// entry to -1 to keep it)
+void agent_reply_free(agent_reply_t *reply);
+
+#endif
@@ -0,0 +1,128 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include "config.h"
+
+// Strip leading and trailing whitespace in place
+static char *trim(char *s) {
+    while (isspace((unsigned char)*s)) {
+        s++;
+    }
+    char *end = s + strlen(s);
+    while (end > s && isspace((unsigned char)end[-1])) {
+        end--;
+    }
+    *end = '\0';
+    return s;
+}
+
+int config_parse(const char *path, config_handler_t handler, void *ctx) {
+    FILE *file = fopen(path, "re");
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    char *line = NULL;
+    size_t size = 0;
+    char *section = strdup("");
+    int lineno = 0;
+    int result = section == NULL ? -1 : 0;
+
+    while (result == 0 && getline(&line, &size, file) != -1) {
+        lineno++;
+        char *s = trim(line);
+        if (*s == '\0' || *s == '#') {
+            continue;
+        }
+
+        if (*s == '[') {
+            char *end = strchr(s, ']');
+            if (end == NULL || end[1] != '\0') {
+                fprintf(stderr, "%s:%d: malformed section header\n", path, lineno);
+                result = -1;
+                break;
+            }
+            *end = '\0';
+            free(section);
+            section = strdup(trim(s + 1));
+            if (section == NULL) {
+                perror("strdup");
+                result = -1;
+            }
+            continue;
+        }
+
+        char *eq = strchr(s, '=');
+        if (eq == NULL) {
+            fprintf(stderr, "%s:%d: expected KEY=VALUE\n", path, lineno);
+            result = -1;
+            break;
+        }
+        *eq = '\0';
+        result = handler(ctx, section, trim(s), trim(eq + 1), lineno);
+    }
+
+    free(line);
+    free(section);
+    fclose(file);
+    return result;
+}
+
+const char *config_path(void) {
+    const char *path = getenv("HOLDEN_CONFIG");
+    return path != NULL ? path : CONFIG_PATH;
+}
+
+int config_bool(const char *value) {
+    if (strcasecmp(value, "true") == 0 || strcasecmp(value, "yes") == 0 ||
+        strcasecmp(value, "on") == 0 || strcmp(value, "1") == 0) {
+        return 1;
+    }
+    if (strcasecmp(value, "false") == 0 || strcasecmp(value, "no") == 0 ||
+        strcasecmp(value, "off") == 0 || strcmp(value, "0") == 0) {
+        return 0;
+    }
+    return -1;
+}
+
+int config_number(const char *value, long *out) {
+    char *end;
+    errno = 0;
+    long number = strtol(value, &end, 10);
+    if (errno != 0 || end == value || *end != '\0' || number < 0) {
+        return -1;
+    }
+    *out = number;
+    return 0;
+}
+
+char **split_command(const char *cmd) {
+    size_t len = strlen(cmd);
+    size_t max_args = len / 2 + 2;
+    char **args = malloc(max_args * sizeof(char *) + len + 1);
+    if (args == NULL) {
+        return NULL;
+    }
+
+    char *copy = (char *)(args + max_args);
+    memcpy(copy, cmd, len + 1);
+
+    size_t argc = 0;
+    char *saveptr;
+    for (char *token = strtok_r(copy, " ", &saveptr); token != NULL;
+         token = strtok_r(NULL, " ", &saveptr)) {
+        args[argc++] = token;
+    }
+    args[argc] = NULL;
+
+    if (argc == 0) {
+        free(args);
+        return NULL;
+    }
+    return args;
+}
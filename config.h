@@ -0,0 +1,36 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#define CONFIG_PATH "/etc/holden/agent.conf"
+
+// Called for every KEY=VALUE setting of a configuration file. section is
+// the name of the enclosing "[section]", or "" before the first one, and
+// line is the line number for error messages. A non-zero return stops
+// parsing and is returned by config_parse().
+typedef int (*config_handler_t)(void *ctx, const char *section,
+                                const char *key, const char *value, int line);
+
+// Parse a configuration file in the format of config/agent.conf: KEY=VALUE
+// lines, blank lines and '#' comments, whitespace around keys and values
+// ignored, optionally grouped in "[section]"s. Returns 0 on success, -1
+// if the file can't be read or is malformed, or the handler's non-zero
+// return value.
+int config_parse(const char *path, config_handler_t handler, void *ctx);
+
+// Path of the agent configuration: HOLDEN_CONFIG, or CONFIG_PATH
+const char *config_path(void);
+
+// Interpret a boolean setting: true/yes/on/1 or false/no/off/0. Returns
+// 1 or 0, or -1 if the value is neither.
+int config_bool(const char *value);
+
+// Interpret a non-negative integer setting. Returns 0 and the value in
+// *out, or -1 if value isn't one.
+int config_number(const char *value, long *out);
+
+// Split a command line on spaces into a NULL-terminated argv vector.
+// The vector and its strings live in one allocation, release it with
+// free(). Returns NULL for an empty command or on allocation failure.
+char **split_command(const char *cmd);
+
+#endif
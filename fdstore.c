@@ -0,0 +1,143 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <search.h>
+#include <unistd.h>
+#include "fdstore.h"
+
+static int compare_entries(const void *a, const void *b) {
+    return strcmp(((const fdstore_entry_t *)a)->name, ((const fdstore_entry_t *)b)->name);
+}
+
+static void close_fds(const int *fds, int count) {
+    for (int i = 0; i < count; i++) {
+        close(fds[i]);
+    }
+}
+
+static void free_entry(fdstore_entry_t *entry) {
+    close_fds(entry->fds, entry->fd_count);
+    free(entry->metadata);
+    free(entry->name);
+    free(entry);
+}
+
+// Drop an entry, moving the last one into its place in the array
+static void remove_entry(fdstore_t *store, fdstore_entry_t *entry) {
+    tdelete(entry, &store->index, compare_entries);
+    fdstore_entry_t *last = store->entries[--store->count];
+    store->entries[entry->index] = last;
+    last->index = entry->index;
+    free_entry(entry);
+}
+
+int fdstore_put(fdstore_t *store, const char *name, const int *fds, int fd_count,
+                const void *metadata, size_t metadata_length) {
+    fdstore_entry_t key = {.name = (char *)name};
+    fdstore_entry_t **found = tfind(&key, &store->index, compare_entries);
+    if (found != NULL) {
+        remove_entry(store, *found);
+    }
+    if (fd_count == 0) {
+        return 0;
+    }
+
+    if (store->count >= store->max) {
+        close_fds(fds, fd_count);
+        errno = ENOSPC;
+        return -1;
+    }
+    if (store->count == store->capacity) {
+        int capacity = store->capacity ? store->capacity * 2 : 64;
+        fdstore_entry_t **entries = realloc(store->entries, capacity * sizeof(*entries));
+        if (entries == NULL) {
+            close_fds(fds, fd_count);
+            return -1;
+        }
+        store->entries = entries;
+        store->capacity = capacity;
+    }
+
+    fdstore_entry_t *entry = calloc(1, sizeof(*entry));
+    if (entry == NULL) {
+        close_fds(fds, fd_count);
+        return -1;
+    }
+    memcpy(entry->fds, fds, fd_count * sizeof(int));
+    entry->fd_count = fd_count;
+    entry->name = strdup(name);
+    entry->metadata = malloc(metadata_length + 1);
+    if (entry->name == NULL || entry->metadata == NULL) {
+        free_entry(entry);
+        errno = ENOMEM;
+        return -1;
+    }
+    memcpy(entry->metadata, metadata, metadata_length);
+    entry->metadata_length = metadata_length;
+    if (tsearch(entry, &store->index, compare_entries) == NULL) {
+        free_entry(entry);
+        errno = ENOMEM;
+        return -1;
+    }
+    entry->index = store->count;
+    store->entries[store->count++] = entry;
+    return 0;
+}
+
+int fdstore_get(const fdstore_t *store, int first, stored_fds_t *entries,
+                int max_entries, int *fds, int max_fds, void **snapshot) {
+    // Pick the entries, then copy their names and metadata in one block
+    int count = 0, fd_count = 0;
+    size_t size = 0;
+    while (first + count < store->count && count < max_entries &&
+           fd_count + store->entries[first + count]->fd_count <= max_fds) {
+        const fdstore_entry_t *entry = store->entries[first + count++];
+        fd_count += entry->fd_count;
+        size += strlen(entry->name) + 1 + entry->metadata_length;
+    }
+    char *copy = malloc(size + 1);
+    if (copy == NULL) {
+        return -1;
+    }
+
+    int ndup = 0;
+    *snapshot = copy;
+    for (int i = 0; i < count; i++) {
+        const fdstore_entry_t *entry = store->entries[first + i];
+        for (int j = 0; j < entry->fd_count; j++) {
+            fds[ndup] = fcntl(entry->fds[j], F_DUPFD_CLOEXEC, 0);
+            if (fds[ndup] == -1) {
+                int saved_errno = errno;
+                close_fds(fds, ndup);
+                free(*snapshot);
+                errno = saved_errno;
+                return -1;
+            }
+            ndup++;
+        }
+        entries[i].name = copy;
+        copy = stpcpy(copy, entry->name) + 1;
+        entries[i].metadata = copy;
+        memcpy(copy, entry->metadata, entry->metadata_length);
+        copy += entry->metadata_length;
+        entries[i].metadata_length = entry->metadata_length;
+        entries[i].fd_count = entry->fd_count;
+    }
+    return count;
+}
+
+// tdestroy() callback
+static void free_node(void *node) {
+    free_entry(node);
+}
+
+void fdstore_free(fdstore_t *store) {
+    tdestroy(store->index, free_node);
+    free(store->entries);
+    store->entries = NULL;
+    store->index = NULL;
+    store->count = 0;
+    store->capacity = 0;
+}
@@ -0,0 +1,46 @@
+#ifndef FDSTORE_H
+#define FDSTORE_H
+
+#include <stddef.h>
+#include "protocol.h"
+
+// A named set of descriptors with its metadata
+typedef struct {
+    char *name;
+    int fds[MAX_STORED_FDS];
+    int fd_count;
+    size_t metadata_length;
+    char *metadata;
+    int index;          // position in the store's entries
+} fdstore_entry_t;
+
+// Descriptors deposited by clients, kept across their restarts. Entries
+// are looked up by name through a tsearch() tree and listed in an array,
+// so that they can be handed out in chunks. Not thread-safe.
+typedef struct {
+    fdstore_entry_t **entries;
+    int count;
+    int capacity;
+    int max;            // entries allowed, 0 if the store is disabled
+    void *index;        // tsearch() tree keyed by name
+} fdstore_t;
+
+// Store fds and metadata under name, replacing (and closing) whatever was
+// there. The store takes over the descriptors, also on failure. With no
+// descriptors, the entry is removed. Returns 0, or -1 with errno ENOSPC
+// if the store is full or disabled.
+int fdstore_put(fdstore_t *store, const char *name, const int *fds, int fd_count,
+                const void *metadata, size_t metadata_length);
+
+// Copy out the entries from first on, as many as fit in max_entries
+// entries and max_fds descriptors. The copies' names and metadata point
+// into *snapshot, to be released with free(); the descriptors stored into
+// fds are duplicates, close-on-exec, in entry order. Returns the number
+// of entries copied, or -1 on error.
+int fdstore_get(const fdstore_t *store, int first, stored_fds_t *entries,
+                int max_entries, int *fds, int max_fds, void **snapshot);
+
+// Close every stored descriptor and release the store
+void fdstore_free(fdstore_t *store);
+
+#endif
@@ -87,6 +87,7 @@ sh ./test_quick.sh || echo "Tests require agent to be running"
 %doc %{_docdir}/%{name}/README.md
 %doc %{_docdir}/%{name}/TESTING.md
 %{_bindir}/holden-orchestrator
+%config(noreplace) %{_sysconfdir}/%{name}/services.conf
 
 %files agent
 %license %{_docdir}/%{name}/LICENSE
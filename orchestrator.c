@@ -3,326 +3,3495 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/syscall.h>
-#include <sys/poll.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <time.h>
+#include <search.h>
+#include <poll.h>
+#include <pwd.h>
+#include <grp.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
 #include "protocol.h"
+#include "client.h"
+#include "spawn.h"
+#include "config.h"
 
-// Signal handler for SIGCHLD to reap zombie children
-void sigchld_handler(int sig) {
-    (void)sig; // Unused parameter
-    int status;
+// (Re)connect to the agent if the persistent connection is down
+int ensure_agent(agent_conn_t *conn) {
+    if (conn->fd != -1) {
+        return 0;
+    }
+    return agent_connect(conn);
+}
+
+// Spawn a process locally and return its pidfd, and its PID in *pid. The
+// descriptors in fds (if any) are installed in the child; envp, if not
+// NULL, replaces our environment. The last listen_fds of them are
+// announced as listening sockets.
+int spawn_local_process(const char *cmd, char *const args[], char *const envp[],
+                        const spawn_fd_t *fds, int fd_count, int listen_fds, pid_t *pid) {
+    sigset_t unblocked;
+    sigemptyset(&unblocked);
+    spawn_attr_t attr = {.file = cmd, .argv = args, .envp = envp, .fds = fds,
+                         .fd_count = fd_count, .listen_fds = listen_fds,
+                         .sigmask = &unblocked};
+    int pidfd = spawn_process(&attr, pid);
+    if (pidfd == -1) {
+        fprintf(stderr, "Failed to spawn %s: %s\n", cmd, strerror(errno));
+        return -1;
+    }
+
+    printf("Spawned local process %s with PID %d, pidfd %d\n", cmd, *pid, pidfd);
+    return pidfd;
+}
+
+// Ask the agent to spawn a process without waiting for the reply, so
+// that several requests can be in flight. The descriptors in fds (if any)
+// are passed to the agent and installed in the child. settings, if not
+// NULL, supplies the optional parts of the request (resource limits).
+// Returns 0 and the ID to wait for in *request_id, or -1 on error.
+int send_agent_request(agent_conn_t *conn, const start_process_msg_t *settings,
+                       const char *cmd, char *const args[],
+                       const spawn_fd_t *fds, int fd_count, uint32_t *request_id) {
+    if (fd_count > MAX_PASSED_FDS) {
+        fprintf(stderr, "Too many descriptors for %s: %d\n", cmd, fd_count);
+        return -1;
+    }
+
+    if (ensure_agent(conn) == -1) {
+        return -1;
+    }
+
+    // Prepare start process message
+    message_t request = {0};
+    request.header.type = MSG_START_PROCESS;
+    if (settings != NULL) {
+        request.data.start_process = *settings;
+    }
+    request.data.start_process.argv = args;
+
+    int passed_fds[MAX_PASSED_FDS];
+    request.data.start_process.fd_count = fd_count;
+    for (int i = 0; i < fd_count; i++) {
+        passed_fds[i] = fds[i].fd;
+        request.data.start_process.fd_targets[i] = fds[i].target;
+    }
+
+    // Send request to agent along with the child's descriptors
+    int result = agent_send(conn, &request, passed_fds, fd_count, request_id);
+    message_free(&request);
+    if (result == -1) {
+        perror("send to agent");
+        agent_disconnect(conn);
+        return -1;
+    }
+    return 0;
+}
+
+// Wait for the reply to a send_agent_request() and return the pidfd of
+// the process, storing its PID in *pid.
+int recv_agent_pidfd(agent_conn_t *conn, uint32_t request_id, const char *cmd,
+                     pid_t *pid) {
+    agent_reply_t *reply = agent_wait(conn, request_id);
+    if (reply == NULL) {
+        perror("recv from agent");
+        agent_disconnect(conn);
+        return -1;
+    }
+
+    if (reply->msg.header.type != MSG_PROCESS_STARTED) {
+        fprintf(stderr, "Agent failed to start process: %s\n",
+                reply->msg.data.process_error.error);
+        agent_reply_free(reply);
+        return -1;
+    }
+
+    int pidfd = reply->fds[0];
+    reply->fds[0] = -1;
+    *pid = reply->msg.data.process_started.host_pid;
+    printf("Spawned agent process %s with PID %d, pidfd %d\n", cmd, *pid, pidfd);
+
+    agent_reply_free(reply);
+    return pidfd;
+}
+
+// Spawn a process via the agent and return its pidfd. The descriptors in
+// fds (if any) are passed to the agent and installed in the child.
+int spawn_agent_process(agent_conn_t *conn, const char *cmd, char *const args[],
+                        const spawn_fd_t *fds, int fd_count) {
+    uint32_t request_id;
+    if (send_agent_request(conn, NULL, cmd, args, fds, fd_count, &request_id) == -1) {
+        return -1;
+    }
+    pid_t pid;
+    return recv_agent_pidfd(conn, request_id, cmd, &pid);
+}
+
+// Spawn count processes via the agent in batches of up to
+// MAX_BATCH_SIZE, all sent before waiting for the first reply.
+// pidfds[i] receives the pidfd of commands[i], or -1 if it could not be
+// started. Returns the number of processes started, or -1 if the agent
+// could not be reached.
+int spawn_agent_batch(agent_conn_t *conn, char **const commands[], int count,
+                      int *pidfds) {
+    for (int i = 0; i < count; i++) {
+        pidfds[i] = -1;
+    }
+
+    if (ensure_agent(conn) == -1) {
+        return -1;
+    }
+
+    int nbatches = (count + MAX_BATCH_SIZE - 1) / MAX_BATCH_SIZE;
+    start_process_msg_t *processes = calloc(count, sizeof(*processes));
+    uint32_t *request_ids = calloc(nbatches, sizeof(*request_ids));
+    if (processes == NULL || request_ids == NULL) {
+        perror("calloc");
+        free(processes);
+        free(request_ids);
+        return -1;
+    }
+
+    message_t msg = {0};
+    int sent = 0;
+    for (; sent < nbatches; sent++) {
+        int first = sent * MAX_BATCH_SIZE;
+        int chunk = count - first < MAX_BATCH_SIZE ? count - first : MAX_BATCH_SIZE;
+
+        for (int i = 0; i < chunk; i++) {
+            processes[first + i].argv = commands[first + i];
+        }
+        memset(&msg.header, 0, sizeof(msg.header));
+        msg.header.type = MSG_START_BATCH;
+        msg.data.start_batch.count = chunk;
+        msg.data.start_batch.processes = processes + first;
+
+        if (agent_send(conn, &msg, NULL, 0, &request_ids[sent]) == -1) {
+            perror("send to agent");
+            break;
+        }
+    }
+    message_free(&msg);
+
+    int started = 0;
+    int failed = sent < nbatches;
+    for (int batch = 0; batch < sent; batch++) {
+        int first = batch * MAX_BATCH_SIZE;
+        int chunk = count - first < MAX_BATCH_SIZE ? count - first : MAX_BATCH_SIZE;
+
+        agent_reply_t *reply = agent_wait(conn, request_ids[batch]);
+        if (reply == NULL) {
+            perror("recv from agent");
+            failed = 1;
+            break;
+        }
+        if (reply->msg.header.type != MSG_BATCH_STARTED ||
+            reply->msg.data.batch_started.count != (uint32_t)chunk) {
+            fprintf(stderr, "Agent failed to start batch: %s\n",
+                    reply->msg.header.type == MSG_PROCESS_ERROR ?
+                    reply->msg.data.process_error.error : "unexpected reply");
+            agent_reply_free(reply);
+            continue;
+        }
+
+        // The pidfds of the started entries come in entry order
+        const batch_result_t *results = reply->msg.data.batch_started.results;
+        int next = 0;
+        for (int i = 0; i < chunk; i++) {
+            if (results[i].error != 0) {
+                fprintf(stderr, "Agent failed to start %s: %s\n",
+                        commands[first + i][0], strerror(results[i].error));
+                continue;
+            }
+            pidfds[first + i] = reply->fds[next];
+            reply->fds[next++] = -1;
+            started++;
+            printf("Spawned agent process %s with PID %d, pidfd %d\n",
+                   commands[first + i][0], results[i].host_pid, pidfds[first + i]);
+        }
+        agent_reply_free(reply);
+    }
+
+    if (failed) {
+        agent_disconnect(conn);
+    }
+    free(processes);
+    free(request_ids);
+    return started;
+}
+
+#define MAX_EVENTS 64
+// Agent requests in flight at once. Replies are only read once the whole
+// group is sent, so the group has to fit in the socket buffers.
+#define MAX_PIPELINED_STARTS 64
+// First delay before restarting a service that keeps failing, doubled on
+// each further failure up to MAX_RESTART_DELAY_MS
+#define DEFAULT_RESTART_DELAY_MS 100
+#define MAX_RESTART_DELAY_MS (60 * 1000)
+// Used when agent.conf doesn't set MAX_RESTART_ATTEMPTS/MONITOR_INTERVAL
+#define DEFAULT_MAX_RESTART_ATTEMPTS 3
+#define DEFAULT_MONITOR_INTERVAL 10
+// cpu.max period when CPU_MAX only gives the quota
+#define DEFAULT_CPU_PERIOD 100000
+// Pipe buffer asked for captured output, and the most moved per splice()
+#define OUTPUT_PIPE_SIZE (1024 * 1024)
+// Health checks: seconds between checks, seconds a check may take, and
+// failures in a row that get a service restarted
+#define DEFAULT_HEALTH_INTERVAL 10
+#define DEFAULT_HEALTH_TIMEOUT 5
+#define DEFAULT_HEALTH_RETRIES 3
+// Seconds a service gets to exit after its stop signal before SIGKILL
+#define DEFAULT_STOP_TIMEOUT 10
+// Stop deadlines sit in a timer wheel of STOP_WHEEL_SLOTS slots, one per
+// tick; deadlines further out than a turn stay in their slot for more
+// turns
+#define STOP_WHEEL_SLOTS 256
+#define STOP_WHEEL_TICK_MS 100
+// Largest REPLICAS or scale count of a replicated service
+#define MAX_REPLICAS 10000
+// Longest command line taken on the control socket
+#define CONTROL_LINE_MAX 256
+// LISTEN sockets of a service; they are kept in one descriptor store entry
+#define MAX_LISTEN_SOCKETS MAX_STORED_FDS
+
+typedef enum {
+    SERVICE_AGENT,  // spawned by the holden agent
+    SERVICE_LOCAL   // spawned by the orchestrator itself
+} service_mode_t;
+
+typedef enum {
+    RESTART_ALWAYS,
+    RESTART_ON_FAILURE,  // unless it exited with status 0
+    RESTART_NEVER
+} restart_policy_t;
+
+// Besides the restart timer (NULL), the agent connection, the signalfd
+// and the control socket, epoll events point to a service (its pidfd) or to one of
+// the descriptors a service has besides; all start with their kind
+typedef enum {
+    WATCH_SERVICE,
+    WATCH_OUTPUT,           // service_output_t
+    WATCH_NOTIFY,           // service_watch_t: the notification socket
+    WATCH_TIMER,            // the readiness/health timer
+    WATCH_CHECK,            // the health check in progress
+    WATCH_CONTROL,          // control_client_t
+    WATCH_LISTEN,           // service_listener_t
+    WATCH_IDLE              // the idle timer of an on-demand service
+} watch_kind_t;
+
+struct service;
+
+// A descriptor watched on behalf of a service
+typedef struct {
+    watch_kind_t kind;
+    struct service *service;
+    int fd;                 // -1 if none
+} service_watch_t;
+
+typedef enum {
+    CHECK_NONE,
+    CHECK_EXEC,             // run a command, healthy if it exits with 0
+    CHECK_CONNECT           // healthy if a stream connection succeeds
+} check_type_t;
+
+// A listening socket bound for a service with LISTEN, and passed to
+// every run. It is watched for connections while an ON_DEMAND service
+// waits for one, or has an IDLE_TIMEOUT.
+typedef struct {
+    watch_kind_t kind;
+    struct service *service;
+    int fd;                 // -1 until bound
+    struct sockaddr_storage address;
+    socklen_t address_length;
+} service_listener_t;
+
+// Captured stdout/stderr of a service with LOG_FILE: one pipe for the
+// service's lifetime, whose write end is fd 1 and 2 of every run, and
+// whose contents are spliced into the log file as they arrive, without
+// passing through our memory
+typedef struct {
+    watch_kind_t kind;
+    struct service *service;
+    int read_fd;            // -1 unless the output is captured
+    int write_fd;
+    int log_fd;
+    off_t log_offset;       // splice() can't write to O_APPEND files
+    uint64_t bytes;         // forwarded to the log
+} service_output_t;
+
+// A supervised process. While it runs, its pidfd is registered in the
+// supervisor's epoll set with the service as event data, so an exit is
+// dispatched without scanning the other services.
+typedef struct service {
+    watch_kind_t kind;
+    char *name;
+    char **args;            // from split_command()
+    service_mode_t mode;
+    int attach_output;      // hand our stdout/stderr to the process
+    char *log_file;         // capture stdout/stderr into this file
+    service_output_t output;
+    int pidfd;              // -1 while not running
+    uint32_t request_id;    // agent request in flight while starting
+    start_process_msg_t settings;  // optional request fields (agent mode)
+    // Storage for the vectors settings points to
+    char **environment;     // strdup()ed NAME=value strings
+    int environment_count;
+    process_rlimit_t rlimits[MAX_SPAWN_RLIMITS];
+    uint32_t *cpus;
+    int has_group;          // GROUP given, USER doesn't pick it
+
+    // Readiness: with NOTIFY, the process gets a NOTIFY_SOCKET (an
+    // abstract datagram socket of its own) and isn't ready until it
+    // sends READY=1 there, like with sd_notify()
+    int notify;
+    service_watch_t notify_socket;
+    char **notify_environment;  // ours or ENVIRONMENT, plus NOTIFY_SOCKET
+    long ready_timeout;     // seconds, 0 for none
+    int ready;
+
+    // Health checks, run every health_interval seconds while ready. The
+    // process is killed, and restarted by its policy, when it hangs
+    // before READY=1 or fails health_retries checks in a row.
+    check_type_t check_type;
+    char **check_args;      // CHECK_EXEC, from split_command()
+    struct sockaddr_storage check_address;  // CHECK_CONNECT
+    socklen_t check_address_length;
+    long health_interval;
+    long health_timeout;
+    long health_retries;
+    int check_failures;     // in a row
+    service_watch_t timer;  // timerfd for readiness and checks
+    service_watch_t check;  // pidfd or socket of the running check
+
+    // Stopping: stop_signal, then SIGKILL if the process still runs
+    // stop_timeout seconds later. At shutdown, a service is stopped once
+    // the services depending on it have exited.
+    int stop_signal;
+    long stop_timeout;
+    char *depends_on;       // DEPENDS_ON, service names
+    struct service **depends;
+    int depend_count;
+    int dependents;         // running services that depend on this one
+    int stopping;           // stopped on purpose, not to be restarted
+    uint64_t stop_deadline; // ms, when SIGKILL is due
+    struct service *wheel_next;   // in its stop wheel slot
+    struct service **wheel_prev;  // NULL if not in the wheel
+
+    restart_policy_t restart;
+    long restart_delay;     // ms, first backoff step
+    long max_attempts;      // restarts allowed per interval, 0 for no limit
+    long interval;          // seconds; a shorter run counts as a failure
+    uint64_t started_at;    // ms on the monotonic clock
+    int failures;           // consecutive short runs or failed starts
+    uint64_t window_start;  // start of the interval attempts are counted in
+    int attempts;
+    uint64_t restart_at;    // when a delayed restart is due
+    int timer_index;        // position in the restart queue, -1 if none
+
+    // An agent service's exit is known from its pidfd, its status and
+    // resource usage from the agent's MSG_PROCESS_EXITED: the run is over
+    // once both have arrived, or the agent connection is gone
     pid_t pid;
+    unsigned int session;   // agent connection the report comes on
+    int exit_flags;         // EXIT_*
+    process_exited_msg_t exit;
+    // Taken over from a previous orchestrator through the agent's
+    // descriptor store: not our child, and no exit report comes
+    int adopted;
+
+    // Counters over all runs
+    unsigned long starts;
+    unsigned long exits;
+    unsigned long failed_exits;  // non-zero status or killed
+    int last_status;        // waitpid() format, -1 if unknown
+    uint64_t runtime_ms;
+    uint64_t utime_us;
+    uint64_t stime_us;
+    uint64_t maxrss_kb;     // largest of any run
+    unsigned long failed_checks;
+    unsigned long hung;     // killed for not being ready or healthy
+
+    // Replication: a section with REPLICAS is a template, which never
+    // runs itself. Its replicas, NAME@1, NAME@2..., are services sharing
+    // its settings, added and removed by scaling.
+    int replicated;         // REPLICAS given
+    long replicas;          // REPLICAS, the number to start with
+    struct service **instances;  // of a template: its replicas by number
+    int instance_count;
+    int instance_capacity;
+    struct service *template;    // of a replica, NULL otherwise
+    int replica;            // number of a replica
+    int retired;            // scaled down, freed once it has stopped
+
+    // Socket activation: the LISTEN sockets are fds 3, 4... of every run,
+    // announced in LISTEN_FDS and LISTEN_PID as sd_listen_fds() expects.
+    // An ON_DEMAND service is only started by a connection, and with
+    // IDLE_TIMEOUT stopped again once that long passes without a new
+    // one. The listeners are watched once per timeout meanwhile
+    // (EPOLLONESHOT), so a busy service costs one wakeup per timeout.
+    service_listener_t *listeners;
+    int listener_count;
+    int on_demand;
+    long idle_timeout;      // seconds, 0 for none
+    service_watch_t idle_timer;
+    int waiting;            // not running, waiting for a connection
+    int active;             // a connection came during this idle period
+    int idle_stopped;       // stopped for being idle
+} service_t;
+
+#define EXIT_PIDFD    0x1   // the pidfd reported the exit
+#define EXIT_REPORTED 0x2   // the agent sent the exit status
+
+// Descriptor store entry of a service: its pidfd, then its output pipe
+// (read and write ends) and its notification socket if flagged in the
+// metadata, "holden1 PID STARTED_AT FLAGS"
+#define STORED_OUTPUT 0x1
+#define STORED_NOTIFY 0x2
+
+// A client of the control socket. Commands are lines of text, read
+// without blocking and answered with a line starting with OK or ERROR,
+// after any lines of data.
+typedef struct control_client {
+    watch_kind_t kind;      // WATCH_CONTROL
+    int fd;
+    size_t length;          // of the incomplete line in line
+    char line[CONTROL_LINE_MAX];
+    struct control_client *next;
+} control_client_t;
+
+typedef struct {
+    int epfd;
+    agent_conn_t agent;
+    service_t **services;
+    int count;
+    int capacity;
+    int running;
+    int restart_count;
+
+    // Delayed restarts, a binary min-heap on restart_at. A single timerfd
+    // is armed for the earliest one.
+    int timerfd;
+    service_t **timers;
+    int timer_count;
+    int timer_capacity;
+    uint64_t timer_armed;   // deadline the timerfd is set to, 0 if none
+
+    // Agent services that have exited, waiting for the agent's report
+    void *reports;          // tsearch() tree keyed by pid
+    int awaiting_reports;   // of them, whose pidfd has fired
+    unsigned int reports_session;  // agent connection last checked
+
+    int signalfd;           // SIGUSR1 prints the counters, SIGTERM and
+                            // SIGINT stop everything
+
+    // Services sent their stop signal and not exited yet, hashed by
+    // deadline into the slots of a timer wheel. A single periodic timerfd
+    // ticks while the wheel isn't empty, however many processes are
+    // being stopped.
+    int stop_timerfd;
+    service_t *stop_wheel[STOP_WHEEL_SLOTS];
+    int stop_count;
+    uint64_t stop_tick;     // last tick processed
+    int shutting_down;
+    uint64_t shutdown_started;  // ms
+
+    // The agent keeps the descriptors of running services in its store
+    // (FD_STORE_MAX), so that SIGUSR2 or a crash leaves them to be
+    // adopted by the next orchestrator
+    int fd_store;
+    int detached;           // SIGUSR2: exit, leaving the services running
+
+    // Replicated services, scaled through the control socket
+    service_t **templates;
+    int template_count;
+    int retired;            // scaled-down replicas not freed yet
+    int controlfd;          // -1 without --control
+    int waiting;            // on-demand services waiting for a connection
+    control_client_t *clients;
+
+    // Defaults for new services
+    long max_attempts;
+    long interval;
+} supervisor_t;
+
+// Milliseconds on the monotonic clock
+uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Current time for log lines
+const char *timestamp(void) {
+    time_t now = time(NULL);
+    char *time_str = ctime(&now);
+    time_str[strlen(time_str) - 1] = '\0'; // Remove newline
+    return time_str;
+}
+
+// Append a service with default settings
+service_t *add_service(supervisor_t *sup, const char *name) {
+    if (sup->count == sup->capacity) {
+        int capacity = sup->capacity ? sup->capacity * 2 : 16;
+        service_t **services = realloc(sup->services, capacity * sizeof(*services));
+        if (services == NULL) {
+            perror("realloc");
+            return NULL;
+        }
+        sup->services = services;
+        sup->capacity = capacity;
+    }
+
+    service_t *service = calloc(1, sizeof(*service));
+    if (service == NULL || (service->name = strdup(name)) == NULL) {
+        perror("calloc");
+        free(service);
+        return NULL;
+    }
+    service->kind = WATCH_SERVICE;
+    service->mode = SERVICE_AGENT;
+    service->output.kind = WATCH_OUTPUT;
+    service->output.service = service;
+    service->output.read_fd = -1;
+    service->output.write_fd = -1;
+    service->output.log_fd = -1;
+    service->notify_socket = (service_watch_t){WATCH_NOTIFY, service, -1};
+    service->timer = (service_watch_t){WATCH_TIMER, service, -1};
+    service->check = (service_watch_t){WATCH_CHECK, service, -1};
+    service->idle_timer = (service_watch_t){WATCH_IDLE, service, -1};
+    service->health_interval = DEFAULT_HEALTH_INTERVAL;
+    service->health_timeout = DEFAULT_HEALTH_TIMEOUT;
+    service->health_retries = DEFAULT_HEALTH_RETRIES;
+    service->stop_signal = SIGTERM;
+    service->stop_timeout = DEFAULT_STOP_TIMEOUT;
+    service->pidfd = -1;
+    service->restart = RESTART_ALWAYS;
+    service->restart_delay = DEFAULT_RESTART_DELAY_MS;
+    service->max_attempts = sup->max_attempts;
+    service->interval = sup->interval;
+    service->timer_index = -1;
+    service->last_status = -1;
+    sup->services[sup->count++] = service;
+    return service;
+}
+
+// Parse the settings shared by agent.conf and the service file. Returns
+// 1 if key was one of them, 0 if not, -1 if the value is invalid.
+int restart_setting(const char *key, const char *value, int line,
+                    long *max_attempts, long *interval) {
+    long number;
+    if (strcmp(key, "MAX_RESTART_ATTEMPTS") == 0) {
+        if (config_number(value, &number) == -1) {
+            fprintf(stderr, "line %d: invalid MAX_RESTART_ATTEMPTS %s\n", line, value);
+            return -1;
+        }
+        *max_attempts = number;
+        return 1;
+    }
+    if (strcmp(key, "MONITOR_INTERVAL") == 0) {
+        if (config_number(value, &number) == -1 || number == 0) {
+            fprintf(stderr, "line %d: invalid MONITOR_INTERVAL %s\n", line, value);
+            return -1;
+        }
+        *interval = number;
+        return 1;
+    }
+    return 0;
+}
+
+// config_parse() handler for agent.conf, which provides the restart
+// limits of services that don't set their own
+int default_setting(void *ctx, const char *section, const char *key,
+                    const char *value, int line) {
+    supervisor_t *sup = ctx;
+    (void)section;
+    return restart_setting(key, value, line, &sup->max_attempts, &sup->interval) == -1;
+}
+
+// What a service runs, for messages
+const char *service_command(const service_t *service) {
+    return service->args != NULL ? service->args[0] : service->settings.profile;
+}
+
+// Parse a size in bytes with an optional K, M or G suffix
+int parse_size(const char *value, uint64_t *size) {
+    char *end;
+    errno = 0;
+    unsigned long long number = strtoull(value, &end, 10);
+    if (errno != 0 || end == value || *value == '-') {
+        return -1;
+    }
+    int shift = 0;
+    switch (*end) {
+        case 'K': case 'k': shift = 10; end++; break;
+        case 'M': case 'm': shift = 20; end++; break;
+        case 'G': case 'g': shift = 30; end++; break;
+    }
+    if (*end != '\0' || number == 0 || number > (UINT64_MAX >> shift)) {
+        return -1;
+    }
+    *size = (uint64_t)number << shift;
+    return 0;
+}
+
+// Resource limits settable as LIMIT_<NAME>
+static const struct {
+    const char *name;
+    int resource;
+} rlimit_names[] = {
+    {"AS", RLIMIT_AS}, {"CORE", RLIMIT_CORE}, {"CPU", RLIMIT_CPU},
+    {"DATA", RLIMIT_DATA}, {"FSIZE", RLIMIT_FSIZE}, {"LOCKS", RLIMIT_LOCKS},
+    {"MEMLOCK", RLIMIT_MEMLOCK}, {"MSGQUEUE", RLIMIT_MSGQUEUE},
+    {"NICE", RLIMIT_NICE}, {"NOFILE", RLIMIT_NOFILE}, {"NPROC", RLIMIT_NPROC},
+    {"RSS", RLIMIT_RSS}, {"RTPRIO", RLIMIT_RTPRIO}, {"RTTIME", RLIMIT_RTTIME},
+    {"SIGPENDING", RLIMIT_SIGPENDING}, {"STACK", RLIMIT_STACK},
+};
+
+// Parse one value of a resource limit: a number or "infinity"
+int parse_rlimit_value(const char *value, uint64_t *out) {
+    if (strcmp(value, "infinity") == 0) {
+        *out = RLIM_INFINITY;
+        return 0;
+    }
+    long number;
+    if (config_number(value, &number) == -1) {
+        return -1;
+    }
+    *out = number;
+    return 0;
+}
+
+// LIMIT_<NAME> = SOFT[:HARD], HARD defaulting to SOFT
+int rlimit_setting(service_t *service, const char *key, const char *value, int line) {
+    int resource = -1;
+    for (size_t i = 0; i < sizeof(rlimit_names) / sizeof(rlimit_names[0]); i++) {
+        if (strcmp(key + strlen("LIMIT_"), rlimit_names[i].name) == 0) {
+            resource = rlimit_names[i].resource;
+        }
+    }
+    if (resource == -1) {
+        fprintf(stderr, "line %d: unknown resource limit %s\n", line, key);
+        return -1;
+    }
+
+    char soft[32], hard[32];
+    const char *colon = strchr(value, ':');
+    size_t soft_length = colon != NULL ? (size_t)(colon - value) : strlen(value);
+    if (soft_length >= sizeof(soft) || (colon != NULL && strlen(colon + 1) >= sizeof(hard))) {
+        fprintf(stderr, "line %d: invalid %s %s\n", line, key, value);
+        return -1;
+    }
+    memcpy(soft, value, soft_length);
+    soft[soft_length] = '\0';
+    strcpy(hard, colon != NULL ? colon + 1 : soft);
+
+    start_process_msg_t *settings = &service->settings;
+    uint32_t index = 0;
+    while (index < settings->rlimit_count && service->rlimits[index].resource != (uint32_t)resource) {
+        index++;
+    }
+    process_rlimit_t *limit = &service->rlimits[index];
+    if (parse_rlimit_value(soft, &limit->soft) == -1 ||
+        parse_rlimit_value(hard, &limit->hard) == -1 || limit->soft > limit->hard) {
+        fprintf(stderr, "line %d: invalid %s %s\n", line, key, value);
+        return -1;
+    }
+    limit->resource = resource;
+    if (index == settings->rlimit_count) {
+        settings->rlimit_count++;
+    }
+    settings->rlimits = service->rlimits;
+    settings->options |= SPAWN_OPT_RLIMITS;
+    return 0;
+}
+
+// CPU_AFFINITY: a list of CPUs and ranges, like 0-3,8
+int affinity_setting(service_t *service, const char *value, int line) {
+    uint32_t count = 0;
+    uint32_t *cpus = NULL;
+    const char *p = value;
+    while (1) {
+        char *end;
+        unsigned long first = strtoul(p, &end, 10);
+        unsigned long last = first;
+        if (end != p && *end == '-') {
+            p = end + 1;
+            last = strtoul(p, &end, 10);
+        }
+        if (end == p || last < first || last >= MAX_SPAWN_CPUS ||
+            count + (last - first + 1) > MAX_SPAWN_CPUS) {
+            fprintf(stderr, "line %d: invalid CPU_AFFINITY %s\n", line, value);
+            free(cpus);
+            return -1;
+        }
+        uint32_t *grown = realloc(cpus, (count + last - first + 1) * sizeof(*cpus));
+        if (grown == NULL) {
+            perror("realloc");
+            free(cpus);
+            return -1;
+        }
+        cpus = grown;
+        for (unsigned long cpu = first; cpu <= last; cpu++) {
+            cpus[count++] = cpu;
+        }
+        if (*end == '\0') {
+            break;
+        }
+        if (*end != ',') {
+            fprintf(stderr, "line %d: invalid CPU_AFFINITY %s\n", line, value);
+            free(cpus);
+            return -1;
+        }
+        p = end + 1;
+    }
+
+    free(service->cpus);
+    service->cpus = cpus;
+    service->settings.cpus = cpus;
+    service->settings.cpu_count = count;
+    service->settings.options |= SPAWN_OPT_AFFINITY;
+    return 0;
+}
+
+// IO_PRIORITY: CLASS[:LEVEL], CLASS realtime, best-effort or idle and
+// LEVEL 0 (highest) to 7, default 4
+int ioprio_setting(service_t *service, const char *value, int line) {
+    static const char *const classes[] = {"realtime", "best-effort", "idle"};
+    const char *colon = strchr(value, ':');
+    size_t length = colon != NULL ? (size_t)(colon - value) : strlen(value);
+    long level = 4;
+    int class = 0;
+    while (class < 3 && (strlen(classes[class]) != length ||
+                         strncmp(value, classes[class], length) != 0)) {
+        class++;
+    }
+    if (class == 3 || (colon != NULL && (config_number(colon + 1, &level) == -1 || level > 7))) {
+        fprintf(stderr, "line %d: IO_PRIORITY must be realtime, best-effort or idle "
+                "with an optional :LEVEL\n", line);
+        return -1;
+    }
+    // IOPRIO_CLASS_RT is 1; the idle class has no levels
+    service->settings.ioprio = (uint32_t)(class + 1) << 13 | (class == 2 ? 0 : level);
+    service->settings.options |= SPAWN_OPT_IOPRIO;
+    return 0;
+}
+
+// USER and GROUP: a name or a number. USER also picks the user's
+// primary group unless GROUP is given.
+int credentials_setting(service_t *service, const char *key, const char *value,
+                        int line) {
+    start_process_msg_t *settings = &service->settings;
+    long number;
+    int numeric = config_number(value, &number) == 0;
+    if (strcmp(key, "USER") == 0) {
+        struct passwd *pw = numeric ? getpwuid(number) : getpwnam(value);
+        if (pw == NULL && !numeric) {
+            fprintf(stderr, "line %d: unknown user %s\n", line, value);
+            return -1;
+        }
+        settings->uid = numeric ? (uint32_t)number : pw->pw_uid;
+        if (!service->has_group) {
+            settings->gid = pw != NULL ? pw->pw_gid : settings->uid;
+        }
+    } else {
+        struct group *gr = numeric ? NULL : getgrnam(value);
+        if (gr == NULL && !numeric) {
+            fprintf(stderr, "line %d: unknown group %s\n", line, value);
+            return -1;
+        }
+        settings->gid = numeric ? (uint32_t)number : gr->gr_gid;
+        service->has_group = 1;
+        if (!(settings->options & SPAWN_OPT_CREDENTIALS)) {
+            settings->uid = getuid();
+        }
+    }
+    settings->options |= SPAWN_OPT_CREDENTIALS;
+    return 0;
+}
+
+// ENVIRONMENT: one NAME=value per line; the process gets only these
+int environment_setting(service_t *service, const char *value, int line) {
+    if (strchr(value, '=') == NULL) {
+        fprintf(stderr, "line %d: ENVIRONMENT must be NAME=value\n", line);
+        return -1;
+    }
+    char **environment = realloc(service->environment,
+                                 (service->environment_count + 2) * sizeof(char *));
+    if (environment == NULL) {
+        perror("realloc");
+        return -1;
+    }
+    service->environment = environment;
+    environment[service->environment_count] = strdup(value);
+    if (environment[service->environment_count] == NULL) {
+        perror("strdup");
+        return -1;
+    }
+    environment[++service->environment_count] = NULL;
+    service->settings.envp = environment;
+    service->settings.options |= SPAWN_OPT_ENV;
+    return 0;
+}
+
+// Parse a Unix socket path or IPv4:PORT. Returns 0, or -1 if invalid.
+int parse_address(const char *address, struct sockaddr_storage *storage,
+                  socklen_t *length, int line) {
+    memset(storage, 0, sizeof(*storage));
+    if (*address == '/') {
+        struct sockaddr_un *un = (struct sockaddr_un *)storage;
+        if (strlen(address) >= sizeof(un->sun_path)) {
+            fprintf(stderr, "line %d: socket path too long\n", line);
+            return -1;
+        }
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, address);
+        *length = sizeof(*un);
+        return 0;
+    }
+
+    struct sockaddr_in *in = (struct sockaddr_in *)storage;
+    char host[INET_ADDRSTRLEN];
+    const char *colon = strrchr(address, ':');
+    long port;
+    if (colon == NULL || (size_t)(colon - address) >= sizeof(host) ||
+        config_number(colon + 1, &port) == -1 || port == 0 || port > 65535) {
+        fprintf(stderr, "line %d: invalid address %s\n", line, address);
+        return -1;
+    }
+    memcpy(host, address, colon - address);
+    host[colon - address] = '\0';
+    if (inet_pton(AF_INET, host, &in->sin_addr) != 1) {
+        fprintf(stderr, "line %d: invalid address %s\n", line, address);
+        return -1;
+    }
+    in->sin_family = AF_INET;
+    in->sin_port = htons(port);
+    *length = sizeof(*in);
+    return 0;
+}
+
+// HEALTH_CHECK: "exec COMMAND..." or "connect ADDRESS", ADDRESS a Unix
+// socket path or IPv4:PORT
+int health_check_setting(service_t *service, const char *value, int line) {
+    if (strncmp(value, "exec ", 5) == 0) {
+        free(service->check_args);
+        service->check_args = split_command(value + 5);
+        if (service->check_args == NULL) {
+            fprintf(stderr, "line %d: invalid health check command\n", line);
+            return -1;
+        }
+        service->check_type = CHECK_EXEC;
+        return 0;
+    }
+    if (strncmp(value, "connect ", 8) != 0) {
+        fprintf(stderr, "line %d: HEALTH_CHECK must be exec COMMAND or connect ADDRESS\n",
+                line);
+        return -1;
+    }
+
+    const char *address = value + 8;
+    while (*address == ' ') {
+        address++;
+    }
+    if (parse_address(address, &service->check_address, &service->check_address_length,
+                      line) == -1) {
+        return -1;
+    }
+    service->check_type = CHECK_CONNECT;
+    return 0;
+}
+
+// LISTEN: a socket to bind for the service, once per socket
+int listen_setting(service_t *service, const char *value, int line) {
+    if (service->listener_count == MAX_LISTEN_SOCKETS) {
+        fprintf(stderr, "line %d: at most %d LISTEN sockets\n", line, MAX_LISTEN_SOCKETS);
+        return -1;
+    }
+    service_listener_t *listeners = realloc(service->listeners,
+                                            (service->listener_count + 1) *
+                                            sizeof(*listeners));
+    if (listeners == NULL) {
+        perror("realloc");
+        return -1;
+    }
+    service->listeners = listeners;
+    service_listener_t *listener = &listeners[service->listener_count];
+    if (parse_address(value, &listener->address, &listener->address_length, line) == -1) {
+        return -1;
+    }
+    listener->kind = WATCH_LISTEN;
+    listener->service = service;
+    listener->fd = -1;
+    service->listener_count++;
+    return 0;
+}
+
+// STOP_SIGNAL: a signal name, with or without SIG, or number
+int stop_signal_setting(service_t *service, const char *value, int line) {
+    static const struct {
+        const char *name;
+        int number;
+    } signals[] = {
+        {"HUP", SIGHUP}, {"INT", SIGINT}, {"QUIT", SIGQUIT}, {"KILL", SIGKILL},
+        {"USR1", SIGUSR1}, {"USR2", SIGUSR2}, {"TERM", SIGTERM},
+    };
+    const char *name = strncmp(value, "SIG", 3) == 0 ? value + 3 : value;
+    for (size_t i = 0; i < sizeof(signals) / sizeof(signals[0]); i++) {
+        if (strcmp(name, signals[i].name) == 0) {
+            service->stop_signal = signals[i].number;
+            return 0;
+        }
+    }
+    long number;
+    if (config_number(value, &number) == -1 || number == 0 || number >= SIGRTMAX) {
+        fprintf(stderr, "line %d: invalid STOP_SIGNAL %s\n", line, value);
+        return -1;
+    }
+    service->stop_signal = number;
+    return 0;
+}
+
+// config_parse() handler for the service file: each [name] section is a
+// service
+int service_setting(void *ctx, const char *section, const char *key,
+                    const char *value, int line) {
+    supervisor_t *sup = ctx;
+    if (*section == '\0') {
+        fprintf(stderr, "line %d: %s outside of a [service] section\n", line, key);
+        return -1;
+    }
+
+    service_t *service = sup->count > 0 ? sup->services[sup->count - 1] : NULL;
+    if (service == NULL || strcmp(service->name, section) != 0) {
+        service = add_service(sup, section);
+        if (service == NULL) {
+            return -1;
+        }
+    }
+
+    int shared = restart_setting(key, value, line, &service->max_attempts,
+                                 &service->interval);
+    if (shared != 0) {
+        return shared == -1 ? -1 : 0;
+    }
+
+    if (strcmp(key, "COMMAND") == 0) {
+        free(service->args);
+        service->args = split_command(value);
+        if (service->args == NULL) {
+            fprintf(stderr, "line %d: invalid command\n", line);
+            return -1;
+        }
+    } else if (strcmp(key, "MODE") == 0) {
+        if (strcmp(value, "agent") == 0) {
+            service->mode = SERVICE_AGENT;
+        } else if (strcmp(value, "local") == 0) {
+            service->mode = SERVICE_LOCAL;
+        } else {
+            fprintf(stderr, "line %d: MODE must be agent or local\n", line);
+            return -1;
+        }
+    } else if (strcmp(key, "ATTACH_OUTPUT") == 0) {
+        service->attach_output = config_bool(value);
+        if (service->attach_output == -1) {
+            fprintf(stderr, "line %d: invalid boolean %s\n", line, value);
+            return -1;
+        }
+    } else if (strcmp(key, "LOG_FILE") == 0) {
+        char *log_file = strdup(value);
+        if (log_file == NULL) {
+            perror("strdup");
+            return -1;
+        }
+        free(service->log_file);
+        service->log_file = log_file;
+    } else if (strcmp(key, "RESTART") == 0) {
+        if (strcmp(value, "always") == 0) {
+            service->restart = RESTART_ALWAYS;
+        } else if (strcmp(value, "on-failure") == 0) {
+            service->restart = RESTART_ON_FAILURE;
+        } else if (strcmp(value, "never") == 0) {
+            service->restart = RESTART_NEVER;
+        } else {
+            fprintf(stderr, "line %d: RESTART must be always, on-failure or never\n",
+                    line);
+            return -1;
+        }
+    } else if (strcmp(key, "MEMORY_MAX") == 0) {
+        if (parse_size(value, &service->settings.memory_max) == -1) {
+            fprintf(stderr, "line %d: invalid MEMORY_MAX %s\n", line, value);
+            return -1;
+        }
+        service->settings.options |= SPAWN_OPT_MEMORY_MAX;
+    } else if (strcmp(key, "CPU_MAX") == 0) {
+        unsigned int quota, period = DEFAULT_CPU_PERIOD;
+        char extra;
+        int n = sscanf(value, "%u %u %c", &quota, &period, &extra);
+        if ((n != 1 && n != 2) || quota == 0 || period == 0) {
+            fprintf(stderr, "line %d: CPU_MAX must be QUOTA [PERIOD]\n", line);
+            return -1;
+        }
+        service->settings.cpu_quota = quota;
+        service->settings.cpu_period = period;
+        service->settings.options |= SPAWN_OPT_CPU_MAX;
+    } else if (strcmp(key, "PIDS_MAX") == 0) {
+        long pids;
+        if (config_number(value, &pids) == -1 || pids == 0) {
+            fprintf(stderr, "line %d: invalid PIDS_MAX %s\n", line, value);
+            return -1;
+        }
+        service->settings.pids_max = pids;
+        service->settings.options |= SPAWN_OPT_PIDS_MAX;
+    } else if (strcmp(key, "PROFILE") == 0) {
+        char *profile = strdup(value);
+        if (profile == NULL) {
+            perror("strdup");
+            return -1;
+        }
+        free((char *)service->settings.profile);
+        service->settings.profile = profile;
+        service->settings.options |= SPAWN_OPT_PROFILE;
+    } else if (strcmp(key, "ENVIRONMENT") == 0) {
+        return environment_setting(service, value, line);
+    } else if (strcmp(key, "WORKING_DIRECTORY") == 0) {
+        char *cwd = strdup(value);
+        if (cwd == NULL) {
+            perror("strdup");
+            return -1;
+        }
+        free((char *)service->settings.cwd);
+        service->settings.cwd = cwd;
+        service->settings.options |= SPAWN_OPT_CWD;
+    } else if (strcmp(key, "USER") == 0 || strcmp(key, "GROUP") == 0) {
+        return credentials_setting(service, key, value, line);
+    } else if (strncmp(key, "LIMIT_", strlen("LIMIT_")) == 0) {
+        return rlimit_setting(service, key, value, line);
+    } else if (strcmp(key, "NICE") == 0) {
+        char *end;
+        long nice = strtol(value, &end, 10);
+        if (end == value || *end != '\0' || nice < -20 || nice > 19) {
+            fprintf(stderr, "line %d: NICE must be between -20 and 19\n", line);
+            return -1;
+        }
+        service->settings.nice = nice;
+        service->settings.options |= SPAWN_OPT_NICE;
+    } else if (strcmp(key, "IO_PRIORITY") == 0) {
+        return ioprio_setting(service, value, line);
+    } else if (strcmp(key, "CPU_AFFINITY") == 0) {
+        return affinity_setting(service, value, line);
+    } else if (strcmp(key, "NOTIFY") == 0) {
+        service->notify = config_bool(value);
+        if (service->notify == -1) {
+            fprintf(stderr, "line %d: invalid boolean %s\n", line, value);
+            return -1;
+        }
+    } else if (strcmp(key, "READY_TIMEOUT") == 0) {
+        if (config_number(value, &service->ready_timeout) == -1) {
+            fprintf(stderr, "line %d: invalid READY_TIMEOUT %s\n", line, value);
+            return -1;
+        }
+    } else if (strcmp(key, "HEALTH_CHECK") == 0) {
+        return health_check_setting(service, value, line);
+    } else if (strcmp(key, "HEALTH_INTERVAL") == 0 || strcmp(key, "HEALTH_TIMEOUT") == 0 ||
+               strcmp(key, "HEALTH_RETRIES") == 0) {
+        long number;
+        if (config_number(value, &number) == -1 || number == 0) {
+            fprintf(stderr, "line %d: invalid %s %s\n", line, key, value);
+            return -1;
+        }
+        *(strcmp(key, "HEALTH_INTERVAL") == 0 ? &service->health_interval :
+          strcmp(key, "HEALTH_TIMEOUT") == 0 ? &service->health_timeout :
+          &service->health_retries) = number;
+    } else if (strcmp(key, "STOP_SIGNAL") == 0) {
+        return stop_signal_setting(service, value, line);
+    } else if (strcmp(key, "STOP_TIMEOUT") == 0) {
+        if (config_number(value, &service->stop_timeout) == -1 ||
+            service->stop_timeout == 0) {
+            fprintf(stderr, "line %d: invalid STOP_TIMEOUT %s\n", line, value);
+            return -1;
+        }
+    } else if (strcmp(key, "DEPENDS_ON") == 0) {
+        char *depends_on = strdup(value);
+        if (depends_on == NULL) {
+            perror("strdup");
+            return -1;
+        }
+        free(service->depends_on);
+        service->depends_on = depends_on;
+    } else if (strcmp(key, "LISTEN") == 0) {
+        return listen_setting(service, value, line);
+    } else if (strcmp(key, "ON_DEMAND") == 0) {
+        service->on_demand = config_bool(value);
+        if (service->on_demand == -1) {
+            fprintf(stderr, "line %d: invalid boolean %s\n", line, value);
+            return -1;
+        }
+    } else if (strcmp(key, "IDLE_TIMEOUT") == 0) {
+        if (config_number(value, &service->idle_timeout) == -1) {
+            fprintf(stderr, "line %d: invalid IDLE_TIMEOUT %s\n", line, value);
+            return -1;
+        }
+    } else if (strcmp(key, "REPLICAS") == 0) {
+        if (config_number(value, &service->replicas) == -1 ||
+            service->replicas > MAX_REPLICAS) {
+            fprintf(stderr, "line %d: REPLICAS must be between 0 and %d\n", line,
+                    MAX_REPLICAS);
+            return -1;
+        }
+        service->replicated = 1;
+    } else if (strcmp(key, "RESTART_DELAY") == 0) {
+        if (config_number(value, &service->restart_delay) == -1 ||
+            service->restart_delay == 0) {
+            fprintf(stderr, "line %d: invalid RESTART_DELAY %s\n", line, value);
+            return -1;
+        }
+    } else {
+        fprintf(stderr, "line %d: unknown setting %s\n", line, key);
+        return -1;
+    }
+    return 0;
+}
+
+// Read the restart limits from agent.conf. A missing file is fine unless
+// HOLDEN_CONFIG points to it.
+int load_defaults(supervisor_t *sup) {
+    sup->max_attempts = DEFAULT_MAX_RESTART_ATTEMPTS;
+    sup->interval = DEFAULT_MONITOR_INTERVAL;
+
+    const char *path = config_path();
+    if (getenv("HOLDEN_CONFIG") == NULL && access(path, F_OK) == -1) {
+        return 0;
+    }
+    if (config_parse(path, default_setting, sup) != 0) {
+        fprintf(stderr, "Failed to load configuration from %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+service_t *find_service(const supervisor_t *sup, const char *name) {
+    for (int i = 0; i < sup->count; i++) {
+        if (strcmp(sup->services[i]->name, name) == 0) {
+            return sup->services[i];
+        }
+    }
+    return NULL;
+}
+
+service_t *find_template(const supervisor_t *sup, const char *name) {
+    for (int i = 0; i < sup->template_count; i++) {
+        if (strcmp(sup->templates[i]->name, name) == 0) {
+            return sup->templates[i];
+        }
+    }
+    return NULL;
+}
+
+// Add replica number of a template, in its place among the template's
+// replicas. It shares the template's settings, except for LOG_FILE, to
+// which the replica's number is appended. Returns NULL on error.
+service_t *add_replica(supervisor_t *sup, service_t *template, int number) {
+    if (template->instance_count == template->instance_capacity) {
+        int capacity = template->instance_capacity ? template->instance_capacity * 2 : 16;
+        service_t **instances = realloc(template->instances,
+                                        capacity * sizeof(*instances));
+        if (instances == NULL) {
+            perror("realloc");
+            return NULL;
+        }
+        template->instances = instances;
+        template->instance_capacity = capacity;
+    }
+
+    char *name, *log_file = NULL;
+    if (asprintf(&name, "%s@%d", template->name, number) == -1) {
+        perror("asprintf");
+        return NULL;
+    }
+    if (template->log_file != NULL &&
+        asprintf(&log_file, "%s.%d", template->log_file, number) == -1) {
+        perror("asprintf");
+        free(name);
+        return NULL;
+    }
+    service_t *replica = add_service(sup, name);
+    free(name);
+    if (replica == NULL) {
+        free(log_file);
+        return NULL;
+    }
+    replica->log_file = log_file;
+    replica->template = template;
+    replica->replica = number;
+    replica->args = template->args;
+    replica->mode = template->mode;
+    replica->attach_output = template->attach_output;
+    replica->settings = template->settings;
+    replica->environment = template->environment;
+    replica->notify = template->notify;
+    replica->ready_timeout = template->ready_timeout;
+    replica->check_type = template->check_type;
+    replica->check_args = template->check_args;
+    replica->check_address = template->check_address;
+    replica->check_address_length = template->check_address_length;
+    replica->health_interval = template->health_interval;
+    replica->health_timeout = template->health_timeout;
+    replica->health_retries = template->health_retries;
+    replica->stop_signal = template->stop_signal;
+    replica->stop_timeout = template->stop_timeout;
+    replica->depends = template->depends;
+    replica->depend_count = template->depend_count;
+    replica->restart = template->restart;
+    replica->restart_delay = template->restart_delay;
+    replica->max_attempts = template->max_attempts;
+    replica->interval = template->interval;
+
+    // Replicas are mostly added above the highest number
+    int index = template->instance_count++;
+    while (index > 0 && template->instances[index - 1]->replica > number) {
+        template->instances[index] = template->instances[index - 1];
+        index--;
+    }
+    template->instances[index] = replica;
+    return replica;
+}
+
+// Resolve the DEPENDS_ON names of every service, and reject cycles,
+// which would leave shutdown waiting on itself. Returns 0, or -1 on error.
+int resolve_dependencies(supervisor_t *sup, const char *path) {
+    for (int i = 0; i < sup->count; i++) {
+        service_t *service = sup->services[i];
+        if (service->depends_on == NULL) {
+            continue;
+        }
+        char *names = service->depends_on;
+        char *saveptr;
+        for (char *name = strtok_r(names, ", ", &saveptr); name != NULL;
+             name = strtok_r(NULL, ", ", &saveptr)) {
+            service_t *dependency = find_service(sup, name);
+            if (dependency == NULL || dependency == service) {
+                fprintf(stderr, "%s: service %s: invalid dependency %s\n", path,
+                        service->name, name);
+                return -1;
+            }
+            service_t **depends = realloc(service->depends,
+                                          (service->depend_count + 1) * sizeof(*depends));
+            if (depends == NULL) {
+                perror("realloc");
+                return -1;
+            }
+            service->depends = depends;
+            depends[service->depend_count++] = dependency;
+        }
+    }
+
+    // Peel off services nothing depends on until none is left; a cycle
+    // is what remains
+    for (int i = 0; i < sup->count; i++) {
+        for (int j = 0; j < sup->services[i]->depend_count; j++) {
+            sup->services[i]->depends[j]->dependents++;
+        }
+    }
+    service_t **ready = malloc(sup->count * sizeof(*ready));
+    if (ready == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    int count = 0, peeled = 0;
+    for (int i = 0; i < sup->count; i++) {
+        if (sup->services[i]->dependents == 0) {
+            ready[count++] = sup->services[i];
+        }
+    }
+    while (peeled < count) {
+        service_t *service = ready[peeled++];
+        for (int j = 0; j < service->depend_count; j++) {
+            if (--service->depends[j]->dependents == 0) {
+                ready[count++] = service->depends[j];
+            }
+        }
+    }
+    free(ready);
+    if (count < sup->count) {
+        fprintf(stderr, "%s: services depend on each other in a cycle\n", path);
+        for (int i = 0; i < sup->count; i++) {
+            sup->services[i]->dependents = 0;
+        }
+        return -1;
+    }
+    return 0;
+}
+
+// Take the services with REPLICAS out of the list as templates, and add
+// their initial replicas in their place. Returns 0, or -1 on error.
+int expand_templates(supervisor_t *sup, const char *path) {
+    // Dependencies on a template would change with its number of replicas
+    for (int i = 0; i < sup->count; i++) {
+        service_t *service = sup->services[i];
+        for (int j = 0; j < service->depend_count; j++) {
+            if (service->depends[j]->replicated) {
+                fprintf(stderr, "%s: service %s: can't depend on replicated service %s\n",
+                        path, service->name, service->depends[j]->name);
+                return -1;
+            }
+        }
+    }
+
+    sup->templates = malloc(sup->count * sizeof(*sup->templates));
+    if (sup->templates == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    int kept = 0;
+    for (int i = 0; i < sup->count; i++) {
+        service_t *service = sup->services[i];
+        if (service->replicated) {
+            sup->templates[sup->template_count++] = service;
+        } else {
+            sup->services[kept++] = service;
+        }
+    }
+    sup->count = kept;
+
+    // Replica names must not be taken
+    for (int i = 0; i < sup->count; i++) {
+        service_t *service = sup->services[i];
+        char *at = strrchr(service->name, '@');
+        if (at != NULL) {
+            *at = '\0';
+            service_t *template = find_template(sup, service->name);
+            *at = '@';
+            if (template != NULL) {
+                fprintf(stderr, "%s: service %s: name reserved for replicas of %s\n",
+                        path, service->name, template->name);
+                return -1;
+            }
+        }
+    }
+
+    for (int i = 0; i < sup->template_count; i++) {
+        for (int number = 1; number <= sup->templates[i]->replicas; number++) {
+            if (add_replica(sup, sup->templates[i], number) == NULL) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Read the services to supervise from a configuration file
+int load_services(supervisor_t *sup, const char *path) {
+    if (config_parse(path, service_setting, sup) != 0) {
+        fprintf(stderr, "Failed to load services from %s\n", path);
+        return -1;
+    }
+
+    for (int i = 0; i < sup->count; i++) {
+        if (sup->services[i]->args == NULL &&
+            !(sup->services[i]->settings.options & SPAWN_OPT_PROFILE)) {
+            fprintf(stderr, "%s: service %s has no COMMAND\n", path,
+                    sup->services[i]->name);
+            return -1;
+        }
+        if (sup->services[i]->mode == SERVICE_LOCAL &&
+            sup->services[i]->settings.options != 0) {
+            fprintf(stderr, "%s: service %s: limits, profiles and process settings "
+                    "need MODE=agent\n",
+                    path, sup->services[i]->name);
+            return -1;
+        }
+        if (sup->services[i]->ready_timeout > 0 && !sup->services[i]->notify) {
+            fprintf(stderr, "%s: service %s: READY_TIMEOUT needs NOTIFY\n", path,
+                    sup->services[i]->name);
+            return -1;
+        }
+        if (sup->services[i]->notify &&
+            (sup->services[i]->settings.options & SPAWN_OPT_PROFILE)) {
+            fprintf(stderr, "%s: service %s: NOTIFY can't be combined with PROFILE\n",
+                    path, sup->services[i]->name);
+            return -1;
+        }
+        if (sup->services[i]->log_file != NULL &&
+            (sup->services[i]->attach_output ||
+             (sup->services[i]->settings.options & SPAWN_OPT_PROFILE))) {
+            fprintf(stderr, "%s: service %s: LOG_FILE can't be combined with "
+                    "ATTACH_OUTPUT or PROFILE\n", path, sup->services[i]->name);
+            return -1;
+        }
+        if (sup->services[i]->listener_count > 0 &&
+            (sup->services[i]->replicated ||
+             (sup->services[i]->settings.options & SPAWN_OPT_PROFILE))) {
+            fprintf(stderr, "%s: service %s: LISTEN can't be combined with "
+                    "REPLICAS or PROFILE\n", path, sup->services[i]->name);
+            return -1;
+        }
+        if ((sup->services[i]->on_demand && sup->services[i]->listener_count == 0) ||
+            (sup->services[i]->idle_timeout > 0 && !sup->services[i]->on_demand)) {
+            fprintf(stderr, "%s: service %s: ON_DEMAND needs LISTEN, and IDLE_TIMEOUT "
+                    "needs ON_DEMAND\n", path, sup->services[i]->name);
+            return -1;
+        }
+    }
+    if (sup->count == 0) {
+        fprintf(stderr, "%s: no services defined\n", path);
+        return -1;
+    }
+    if (resolve_dependencies(sup, path) == -1) {
+        return -1;
+    }
+    return expand_templates(sup, path);
+}
+
+// Restart queue (binary heap) helpers
+void timer_set(supervisor_t *sup, int index, service_t *service) {
+    sup->timers[index] = service;
+    service->timer_index = index;
+}
+
+void timer_sift_up(supervisor_t *sup, int index) {
+    service_t *service = sup->timers[index];
+    while (index > 0) {
+        int parent = (index - 1) / 2;
+        if (sup->timers[parent]->restart_at <= service->restart_at) {
+            break;
+        }
+        timer_set(sup, index, sup->timers[parent]);
+        index = parent;
+    }
+    timer_set(sup, index, service);
+}
+
+void timer_sift_down(supervisor_t *sup, int index) {
+    service_t *service = sup->timers[index];
+    while (1) {
+        int child = 2 * index + 1;
+        if (child >= sup->timer_count) {
+            break;
+        }
+        if (child + 1 < sup->timer_count &&
+            sup->timers[child + 1]->restart_at < sup->timers[child]->restart_at) {
+            child++;
+        }
+        if (service->restart_at <= sup->timers[child]->restart_at) {
+            break;
+        }
+        timer_set(sup, index, sup->timers[child]);
+        index = child;
+    }
+    timer_set(sup, index, service);
+}
+
+// Queue a restart of service at time at (ms). Returns 0, or -1 if out of
+// memory.
+int queue_restart(supervisor_t *sup, service_t *service, uint64_t at) {
+    if (sup->timer_count == sup->timer_capacity) {
+        int capacity = sup->timer_capacity ? sup->timer_capacity * 2 : 16;
+        service_t **timers = realloc(sup->timers, capacity * sizeof(*timers));
+        if (timers == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        sup->timers = timers;
+        sup->timer_capacity = capacity;
+    }
+
+    service->restart_at = at;
+    sup->timers[sup->timer_count] = service;
+    timer_sift_up(sup, sup->timer_count++);
+    return 0;
+}
+
+// Pop the earliest queued restart if it is due by now
+service_t *next_due_restart(supervisor_t *sup, uint64_t now) {
+    if (sup->timer_count == 0 || sup->timers[0]->restart_at > now) {
+        return NULL;
+    }
+
+    service_t *service = sup->timers[0];
+    service->timer_index = -1;
+    if (--sup->timer_count > 0) {
+        sup->timers[0] = sup->timers[sup->timer_count];
+        timer_sift_down(sup, 0);
+    }
+    return service;
+}
+
+// Take a service out of the restart queue
+void cancel_restart(supervisor_t *sup, service_t *service) {
+    int index = service->timer_index;
+    if (index == -1) {
+        return;
+    }
+    service->timer_index = -1;
+    if (index < --sup->timer_count) {
+        service_t *moved = sup->timers[sup->timer_count];
+        sup->timers[index] = moved;
+        timer_sift_up(sup, index);
+        if (moved->timer_index == index) {
+            timer_sift_down(sup, index);
+        }
+    }
+}
+
+// Point the timerfd at the earliest queued restart
+void arm_restart_timer(supervisor_t *sup) {
+    uint64_t deadline = sup->timer_count > 0 ? sup->timers[0]->restart_at : 0;
+    if (deadline == sup->timer_armed) {
+        return;
+    }
+
+    struct itimerspec its = {0};
+    its.it_value.tv_sec = deadline / 1000;
+    its.it_value.tv_nsec = (deadline % 1000) * 1000000;
+    if (timerfd_settime(sup->timerfd, TFD_TIMER_ABSTIME, &its, NULL) == -1) {
+        perror("timerfd_settime");
+        return;
+    }
+    sup->timer_armed = deadline;
+}
+
+// Backoff before the next restart of a service that failed `failures`
+// times in a row: RESTART_DELAY doubled each time, capped, with the upper
+// half randomized so that services failing together don't restart in
+// lockstep
+uint64_t restart_delay(const service_t *service) {
+    uint64_t delay = service->restart_delay;
+    for (int i = 1; i < service->failures && delay < MAX_RESTART_DELAY_MS; i++) {
+        delay *= 2;
+    }
+    if (delay > MAX_RESTART_DELAY_MS) {
+        delay = MAX_RESTART_DELAY_MS;
+    }
+    return delay / 2 + random() % (delay / 2 + 1);
+}
+
+// Decide what to do about a service that stopped: its process exited
+// (failed tells whether unsuccessfully) or, with start_failed, it could
+// not be started. Returns 1 if it should be restarted right away, 0 if
+// the restart has been queued or the service is left stopped.
+int plan_restart(supervisor_t *sup, service_t *service, int failed,
+                 int start_failed, const char *what) {
+    const char *time_str = timestamp();
+    if (service->stopping) {
+        printf("[%s] Service %s %s, stopped\n", time_str, service->name, what);
+        return 0;
+    }
+    if (service->restart == RESTART_NEVER ||
+        (service->restart == RESTART_ON_FAILURE && !failed)) {
+        printf("[%s] Service %s %s, not restarting\n", time_str, service->name, what);
+        return 0;
+    }
+
+    // Give up on a crash loop: too many restarts within one interval
+    uint64_t now = now_ms();
+    uint64_t interval = (uint64_t)service->interval * 1000;
+    if (now - service->window_start >= interval) {
+        service->window_start = now;
+        service->attempts = 0;
+    }
+    if (service->max_attempts > 0 && service->attempts >= service->max_attempts) {
+        printf("[%s] Service %s %s, restarted %d times within %lds, giving up\n",
+               time_str, service->name, what, service->attempts, service->interval);
+        return 0;
+    }
+    service->attempts++;
+
+    // A process that ran for a whole interval restarts immediately,
+    // repeated failures back off
+    if (start_failed || now - service->started_at < interval) {
+        service->failures++;
+    } else {
+        service->failures = 0;
+    }
+    if (service->failures == 0) {
+        printf("[%s] Service %s %s, restarting...\n", time_str, service->name, what);
+        return 1;
+    }
+
+    uint64_t delay = restart_delay(service);
+    if (queue_restart(sup, service, now + delay) == -1) {
+        return 0;
+    }
+    printf("[%s] Service %s %s, restarting in %llu ms...\n", time_str,
+           service->name, what, (unsigned long long)delay);
+    return 0;
+}
+
+int compare_service_pids(const void *a, const void *b) {
+    pid_t pa = ((const service_t *)a)->pid;
+    pid_t pb = ((const service_t *)b)->pid;
+    return (pa > pb) - (pa < pb);
+}
+
+// Register a freshly started service's pidfd for exit notification; an
+// agent service also waits for its exit report
+void watch_service(supervisor_t *sup, service_t *service) {
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = service};
+    if (epoll_ctl(sup->epfd, EPOLL_CTL_ADD, service->pidfd, &ev) == -1) {
+        perror("epoll_ctl");
+        close(service->pidfd);
+        service->pidfd = -1;
+        return;
+    }
+    if (service->mode == SERVICE_AGENT) {
+        // Without an entry in the tree, the report is ignored and the
+        // pidfd alone tells about the exit
+        service_t **found = tsearch(service, &sup->reports, compare_service_pids);
+        service->session = found != NULL && *found == service ? sup->agent.session : 0;
+        service->exit_flags = 0;
+    }
+    service->stopping = 0;
+    service->adopted = 0;
+    service->idle_stopped = 0;
+    service->started_at = now_ms();
+    service->starts++;
+    sup->running++;
+}
+
+// Watch the agent connection for exit reports
+void watch_agent(supervisor_t *sup) {
+    if (sup->agent.fd == -1) {
+        return;
+    }
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = &sup->agent};
+    if (epoll_ctl(sup->epfd, EPOLL_CTL_ADD, sup->agent.fd, &ev) == -1 &&
+        errno != EEXIST) {
+        perror("epoll_ctl");
+    }
+}
+
+// Set up output capture for a service with LOG_FILE: open the log and
+// create the pipe, watched for output. Returns 0, or -1 on error.
+int open_service_output(supervisor_t *sup, service_t *service) {
+    service_output_t *output = &service->output;
+    output->log_fd = open(service->log_file, O_WRONLY | O_CREAT | O_CLOEXEC, 0640);
+    if (output->log_fd == -1) {
+        fprintf(stderr, "Failed to open %s: %s\n", service->log_file, strerror(errno));
+        return -1;
+    }
+    output->log_offset = lseek(output->log_fd, 0, SEEK_END);
+
+    // An adopted service goes on writing to the pipe it was started with
+    int fds[2];
+    if (output->log_offset == -1 ||
+        (output->read_fd == -1 && pipe2(fds, O_CLOEXEC) == -1)) {
+        fprintf(stderr, "Failed to capture output of %s: %s\n", service->name,
+                strerror(errno));
+        return -1;
+    }
+    if (output->read_fd == -1) {
+        output->read_fd = fds[0];
+        output->write_fd = fds[1];
+    }
+    // Only our end is non-blocking; the service blocks when the pipe is
+    // full. A larger pipe means fewer wakeups at high log rates.
+    fcntl(output->read_fd, F_SETFL, O_NONBLOCK);
+    fcntl(output->read_fd, F_SETPIPE_SZ, OUTPUT_PIPE_SIZE);
+
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = output};
+    if (epoll_ctl(sup->epfd, EPOLL_CTL_ADD, output->read_fd, &ev) == -1) {
+        perror("epoll_ctl");
+        return -1;
+    }
+    return 0;
+}
+
+// Move whatever a service wrote from its pipe to its log file. If the
+// log can't be written, the output is discarded so that the service
+// doesn't block on a full pipe.
+void forward_output(service_output_t *output) {
+    while (1) {
+        ssize_t n = splice(output->read_fd, NULL, output->log_fd, &output->log_offset,
+                           OUTPUT_PIPE_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) {
+            output->bytes += n;
+            continue;
+        }
+        if (n == 0 || errno == EAGAIN) {
+            return;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+
+        fprintf(stderr, "[%s] Failed to write the log of %s: %s\n", timestamp(),
+                output->service->name, strerror(errno));
+        char discard[4096];
+        while (read(output->read_fd, discard, sizeof(discard)) > 0) {
+        }
+        return;
+    }
+}
+
+// Set up readiness notification and health checking for a service: its
+// notification socket, bound in the abstract namespace and announced to
+// the process in NOTIFY_SOCKET, and its timer. Returns 0, or -1 on error.
+int open_service_health(supervisor_t *sup, service_t *service) {
+    struct epoll_event ev = {.events = EPOLLIN};
+    if (service->notify) {
+        struct sockaddr_un addr = {.sun_family = AF_UNIX};
+        socklen_t length = sizeof(addr);
+        if (service->notify_socket.fd != -1) {
+            // Adopted with the process, which knows it by its name
+            if (getsockname(service->notify_socket.fd, (struct sockaddr *)&addr,
+                            &length) == -1) {
+                perror("getsockname");
+                return -1;
+            }
+        } else {
+            int n = snprintf(addr.sun_path + 1, sizeof(addr.sun_path) - 1,
+                             "holden-%d-%s", getpid(), service->name);
+            if (n >= (int)sizeof(addr.sun_path) - 1) {
+                n = sizeof(addr.sun_path) - 2;
+            }
+            service->notify_socket.fd = socket(AF_UNIX,
+                                               SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (service->notify_socket.fd == -1 ||
+                bind(service->notify_socket.fd, (struct sockaddr *)&addr,
+                     offsetof(struct sockaddr_un, sun_path) + 1 + n) == -1) {
+                fprintf(stderr, "Failed to create the notification socket of %s: %s\n",
+                        service->name, strerror(errno));
+                return -1;
+            }
+        }
+
+        // The process's environment plus NOTIFY_SOCKET, which comes first
+        // so that it can be freed
+        char **base = service->environment != NULL ? service->environment : environ;
+        int count = 0;
+        while (base[count] != NULL) {
+            count++;
+        }
+        service->notify_environment = malloc((count + 2) * sizeof(char *));
+        if (service->notify_environment == NULL ||
+            asprintf(&service->notify_environment[0], "NOTIFY_SOCKET=@%s",
+                     addr.sun_path + 1) == -1) {
+            perror("malloc");
+            free(service->notify_environment);
+            service->notify_environment = NULL;
+            return -1;
+        }
+        memcpy(service->notify_environment + 1, base, (count + 1) * sizeof(char *));
+        service->settings.envp = service->notify_environment;
+        if (service->mode == SERVICE_AGENT) {
+            service->settings.options |= SPAWN_OPT_ENV;
+        }
+
+        ev.data.ptr = &service->notify_socket;
+        if (epoll_ctl(sup->epfd, EPOLL_CTL_ADD, service->notify_socket.fd, &ev) == -1) {
+            perror("epoll_ctl");
+            return -1;
+        }
+    }
+
+    if (service->notify || service->check_type != CHECK_NONE) {
+        service->timer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        ev.data.ptr = &service->timer;
+        if (service->timer.fd == -1 ||
+            epoll_ctl(sup->epfd, EPOLL_CTL_ADD, service->timer.fd, &ev) == -1) {
+            perror("timerfd");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Arm a service's timer to fire in the given number of seconds, or
+// disarm it with 0
+void set_service_timer(service_t *service, long secs) {
+    if (service->timer.fd == -1) {
+        return;
+    }
+    struct itimerspec spec = {.it_value = {.tv_sec = secs}};
+    if (timerfd_settime(service->timer.fd, 0, &spec, NULL) == -1) {
+        perror("timerfd_settime");
+    }
+}
+
+// Stop the health check in progress, if any. An exec check that is still
+// running is killed and reaped.
+void cancel_check(supervisor_t *sup, service_t *service) {
+    if (service->check.fd == -1) {
+        return;
+    }
+    epoll_ctl(sup->epfd, EPOLL_CTL_DEL, service->check.fd, NULL);
+    if (service->check_type == CHECK_EXEC) {
+        siginfo_t info;
+        pidfd_signal(service->check.fd, SIGKILL);
+        waitid(P_PIDFD, service->check.fd, &info, WEXITED);
+    }
+    close(service->check.fd);
+    service->check.fd = -1;
+}
+
+// The service is ready: health checks start
+void service_ready(service_t *service) {
+    service->ready = 1;
+    service->check_failures = 0;
+    if (service->check_type != CHECK_NONE) {
+        set_service_timer(service, service->health_interval);
+    }
+}
+
+// A freshly started service waits for READY=1 if it uses notification,
+// and is ready right away otherwise
+void start_health(service_t *service) {
+    if (service->notify) {
+        service->ready = 0;
+        set_service_timer(service, service->ready_timeout);
+    } else {
+        service_ready(service);
+    }
+}
+
+// The service's run is over: no more timeouts or checks
+void stop_health(supervisor_t *sup, service_t *service) {
+    cancel_check(sup, service);
+    set_service_timer(service, 0);
+    service->ready = 0;
+}
+
+// Kill a service that hangs. Its exit is then handled like any other, so
+// it is restarted according to its policy.
+void kill_hung(supervisor_t *sup, service_t *service, const char *why) {
+    printf("[%s] Service %s %s, killing it\n", timestamp(), service->name, why);
+    service->hung++;
+    stop_health(sup, service);
+    if (pidfd_signal(service->pidfd, SIGKILL) == -1 && errno != ESRCH) {
+        fprintf(stderr, "Failed to kill %s: %s\n", service->name, strerror(errno));
+    }
+}
+
+// Account for the outcome of a health check and schedule the next one,
+// unless the service has failed too many in a row
+void check_done(supervisor_t *sup, service_t *service, int healthy, const char *why) {
+    cancel_check(sup, service);
+    if (healthy) {
+        service->check_failures = 0;
+    } else {
+        service->failed_checks++;
+        service->check_failures++;
+        printf("[%s] Health check of %s failed (%d of %ld): %s\n", timestamp(),
+               service->name, service->check_failures, service->health_retries, why);
+        if (service->check_failures >= service->health_retries) {
+            kill_hung(sup, service, "is unhealthy");
+            return;
+        }
+    }
+    set_service_timer(service, service->health_interval);
+}
+
+// Start a health check: spawn the check command, or begin connecting
+void start_check(supervisor_t *sup, service_t *service) {
+    int healthy = 0;
+    struct epoll_event ev = {.data.ptr = &service->check};
+    if (service->check_type == CHECK_EXEC) {
+        // The check's output goes where the service's does
+        spawn_fd_t log_fds[] = {
+            {.fd = service->output.write_fd, .target = STDOUT_FILENO},
+            {.fd = service->output.write_fd, .target = STDERR_FILENO},
+        };
+        sigset_t unblocked;
+        sigemptyset(&unblocked);
+        spawn_attr_t attr = {
+            .file = service->check_args[0], .argv = service->check_args,
+            .fds = log_fds, .fd_count = service->output.write_fd != -1 ? 2 : 0,
+            .sigmask = &unblocked,
+        };
+        pid_t pid;
+        service->check.fd = spawn_process(&attr, &pid);
+        ev.events = EPOLLIN;
+    } else {
+        service->check.fd = socket(service->check_address.ss_family,
+                                   SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (service->check.fd != -1 &&
+            connect(service->check.fd, (struct sockaddr *)&service->check_address,
+                    service->check_address_length) == 0) {
+            healthy = 1;  // Unix sockets connect right away
+        } else if (service->check.fd != -1 && errno != EINPROGRESS) {
+            close(service->check.fd);
+            service->check.fd = -1;
+        }
+        ev.events = EPOLLOUT;
+    }
+
+    if (service->check.fd == -1 || healthy) {
+        check_done(sup, service, healthy, strerror(errno));
+        return;
+    }
+    if (epoll_ctl(sup->epfd, EPOLL_CTL_ADD, service->check.fd, &ev) == -1) {
+        check_done(sup, service, 0, strerror(errno));
+        return;
+    }
+    set_service_timer(service, service->health_timeout);
+}
+
+// The health check in progress has finished: the command has exited or
+// the connection is established or refused
+void check_finished(supervisor_t *sup, service_t *service) {
+    if (service->check.fd == -1) {
+        return;  // cancelled earlier in the same wakeup
+    }
+    char why[64];
+    int healthy;
+    if (service->check_type == CHECK_EXEC) {
+        siginfo_t info = {0};
+        if (waitid(P_PIDFD, service->check.fd, &info, WEXITED | WNOHANG) == -1 ||
+            info.si_pid == 0) {
+            return;
+        }
+        healthy = info.si_code == CLD_EXITED && info.si_status == 0;
+        if (info.si_code == CLD_EXITED) {
+            snprintf(why, sizeof(why), "exited with status %d", info.si_status);
+        } else {
+            snprintf(why, sizeof(why), "killed by signal %d", info.si_status);
+        }
+        // Reaped already
+        epoll_ctl(sup->epfd, EPOLL_CTL_DEL, service->check.fd, NULL);
+        close(service->check.fd);
+        service->check.fd = -1;
+    } else {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        getsockopt(service->check.fd, SOL_SOCKET, SO_ERROR, &error, &length);
+        healthy = error == 0;
+        snprintf(why, sizeof(why), "%s", strerror(error));
+    }
+    check_done(sup, service, healthy, why);
+}
+
+// A service's timer has fired: it didn't get ready in time, its health
+// check took too long, or the next check is due
+void service_timer_fired(supervisor_t *sup, service_t *service) {
+    uint64_t expirations;
+    if (read(service->timer.fd, &expirations, sizeof(expirations)) == -1 ||
+        service->pidfd == -1) {
+        return;  // disarmed or stopped earlier in the same wakeup
+    }
+    if (!service->ready) {
+        char why[64];
+        snprintf(why, sizeof(why), "isn't ready after %lds", service->ready_timeout);
+        kill_hung(sup, service, why);
+    } else if (service->check.fd != -1) {
+        check_done(sup, service, 0, "timed out");
+    } else {
+        start_check(sup, service);
+    }
+}
+
+// Read the notifications a service sent. READY=1 makes it ready; other
+// assignments are ignored, as are notifications while it isn't running.
+void notify_received(service_t *service) {
+    char buf[4096];
+    ssize_t n;
+    while ((n = recv(service->notify_socket.fd, buf, sizeof(buf) - 1, 0)) >= 0) {
+        buf[n] = '\0';
+        for (char *line = strtok(buf, "\n"); line != NULL; line = strtok(NULL, "\n")) {
+            if (strcmp(line, "READY=1") == 0 && service->pidfd != -1 && !service->ready) {
+                printf("[%s] Service %s is ready after %llu ms\n", timestamp(),
+                       service->name,
+                       (unsigned long long)(now_ms() - service->started_at));
+                set_service_timer(service, 0);
+                service_ready(service);
+            }
+        }
+    }
+}
+
+// Stop wheel helpers. A service is in the slot of the tick its deadline
+// rounds up to.
+void wheel_add(supervisor_t *sup, service_t *service, uint64_t deadline) {
+    if (sup->stop_count++ == 0) {
+        // Start ticking
+        struct itimerspec spec = {
+            .it_interval = {.tv_nsec = STOP_WHEEL_TICK_MS * 1000000L},
+            .it_value = {.tv_nsec = STOP_WHEEL_TICK_MS * 1000000L},
+        };
+        sup->stop_tick = now_ms() / STOP_WHEEL_TICK_MS;
+        if (timerfd_settime(sup->stop_timerfd, 0, &spec, NULL) == -1) {
+            perror("timerfd_settime");
+        }
+    }
+    service->stop_deadline = deadline;
+    service_t **slot = &sup->stop_wheel[(deadline + STOP_WHEEL_TICK_MS - 1) /
+                                        STOP_WHEEL_TICK_MS % STOP_WHEEL_SLOTS];
+    service->wheel_next = *slot;
+    service->wheel_prev = slot;
+    if (*slot != NULL) {
+        (*slot)->wheel_prev = &service->wheel_next;
+    }
+    *slot = service;
+}
+
+void wheel_remove(supervisor_t *sup, service_t *service) {
+    if (service->wheel_prev == NULL) {
+        return;
+    }
+    *service->wheel_prev = service->wheel_next;
+    if (service->wheel_next != NULL) {
+        service->wheel_next->wheel_prev = service->wheel_prev;
+    }
+    service->wheel_prev = NULL;
+    if (--sup->stop_count == 0) {
+        struct itimerspec spec = {0};
+        timerfd_settime(sup->stop_timerfd, 0, &spec, NULL);
+    }
+}
+
+// Stop a running service: send its stop signal now, and SIGKILL if it
+// hasn't exited by its stop timeout. It isn't restarted.
+void stop_service(supervisor_t *sup, service_t *service) {
+    if (service->pidfd == -1 || service->stopping) {
+        return;
+    }
+    service->stopping = 1;
+    stop_health(sup, service);
+    if (pidfd_signal(service->pidfd, service->stop_signal) == -1) {
+        if (errno != ESRCH) {
+            fprintf(stderr, "Failed to stop %s: %s\n", service->name, strerror(errno));
+        }
+        return;  // already exited, or nothing more to try
+    }
+    wheel_add(sup, service, now_ms() + service->stop_timeout * 1000);
+}
+
+// The stop wheel has ticked: kill the services whose stop timeout has
+// expired. Every slot passed since the last tick is visited; entries in
+// them that are due a later turn stay.
+void stop_timer_fired(supervisor_t *sup) {
+    uint64_t expirations;
+    if (read(sup->stop_timerfd, &expirations, sizeof(expirations)) == -1) {
+        return;
+    }
+    uint64_t now = now_ms();
+    uint64_t tick = now / STOP_WHEEL_TICK_MS;
+    uint64_t first = tick - sup->stop_tick > STOP_WHEEL_SLOTS ?
+                     tick - STOP_WHEEL_SLOTS + 1 : sup->stop_tick + 1;
+    sup->stop_tick = tick;
+    for (uint64_t t = first; t <= tick && sup->stop_count > 0; t++) {
+        service_t *service = sup->stop_wheel[t % STOP_WHEEL_SLOTS];
+        while (service != NULL) {
+            service_t *next = service->wheel_next;
+            if (service->stop_deadline <= now) {
+                wheel_remove(sup, service);
+                printf("[%s] Service %s still running %lds after signal %d, killing it\n",
+                       timestamp(), service->name, service->stop_timeout,
+                       service->stop_signal);
+                pidfd_signal(service->pidfd, SIGKILL);
+            }
+            service = next;
+        }
+    }
+}
+
+// Stop every service, each one once the services that depend on it have
+// exited; the supervisor returns when none is left. A second request
+// kills whatever is still running.
+void shutdown_services(supervisor_t *sup) {
+    if (sup->shutting_down) {
+        printf("[%s] Killing %d remaining services\n", timestamp(), sup->running);
+        for (int i = 0; i < sup->count; i++) {
+            service_t *service = sup->services[i];
+            if (service->pidfd != -1) {
+                wheel_remove(sup, service);
+                pidfd_signal(service->pidfd, SIGKILL);
+            }
+        }
+        return;
+    }
+
+    printf("[%s] Stopping %d services...\n", timestamp(), sup->running);
+    sup->shutting_down = 1;
+    sup->shutdown_started = now_ms();
+    for (int i = 0; i < sup->timer_count; i++) {
+        sup->timers[i]->timer_index = -1;
+    }
+    sup->timer_count = 0;  // no more restarts
+
+    for (int i = 0; i < sup->count; i++) {
+        sup->services[i]->dependents = 0;
+    }
+    for (int i = 0; i < sup->count; i++) {
+        service_t *service = sup->services[i];
+        for (int j = 0; service->pidfd != -1 && j < service->depend_count; j++) {
+            service->depends[j]->dependents++;
+        }
+    }
+    for (int i = 0; i < sup->count; i++) {
+        if (sup->services[i]->dependents == 0) {
+            stop_service(sup, sup->services[i]);
+        }
+    }
+}
+
+// A service's run is over during shutdown: the services it depends on
+// may be next
+void service_stopped(supervisor_t *sup, service_t *service) {
+    for (int j = 0; j < service->depend_count; j++) {
+        if (--service->depends[j]->dependents == 0) {
+            stop_service(sup, service->depends[j]);
+        }
+    }
+    if (sup->running == 0) {
+        printf("[%s] All services stopped in %llu ms\n", timestamp(),
+               (unsigned long long)(now_ms() - sup->shutdown_started));
+    }
+}
+
+// Deposit descriptors under name in the agent's store, or remove the
+// entry with none. The reply isn't waited for: errors show up with the
+// exit reports.
+void store_fds(supervisor_t *sup, const char *name, const int *fds, int fd_count,
+               const char *metadata) {
+    if (!sup->fd_store || ensure_agent(&sup->agent) == -1) {
+        return;
+    }
+    message_t msg = {0};
+    msg.header.type = MSG_STORE_FDS;
+    msg.data.store_fds.name = name;
+    msg.data.store_fds.fd_count = fd_count;
+    msg.data.store_fds.metadata = metadata;
+    msg.data.store_fds.metadata_length = metadata != NULL ? strlen(metadata) + 1 : 0;
+    uint32_t request_id;
+    if (agent_send(&sup->agent, &msg, fds, fd_count, &request_id) == -1) {
+        perror("send to agent");
+        agent_disconnect(&sup->agent);
+    }
+    message_free(&msg);
+}
+
+// Keep what it takes to adopt a running service in the agent's store, or
+// forget it once the service has stopped
+void store_service(supervisor_t *sup, service_t *service) {
+    if (service->pidfd == -1) {
+        store_fds(sup, service->name, NULL, 0, NULL);
+        return;
+    }
+    int fds[MAX_STORED_FDS];
+    int count = 0, flags = 0;
+    fds[count++] = service->pidfd;
+    if (service->output.read_fd != -1) {
+        fds[count++] = service->output.read_fd;
+        fds[count++] = service->output.write_fd;
+        flags |= STORED_OUTPUT;
+    }
+    if (service->notify_socket.fd != -1) {
+        fds[count++] = service->notify_socket.fd;
+        flags |= STORED_NOTIFY;
+    }
+    char metadata[64];
+    snprintf(metadata, sizeof(metadata), "holden1 %d %llu %d", service->pid,
+             (unsigned long long)service->started_at, flags);
+    store_fds(sup, service->name, fds, count, metadata);
+}
+
+// Keep the LISTEN sockets of a service in the agent's store, so that they
+// outlive us and a new orchestrator binds nothing, or forget them
+void store_listeners(supervisor_t *sup, service_t *service, int keep) {
+    char *name;
+    if (service->listener_count == 0 || asprintf(&name, "%s:listen", service->name) == -1) {
+        return;
+    }
+    int fds[MAX_LISTEN_SOCKETS];
+    for (int i = 0; i < service->listener_count; i++) {
+        fds[i] = service->listeners[i].fd;
+    }
+    store_fds(sup, name, fds, keep ? service->listener_count : 0, keep ? "holden1" : NULL);
+    free(name);
+}
+
+// Bind the LISTEN sockets of a service that weren't adopted, and watch
+// them (for nothing yet). Returns 0, or -1 on error.
+int open_service_sockets(supervisor_t *sup, service_t *service) {
+    if (service->listener_count == 0) {
+        return 0;
+    }
+    for (int i = 0; i < service->listener_count; i++) {
+        service_listener_t *listener = &service->listeners[i];
+        struct sockaddr *address = (struct sockaddr *)&listener->address;
+        if (listener->fd == -1) {
+            int on = 1;
+            if (address->sa_family == AF_UNIX) {
+                unlink(((struct sockaddr_un *)address)->sun_path);
+            }
+            listener->fd = socket(address->sa_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (listener->fd == -1 ||
+                (address->sa_family == AF_INET &&
+                 setsockopt(listener->fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1) ||
+                bind(listener->fd, address, listener->address_length) == -1 ||
+                listen(listener->fd, SOMAXCONN) == -1) {
+                fprintf(stderr, "Failed to listen for %s: %s\n", service->name,
+                        strerror(errno));
+                return -1;
+            }
+        }
+        struct epoll_event ev = {.events = 0, .data.ptr = listener};
+        if (epoll_ctl(sup->epfd, EPOLL_CTL_ADD, listener->fd, &ev) == -1) {
+            perror("epoll_ctl");
+            return -1;
+        }
+    }
+
+    if (service->idle_timeout > 0) {
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = &service->idle_timer};
+        service->idle_timer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (service->idle_timer.fd == -1 ||
+            epoll_ctl(sup->epfd, EPOLL_CTL_ADD, service->idle_timer.fd, &ev) == -1) {
+            perror("timerfd");
+            return -1;
+        }
+    }
+    store_listeners(sup, service, 1);
+    return 0;
+}
 
-    // Reap all available zombie children
-    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
-        // Child reaped, no action needed since we use pidfds for monitoring
+// Set the events the LISTEN sockets of a service are watched for
+void watch_listeners(supervisor_t *sup, service_t *service, uint32_t events) {
+    for (int i = 0; i < service->listener_count; i++) {
+        struct epoll_event ev = {.events = events, .data.ptr = &service->listeners[i]};
+        if (epoll_ctl(sup->epfd, EPOLL_CTL_MOD, service->listeners[i].fd, &ev) == -1) {
+            perror("epoll_ctl");
+        }
     }
 }
 
-// pidfd_open system call wrapper
-int pidfd_open(pid_t pid, unsigned int flags) {
-    return syscall(SYS_pidfd_open, pid, flags);
+// An on-demand service that isn't running is started by the next
+// connection to one of its sockets
+void wait_for_connection(supervisor_t *sup, service_t *service) {
+    if (!service->waiting) {
+        service->waiting = 1;
+        sup->waiting++;
+    }
+    watch_listeners(sup, service, EPOLLIN);
 }
 
-// Receive file descriptor over Unix socket
-int recv_fd(int socket) {
-    struct msghdr msg = {0};
-    struct cmsghdr *cmsg;
-    char buf[CMSG_SPACE(sizeof(int))];
-    char data;
-    struct iovec iov = {.iov_base = &data, .iov_len = 1};
+// A connection is pending on one of a service's sockets. Returns 1 if it
+// should start the service, which then accepts it.
+int connection_arrived(supervisor_t *sup, service_listener_t *listener) {
+    service_t *service = listener->service;
+    if (!service->waiting) {
+        service->active = 1;  // running: the one-shot watch is disarmed
+        return 0;
+    }
+    service->waiting = 0;
+    sup->waiting--;
+    watch_listeners(sup, service, 0);
+    if (sup->shutting_down) {
+        return 0;
+    }
+    printf("[%s] Connection for %s, starting it\n", timestamp(), service->name);
+    return 1;
+}
 
-    msg.msg_iov = &iov;
-    msg.msg_iovlen = 1;
-    msg.msg_control = buf;
-    msg.msg_controllen = sizeof(buf);
+void set_idle_timer(service_t *service, long secs) {
+    struct itimerspec spec = {.it_value = {.tv_sec = secs}};
+    if (timerfd_settime(service->idle_timer.fd, 0, &spec, NULL) == -1) {
+        perror("timerfd_settime");
+    }
+}
 
-    if (recvmsg(socket, &msg, 0) < 0) {
-        return -1;
+// Start an idle period of a running on-demand service with IDLE_TIMEOUT:
+// the service is stopped if no connection arrives before it ends. Only
+// the first connection of the period is watched for.
+void start_idle(supervisor_t *sup, service_t *service) {
+    if (service->idle_timer.fd == -1) {
+        return;
     }
+    service->active = 0;
+    watch_listeners(sup, service, EPOLLIN | EPOLLONESHOT);
+    set_idle_timer(service, service->idle_timeout);
+}
 
-    cmsg = CMSG_FIRSTHDR(&msg);
-    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
-        return *(int*)CMSG_DATA(cmsg);
+// The service's run is over: its sockets aren't watched for now
+void stop_idle(supervisor_t *sup, service_t *service) {
+    if (service->idle_timer.fd != -1) {
+        set_idle_timer(service, 0);
+        watch_listeners(sup, service, 0);
     }
+}
 
-    return -1;
+// An idle period has ended: stop the service unless a connection came
+void idle_timer_fired(supervisor_t *sup, service_t *service) {
+    uint64_t expirations;
+    if (read(service->idle_timer.fd, &expirations, sizeof(expirations)) == -1 ||
+        service->pidfd == -1 || service->stopping) {
+        return;
+    }
+    if (service->active) {
+        start_idle(sup, service);
+        return;
+    }
+    printf("[%s] Service %s idle for %lds, stopping it\n", timestamp(), service->name,
+           service->idle_timeout);
+    service->idle_stopped = 1;
+    stop_service(sup, service);
 }
 
-// Connect to the agent
-int connect_to_agent() {
-    int sockfd;
-    struct sockaddr_un addr;
-    const char *socket_path;
+// Start up to MAX_PIPELINED_STARTS services. Requests for agent services
+// are all sent before waiting for the first reply, so they cost about one
+// round trip together.
+int start_service_group(supervisor_t *sup, service_t **services, int count) {
+    for (int i = 0; i < count; i++) {
+        service_t *service = services[i];
+        start_process_msg_t settings = service->settings;
+        settings.options |= SPAWN_OPT_NOTIFY_EXIT;
+        service->request_id = 0;
+
+        // Captured output goes to the service's pipe, attached output to
+        // ours; LISTEN sockets follow from fd 3 on
+        spawn_fd_t fds[2 + MAX_LISTEN_SOCKETS];
+        int fd_count = 0;
+        if (service->output.read_fd != -1) {
+            fds[fd_count++] = (spawn_fd_t){service->output.write_fd, STDOUT_FILENO};
+            fds[fd_count++] = (spawn_fd_t){service->output.write_fd, STDERR_FILENO};
+        } else if (service->attach_output) {
+            fds[fd_count++] = (spawn_fd_t){STDOUT_FILENO, STDOUT_FILENO};
+            fds[fd_count++] = (spawn_fd_t){STDERR_FILENO, STDERR_FILENO};
+        }
+        for (int j = 0; j < service->listener_count; j++) {
+            fds[fd_count++] = (spawn_fd_t){service->listeners[j].fd, 3 + j};
+        }
+        if (service->listener_count > 0) {
+            settings.options |= SPAWN_OPT_LISTEN_FDS;
+            settings.listen_fds = service->listener_count;
+        }
 
-    socket_path = getenv("HOLDEN_SOCKET_PATH");
-    if (socket_path == NULL) {
-        socket_path = SOCKET_PATH;
+        if (service->mode == SERVICE_LOCAL) {
+            service->pidfd = spawn_local_process(service->args[0], service->args,
+                                                 service->settings.envp, fds, fd_count,
+                                                 service->listener_count, &service->pid);
+        } else if (send_agent_request(&sup->agent, &settings,
+                                      service_command(service), service->args,
+                                      fds, fd_count, &service->request_id) == -1) {
+            service->request_id = 0;
+        }
     }
 
-    sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
-    if (sockfd == -1) {
-        perror("socket");
-        return -1;
+    int started = 0;
+    for (int i = 0; i < count; i++) {
+        service_t *service = services[i];
+        if (service->request_id != 0) {
+            service->pidfd = recv_agent_pidfd(&sup->agent, service->request_id,
+                                              service_command(service), &service->pid);
+        }
+        if (service->pidfd != -1) {
+            watch_service(sup, service);
+            start_health(service);
+            start_idle(sup, service);
+            store_service(sup, service);
+        }
+        if (service->pidfd == -1) {
+            plan_restart(sup, service, 1, 1, "failed to start");
+            continue;
+        }
+        started++;
     }
+    watch_agent(sup);
+    return started;
+}
 
-    memset(&addr, 0, sizeof(addr));
-    addr.sun_family = AF_UNIX;
-    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+// Start the given services. Returns the number started; the others are
+// retried later or left stopped according to their restart policy.
+int start_services(supervisor_t *sup, service_t **services, int count) {
+    int started = 0;
+    for (int first = 0; first < count; first += MAX_PIPELINED_STARTS) {
+        int group = count - first < MAX_PIPELINED_STARTS ?
+                    count - first : MAX_PIPELINED_STARTS;
+        started += start_service_group(sup, services + first, group);
+    }
+    return started;
+}
 
-    if (connect(sockfd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
-        perror("connect to agent");
-        close(sockfd);
-        return -1;
+// Release a service and its descriptors. A replica's settings belong to
+// its template.
+void free_service(supervisor_t *sup, service_t *service) {
+    if (service->pidfd != -1) {
+        close(service->pidfd);
+    }
+    if (service->output.read_fd != -1) {
+        forward_output(&service->output);  // what the last run left
+        close(service->output.read_fd);
+        close(service->output.write_fd);
+    }
+    if (service->output.log_fd != -1) {
+        close(service->output.log_fd);
+    }
+    cancel_check(sup, service);
+    if (service->timer.fd != -1) {
+        close(service->timer.fd);
+    }
+    if (service->notify_socket.fd != -1) {
+        close(service->notify_socket.fd);
+    }
+    for (int j = 0; j < service->listener_count; j++) {
+        if (service->listeners[j].fd != -1) {
+            close(service->listeners[j].fd);
+        }
     }
+    if (service->idle_timer.fd != -1) {
+        close(service->idle_timer.fd);
+    }
+    if (service->notify_environment != NULL) {
+        free(service->notify_environment[0]);
+        free(service->notify_environment);
+    }
+    free(service->log_file);
+    free(service->name);
+    if (service->template == NULL) {
+        free(service->check_args);
+        free(service->depends_on);
+        free(service->depends);
+        for (int j = 0; j < service->environment_count; j++) {
+            free(service->environment[j]);
+        }
+        free(service->environment);
+        free(service->cpus);
+        free((char *)service->settings.cwd);
+        free(service->args);
+        free((char *)service->settings.profile);
+        free(service->instances);
+        free(service->listeners);
+    }
+    free(service);
+}
 
-    return sockfd;
+// Scale down by one replica: stop it, with SIGKILL after its stop
+// timeout, and free it once it has exited. Until then its number isn't
+// given to a new replica.
+void retire_replica(supervisor_t *sup, service_t *replica) {
+    service_t *template = replica->template;
+    int index = template->instance_count - 1;
+    while (template->instances[index] != replica) {
+        index--;
+    }
+    memmove(&template->instances[index], &template->instances[index + 1],
+            (template->instance_count - index - 1) * sizeof(*template->instances));
+    template->instance_count--;
+    replica->retired = 1;
+    sup->retired++;
+    cancel_restart(sup, replica);
+    stop_service(sup, replica);
 }
 
-// Spawn a process locally using fork() and return its pidfd
-int spawn_local_process(const char *cmd, char *const args[]) {
-    pid_t pid = fork();
+// Free the retired replicas that have stopped
+void free_retired(supervisor_t *sup) {
+    if (sup->retired == 0) {
+        return;
+    }
+    int kept = 0;
+    for (int i = 0; i < sup->count; i++) {
+        service_t *service = sup->services[i];
+        if (service->retired && service->pidfd == -1) {
+            free_service(sup, service);
+            sup->retired--;
+        } else {
+            sup->services[kept++] = service;
+        }
+    }
+    sup->count = kept;
+}
 
-    if (pid == -1) {
-        perror("fork");
-        return -1;
+// Scale a template to count replicas. Replicas removed are the highest
+// numbered, normally the newest. Those added get the lowest numbers free
+// and are started together, through start_services(). Returns the number
+// of replicas started.
+int scale_service(supervisor_t *sup, service_t *template, int count) {
+    while (template->instance_count > count) {
+        retire_replica(sup, template->instances[template->instance_count - 1]);
+    }
+    int wanted = count - template->instance_count;
+    if (wanted <= 0) {
+        return 0;
     }
 
-    if (pid == 0) {
-        // Child: close inherited fds and exec
-        for (int fd = 3; fd < 1024; fd++) {
-            close(fd);
+    // The numbers taken, by replicas and by retired ones still stopping,
+    // leave the wanted ones at or below limit
+    int limit = count + sup->retired;
+    char *taken = calloc(limit + 1, 1);
+    service_t **added = malloc(wanted * sizeof(*added));
+    if (taken == NULL || added == NULL) {
+        perror("malloc");
+        free(taken);
+        free(added);
+        return 0;
+    }
+    for (int i = 0; i < template->instance_count; i++) {
+        if (template->instances[i]->replica <= limit) {
+            taken[template->instances[i]->replica] = 1;
+        }
+    }
+    for (int i = 0; sup->retired > 0 && i < sup->count; i++) {
+        service_t *service = sup->services[i];
+        if (service->retired && service->template == template && service->replica <= limit) {
+            taken[service->replica] = 1;
         }
+    }
 
-        execvp(cmd, args);
-        fprintf(stderr, "Failed to exec %s: %s\n", cmd, strerror(errno));
-        _exit(1);
+    int count_added = 0;
+    for (int number = 1; count_added < wanted && number <= limit; number++) {
+        if (taken[number]) {
+            continue;
+        }
+        service_t *replica = add_replica(sup, template, number);
+        if (replica == NULL) {
+            break;
+        }
+        if ((replica->log_file != NULL && open_service_output(sup, replica) == -1) ||
+            open_service_health(sup, replica) == -1) {
+            retire_replica(sup, replica);
+            break;
+        }
+        added[count_added++] = replica;
     }
+    int started = start_services(sup, added, count_added);
+    free(taken);
+    free(added);
+    return started;
+}
 
-    // Parent: get pidfd for child
-    int pidfd = pidfd_open(pid, 0);
-    if (pidfd == -1) {
-        perror("pidfd_open for local process");
-        return -1;
+// Format a duration given in microseconds as seconds
+const char *seconds(char *buf, size_t size, uint64_t us) {
+    snprintf(buf, size, "%llu.%02llus", (unsigned long long)(us / 1000000),
+             (unsigned long long)(us % 1000000 / 10000));
+    return buf;
+}
+
+// Account for a finished run and decide about a restart. status is in
+// waitpid() format, -1 if unknown; usage is NULL if unknown. Returns 1
+// if the service should be restarted right away.
+int service_finished(supervisor_t *sup, service_t *service, int status,
+                     const process_exited_msg_t *usage) {
+    uint64_t runtime = now_ms() - service->started_at;
+    int failed = status == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+
+    if (service->mode == SERVICE_AGENT) {
+        if (service->exit_flags == EXIT_PIDFD) {
+            sup->awaiting_reports--;
+        }
+        service_t **found = tfind(service, &sup->reports, compare_service_pids);
+        if (found != NULL && *found == service) {
+            tdelete(service, &sup->reports, compare_service_pids);
+        }
     }
+    stop_health(sup, service);
+    stop_idle(sup, service);
+    wheel_remove(sup, service);
+    if (service->pidfd != -1) {
+        close(service->pidfd);
+        service->pidfd = -1;
+    }
+    sup->running--;
+    store_service(sup, service);
 
-    printf("Spawned local process %s with PID %d, pidfd %d\n", cmd, pid, pidfd);
-    return pidfd;
+    service->exits++;
+    service->failed_exits += failed;
+    service->last_status = status;
+    service->runtime_ms += runtime;
+
+    char what[160];
+    int n;
+    if (status == -1) {
+        n = snprintf(what, sizeof(what), "died");
+    } else if (WIFEXITED(status)) {
+        n = snprintf(what, sizeof(what), "exited with status %d", WEXITSTATUS(status));
+    } else {
+        n = snprintf(what, sizeof(what), "killed by signal %d", WTERMSIG(status));
+    }
+    char run[24], user[24], sys[24];
+    seconds(run, sizeof(run), runtime * 1000);
+    if (usage != NULL) {
+        service->utime_us += usage->utime_us;
+        service->stime_us += usage->stime_us;
+        if (usage->maxrss_kb > service->maxrss_kb) {
+            service->maxrss_kb = usage->maxrss_kb;
+        }
+        snprintf(what + n, sizeof(what) - n, " after %s (user %s, sys %s, max RSS %llu KB)",
+                 run, seconds(user, sizeof(user), usage->utime_us),
+                 seconds(sys, sizeof(sys), usage->stime_us),
+                 (unsigned long long)usage->maxrss_kb);
+    } else {
+        snprintf(what + n, sizeof(what) - n, " after %s", run);
+    }
+
+    // An on-demand service that was idle or exited cleanly is started again
+    // by the next connection; a failed one by its restart policy
+    int restart = 0;
+    if (service->on_demand && !sup->shutting_down && (service->idle_stopped || !failed)) {
+        printf("[%s] Service %s %s, waiting for a connection\n", timestamp(), service->name,
+               what);
+        wait_for_connection(sup, service);
+    } else {
+        restart = plan_restart(sup, service, failed, 0, what);
+    }
+    if (sup->shutting_down) {
+        service_stopped(sup, service);
+    }
+    return restart;
 }
 
-// Spawn a process via the agent and return its pidfd
-int spawn_agent_process(const char *cmd, char *const args[]) {
-    int sockfd = connect_to_agent();
-    if (sockfd == -1) {
-        return -1;
+// An agent service has exited but its report won't come: settle for
+// what its pidfd tells (kernels with PIDFD_INFO_EXIT only)
+int report_lost(supervisor_t *sup, service_t *service) {
+    int status;
+    if (pidfd_exit_status(service->pidfd, &status) == -1) {
+        status = -1;
     }
+    return service_finished(sup, service, status, NULL);
+}
 
-    // Prepare start process message
-    message_t request = {0};
-    request.header.type = MSG_START_PROCESS;
-    request.header.length = sizeof(start_process_msg_t);
+// A service's pidfd reports that its process has exited. Returns 1 if it
+// should be restarted right away.
+int service_exited(supervisor_t *sup, service_t *service) {
+    epoll_ctl(sup->epfd, EPOLL_CTL_DEL, service->pidfd, NULL);
+    if (service->adopted) {
+        return report_lost(sup, service);
+    }
 
-    strncpy(request.data.start_process.name, cmd, MAX_PROCESS_NAME - 1);
-    request.data.start_process.name[MAX_PROCESS_NAME - 1] = '\0';
+    if (service->mode == SERVICE_LOCAL) {
+        // Our child: reap it, with its resource usage, which waitid()
+        // only returns through the raw system call
+        siginfo_t info = {0};
+        struct rusage ru;
+        if (syscall(SYS_waitid, P_PIDFD, service->pidfd, &info, WEXITED, &ru) == -1) {
+            return service_finished(sup, service, -1, NULL);
+        }
+        int status = info.si_code == CLD_EXITED ? (info.si_status & 0xff) << 8 :
+                     (info.si_status & 0x7f) | (info.si_code == CLD_DUMPED ? 0x80 : 0);
+        process_exited_msg_t usage = {
+            .utime_us = (uint64_t)ru.ru_utime.tv_sec * 1000000 + ru.ru_utime.tv_usec,
+            .stime_us = (uint64_t)ru.ru_stime.tv_sec * 1000000 + ru.ru_stime.tv_usec,
+            .maxrss_kb = ru.ru_maxrss,
+        };
+        return service_finished(sup, service, status, &usage);
+    }
 
-    // Copy arguments (skip argv[0] since we already have the command name)
-    int arg_count = 0;
-    for (int i = 1; args[i] != NULL && arg_count < MAX_ARGS; i++) {
-        strncpy(request.data.start_process.args[arg_count], args[i], MAX_ARG_LEN - 1);
-        request.data.start_process.args[arg_count][MAX_ARG_LEN - 1] = '\0';
-        arg_count++;
+    service->exit_flags |= EXIT_PIDFD;
+    if (service->exit_flags & EXIT_REPORTED) {
+        return service_finished(sup, service, service->exit.status, &service->exit);
     }
-    request.data.start_process.arg_count = arg_count;
+    sup->awaiting_reports++;
+    if (service->session != sup->agent.session || sup->agent.fd == -1) {
+        return report_lost(sup, service);
+    }
+    return 0;
+}
 
-    // Send request to agent
-    if (send_message(sockfd, &request) == -1) {
-        perror("send_message to agent");
-        close(sockfd);
-        return -1;
+// Handle the exit reports that have arrived from the agent. Services to
+// restart right away are stored in restart. Returns how many.
+int collect_agent_reports(supervisor_t *sup, service_t **restart) {
+    int count = 0;
+    while (sup->agent.fd != -1) {
+        agent_reply_t *reply = agent_poll(&sup->agent);
+        if (reply == NULL) {
+            if (errno != EAGAIN) {
+                perror("recv from agent");
+                agent_disconnect(&sup->agent);
+            }
+            break;
+        }
+
+        service_t key = {.pid = reply->msg.data.process_exited.pid};
+        service_t **found = reply->msg.header.type == MSG_PROCESS_EXITED ?
+                            tfind(&key, &sup->reports, compare_service_pids) : NULL;
+        if (reply->msg.header.type == MSG_PROCESS_ERROR) {
+            // Only descriptor store requests go unanswered for
+            fprintf(stderr, "Agent: %s\n", reply->msg.data.process_error.error);
+        }
+        if (found != NULL && (*found)->session == sup->agent.session) {
+            service_t *service = *found;
+            service->exit = reply->msg.data.process_exited;
+            service->exit_flags |= EXIT_REPORTED;
+            if ((service->exit_flags & EXIT_PIDFD) &&
+                service_finished(sup, service, service->exit.status, &service->exit)) {
+                restart[count++] = service;
+            }
+        }
+        agent_reply_free(reply);
     }
 
-    // Receive response
-    message_t response;
-    if (recv_message(sockfd, &response) == -1) {
-        perror("recv_message from agent");
-        close(sockfd);
-        return -1;
+    // Reports sent on a connection that is gone won't come
+    if (sup->awaiting_reports > 0 &&
+        (sup->agent.fd == -1 || sup->agent.session != sup->reports_session)) {
+        for (int i = 0; i < sup->count; i++) {
+            service_t *service = sup->services[i];
+            if (service->mode == SERVICE_AGENT && service->exit_flags == EXIT_PIDFD &&
+                (sup->agent.fd == -1 || service->session != sup->agent.session) &&
+                report_lost(sup, service)) {
+                restart[count++] = service;
+            }
+        }
     }
+    sup->reports_session = sup->agent.session;
+    return count;
+}
 
-    if (response.header.type != MSG_PROCESS_STARTED) {
-        fprintf(stderr, "Agent failed to start process: %s\n",
-                response.data.process_error.error);
-        close(sockfd);
-        return -1;
+// Take over a process a previous orchestrator left running, from its
+// descriptor store entry; the descriptors taken are set to -1 in fds.
+// Returns 1 if adopted, 0 if the entry is stale or doesn't fit.
+int adopt_service(service_t *service, const stored_fds_t *entry, int *fds) {
+    char metadata[64];
+    int pid, flags;
+    unsigned long long started_at;
+    snprintf(metadata, sizeof(metadata), "%.*s", (int)entry->metadata_length,
+             (const char *)entry->metadata);
+    if (service->pidfd != -1 ||
+        sscanf(metadata, "holden1 %d %llu %d", &pid, &started_at, &flags) != 3 ||
+        (int)entry->fd_count != 1 + (flags & STORED_OUTPUT ? 2 : 0) +
+                                (flags & STORED_NOTIFY ? 1 : 0)) {
+        return 0;
+    }
+    struct pollfd pfd = {.fd = fds[0], .events = POLLIN};
+    if (poll(&pfd, 1, 0) != 0) {
+        return 0;  // exited since
     }
 
-    // Receive the pidfd via fd passing
-    int pidfd = recv_fd(sockfd);
-    if (pidfd == -1) {
-        perror("recv_fd from agent");
-        close(sockfd);
-        return -1;
+    service->pidfd = fds[0];
+    fds[0] = -1;
+    int next = 1;
+    if (flags & STORED_OUTPUT) {
+        if (service->log_file != NULL) {
+            service->output.read_fd = fds[1];
+            service->output.write_fd = fds[2];
+            fds[1] = fds[2] = -1;
+        }
+        next += 2;
+    }
+    if ((flags & STORED_NOTIFY) && service->notify) {
+        service->notify_socket.fd = fds[next];
+        fds[next] = -1;
     }
+    service->pid = pid;
+    service->started_at = started_at;
+    service->adopted = 1;
+    return 1;
+}
 
-    printf("Spawned agent process %s with PID %d, pidfd %d\n",
-           cmd, response.data.process_started.host_pid, pidfd);
+// A replica beyond the initial ones, which a previous orchestrator had
+// scaled up to, for the store entry name: added if its template exists.
+// Returns NULL if not.
+service_t *replica_for(supervisor_t *sup, const char *name) {
+    const char *at = strrchr(name, '@');
+    long number;
+    if (at == NULL || at[1] < '1' || at[1] > '9' ||
+        config_number(at + 1, &number) == -1 || number > MAX_REPLICAS) {
+        return NULL;
+    }
+    char *template_name = strndup(name, at - name);
+    if (template_name == NULL) {
+        perror("strndup");
+        return NULL;
+    }
+    service_t *template = find_template(sup, template_name);
+    free(template_name);
+    if (template == NULL || template->instance_count >= MAX_REPLICAS) {
+        return NULL;
+    }
+    return add_replica(sup, template, number);
+}
 
-    close(sockfd);
-    return pidfd;
+// Whether a bound socket is at the address configured for it
+int bound_to(int fd, const service_listener_t *listener) {
+    struct sockaddr_storage address;
+    socklen_t length = sizeof(address);
+    if (getsockname(fd, (struct sockaddr *)&address, &length) == -1 ||
+        address.ss_family != listener->address.ss_family) {
+        return 0;
+    }
+    if (address.ss_family == AF_UNIX) {
+        return strcmp(((struct sockaddr_un *)&address)->sun_path,
+                      ((const struct sockaddr_un *)&listener->address)->sun_path) == 0;
+    }
+    const struct sockaddr_in *in = (const struct sockaddr_in *)&address;
+    const struct sockaddr_in *configured = (const struct sockaddr_in *)&listener->address;
+    return in->sin_port == configured->sin_port &&
+           in->sin_addr.s_addr == configured->sin_addr.s_addr;
 }
 
-void print_usage(const char *prog_name) {
-    printf("Holden PID File Descriptor Process Orchestrator\n");
-    printf("Usage: %s <local_cmd> <agent_cmd>\n", prog_name);
-    printf("\n");
-    printf("This program demonstrates pidfd-based process orchestration by:\n");
-    printf("1. Spawning <local_cmd> locally using fork() and getting its pidfd\n");
-    printf("2. Spawning <agent_cmd> via the holden agent and receiving its pidfd\n");
-    printf("3. Orchestrating both processes using poll() on their pidfds\n");
-    printf("4. Automatically restarting processes when they die\n");
-    printf("\n");
-    printf("Example: %s 'sleep 5' 'sleep 10'\n", prog_name);
-    printf("Environment Variables:\n");
-    printf("  HOLDEN_SOCKET_PATH - Path to agent socket (default: %s)\n", SOCKET_PATH);
+// Take over the LISTEN sockets of a service from its "NAME:listen" store
+// entry, if they are still those configured. Returns 1 if taken, 0 if not.
+int adopt_listeners(supervisor_t *sup, const stored_fds_t *entry, int *fds) {
+    size_t length = strlen(entry->name);
+    if (length <= 7 || strcmp(entry->name + length - 7, ":listen") != 0) {
+        return 0;
+    }
+    char *name = strndup(entry->name, length - 7);
+    service_t *service = name != NULL ? find_service(sup, name) : NULL;
+    free(name);
+    if (service == NULL || (int)entry->fd_count != service->listener_count ||
+        service->listeners[0].fd != -1) {
+        return 0;
+    }
+    for (int i = 0; i < service->listener_count; i++) {
+        if (!bound_to(fds[i], &service->listeners[i])) {
+            return 0;
+        }
+    }
+    for (int i = 0; i < service->listener_count; i++) {
+        service->listeners[i].fd = fds[i];
+        fds[i] = -1;
+    }
+    return 1;
 }
 
-int main(int argc, char *argv[]) {
-    if (argc != 3) {
-        print_usage(argv[0]);
-        return 1;
+// Adopt the processes of our services that the agent's descriptor store
+// holds, including replicas beyond REPLICAS, and their LISTEN sockets,
+// and remove the entries of everything else. Without an agent, or with its store disabled, nothing
+// is stored either. Returns the number of services adopted.
+int adopt_services(supervisor_t *sup) {
+    if (ensure_agent(&sup->agent) == -1) {
+        return 0;
     }
 
-    // Install SIGCHLD handler to reap zombie children
-    struct sigaction sa;
-    sa.sa_handler = sigchld_handler;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
-    if (sigaction(SIGCHLD, &sa, NULL) == -1) {
-        perror("sigaction");
-        return 1;
+    int adopted = 0;
+    char **stale = NULL;
+    int stale_count = 0;
+    uint32_t first = 0, total = 0;
+    do {
+        message_t msg = {0};
+        msg.header.type = MSG_RETRIEVE_FDS;
+        msg.data.retrieve_fds.first = first;
+        uint32_t request_id;
+        int sent = agent_send(&sup->agent, &msg, NULL, 0, &request_id);
+        message_free(&msg);
+        agent_reply_t *reply = sent == -1 ? NULL : agent_wait(&sup->agent, request_id);
+        if (reply == NULL) {
+            perror("retrieve from agent");
+            agent_disconnect(&sup->agent);
+            break;
+        }
+        if (reply->msg.header.type != MSG_STORED_FDS) {
+            agent_reply_free(reply);  // the store is disabled
+            break;
+        }
+
+        sup->fd_store = 1;
+        const stored_fds_msg_t *stored = &reply->msg.data.stored_fds;
+        total = stored->total;
+        int *fds = reply->fds;
+        for (uint32_t i = 0; i < stored->count; i++) {
+            if (adopt_listeners(sup, &stored->entries[i], fds)) {
+                fds += stored->entries[i].fd_count;
+                continue;
+            }
+            service_t *service = find_service(sup, stored->entries[i].name);
+            int added = 0;
+            if (service == NULL) {
+                service = replica_for(sup, stored->entries[i].name);
+                added = service != NULL;
+            }
+            if (service != NULL && adopt_service(service, &stored->entries[i], fds)) {
+                adopted++;
+            } else {
+                if (added) {
+                    retire_replica(sup, service);
+                }
+                char **names = realloc(stale, (stale_count + 1) * sizeof(*names));
+                if (names != NULL) {
+                    stale = names;
+                    stale[stale_count] = strdup(stored->entries[i].name);
+                    stale_count += stale[stale_count] != NULL;
+                }
+            }
+            fds += stored->entries[i].fd_count;
+        }
+        first += stored->count;
+        int done = stored->count == 0;
+        agent_reply_free(reply);
+        if (done) {
+            break;
+        }
+    } while (first < total);
+
+    // Removing entries reorders the store, so only once all are read
+    for (int i = 0; i < stale_count; i++) {
+        store_fds(sup, stale[i], NULL, 0, NULL);
+        free(stale[i]);
     }
+    free(stale);
+    return adopted;
+}
 
-    const char *local_cmd = argv[1];
-    const char *agent_cmd = argv[2];
+// Watch an adopted service like one we started
+void watch_adopted(supervisor_t *sup, service_t *service) {
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = service};
+    if (epoll_ctl(sup->epfd, EPOLL_CTL_ADD, service->pidfd, &ev) == -1) {
+        perror("epoll_ctl");
+        close(service->pidfd);
+        service->pidfd = -1;
+        return;
+    }
+    service->session = 0;
+    service->exit_flags = 0;
+    sup->running++;
+    service_ready(service);
+    start_idle(sup, service);
+    printf("Adopted service %s with PID %d, running for %llu ms\n", service->name,
+           service->pid, (unsigned long long)(now_ms() - service->started_at));
+}
 
-    // Parse commands into argv arrays (simple space-based parsing)
-    char local_cmd_copy[256], agent_cmd_copy[256];
-    strncpy(local_cmd_copy, local_cmd, sizeof(local_cmd_copy) - 1);
-    local_cmd_copy[sizeof(local_cmd_copy) - 1] = '\0';
-    strncpy(agent_cmd_copy, agent_cmd, sizeof(agent_cmd_copy) - 1);
-    agent_cmd_copy[sizeof(agent_cmd_copy) - 1] = '\0';
+// Print the counters of every service
+void print_service_stats(const supervisor_t *sup) {
+    printf("%-20s %7s %7s %7s %12s %10s %10s %12s %7s %5s %8s\n", "SERVICE", "STARTS",
+           "EXITS", "FAILED", "RUNTIME", "USER", "SYS", "MAX RSS KB", "CHECKS", "HUNG",
+           "LAST");
+    for (int i = 0; i < sup->count; i++) {
+        const service_t *service = sup->services[i];
+        char runtime[24], user[24], sys[24], last[16];
+        if (service->last_status == -1) {
+            snprintf(last, sizeof(last), "-");
+        } else if (WIFEXITED(service->last_status)) {
+            snprintf(last, sizeof(last), "exit %d", WEXITSTATUS(service->last_status));
+        } else {
+            snprintf(last, sizeof(last), "sig %d", WTERMSIG(service->last_status));
+        }
+        printf("%-20s %7lu %7lu %7lu %12s %10s %10s %12llu %7lu %5lu %8s\n",
+               service->name, service->starts, service->exits, service->failed_exits,
+               seconds(runtime, sizeof(runtime), service->runtime_ms * 1000),
+               seconds(user, sizeof(user), service->utime_us),
+               seconds(sys, sizeof(sys), service->stime_us),
+               (unsigned long long)service->maxrss_kb, service->failed_checks,
+               service->hung, last);
+    }
+}
 
-    // Simple tokenization for local command
-    char *local_args[16] = {NULL};
-    int local_argc = 0;
-    char *token = strtok(local_cmd_copy, " ");
-    while (token && local_argc < 15) {
-        local_args[local_argc++] = token;
-        token = strtok(NULL, " ");
+// Listen for control clients at path, accessible to our user only
+int open_control_socket(const char *path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Control socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("socket");
+        return -1;
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        chmod(path, 0600) == -1 || listen(fd, SOMAXCONN) == -1) {
+        fprintf(stderr, "Failed to listen on %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
     }
-    local_args[local_argc] = NULL;
+    return fd;
+}
 
-    // Simple tokenization for agent command
-    char *agent_args[16] = {NULL};
-    int agent_argc = 0;
-    token = strtok(agent_cmd_copy, " ");
-    while (token && agent_argc < 15) {
-        agent_args[agent_argc++] = token;
-        token = strtok(NULL, " ");
+// Accept the clients waiting on the control socket
+void accept_control_clients(supervisor_t *sup) {
+    int fd;
+    while ((fd = accept4(sup->controlfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+        control_client_t *client = calloc(1, sizeof(*client));
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = client};
+        if (client == NULL || epoll_ctl(sup->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            perror("control client");
+            free(client);
+            close(fd);
+            continue;
+        }
+        client->kind = WATCH_CONTROL;
+        client->fd = fd;
+        client->next = sup->clients;
+        sup->clients = client;
     }
-    agent_args[agent_argc] = NULL;
+}
 
-    printf("Starting pidfd orchestrator demo...\n");
-    printf("Local command: %s\n", local_cmd);
-    printf("Agent command: %s\n", agent_cmd);
-    printf("Press Ctrl+C to exit\n\n");
+void close_control_client(supervisor_t *sup, control_client_t *client) {
+    control_client_t **link = &sup->clients;
+    while (*link != client) {
+        link = &(*link)->next;
+    }
+    *link = client->next;
+    close(client->fd);
+    free(client);
+}
 
-    int local_pidfd = -1;
-    int agent_pidfd = -1;
-    int restart_count = 0;
+// Send a line to a control client. Replies are small and the client is
+// expected to read them: one that doesn't fit in the socket buffer gets
+// the client dropped. Returns 0, or -1 if the client should be closed.
+int control_reply(control_client_t *client, const char *format, ...) {
+    char line[CONTROL_LINE_MAX + 128];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (length >= (int)sizeof(line)) {
+        length = sizeof(line) - 1;
+        line[length - 1] = '\n';
+    }
+    return send(client->fd, line, length, MSG_NOSIGNAL) == length ? 0 : -1;
+}
 
-    // Initial spawn
-    local_pidfd = spawn_local_process(local_args[0], local_args);
-    if (local_pidfd == -1) {
-        fprintf(stderr, "Failed to spawn local process\n");
-        return 1;
+// Run a control command:
+//   status             - each replicated service's replicas and how many run
+//   scale NAME COUNT   - scale a replicated service to COUNT replicas
+// Returns 0, or -1 if the client should be closed.
+int control_command(supervisor_t *sup, control_client_t *client, char *line) {
+    char *saveptr;
+    char *command = strtok_r(line, " \t\r", &saveptr);
+    if (command == NULL) {
+        return 0;
     }
 
-    agent_pidfd = spawn_agent_process(agent_args[0], agent_args);
-    if (agent_pidfd == -1) {
-        fprintf(stderr, "Failed to spawn agent process\n");
-        close(local_pidfd);
-        return 1;
+    if (strcmp(command, "status") == 0) {
+        for (int i = 0; i < sup->template_count; i++) {
+            const service_t *template = sup->templates[i];
+            int running = 0;
+            for (int j = 0; j < template->instance_count; j++) {
+                running += template->instances[j]->pidfd != -1;
+            }
+            if (control_reply(client, "%s %d replicas, %d running\n", template->name,
+                              template->instance_count, running) == -1) {
+                return -1;
+            }
+        }
+        return control_reply(client, "OK %d retired replicas stopping\n", sup->retired);
+    }
+
+    if (strcmp(command, "scale") != 0) {
+        return control_reply(client, "ERROR unknown command %s\n", command);
+    }
+    char *name = strtok_r(NULL, " \t\r", &saveptr);
+    char *value = strtok_r(NULL, " \t\r", &saveptr);
+    if (value == NULL || strtok_r(NULL, " \t\r", &saveptr) != NULL) {
+        return control_reply(client, "ERROR usage: scale NAME COUNT\n");
     }
+    service_t *template = find_template(sup, name);
+    long count;
+    if (template == NULL) {
+        return control_reply(client, "ERROR %s is not a replicated service\n", name);
+    }
+    if (config_number(value, &count) == -1 || count > MAX_REPLICAS) {
+        return control_reply(client, "ERROR COUNT must be between 0 and %d\n",
+                             MAX_REPLICAS);
+    }
+    if (sup->shutting_down) {
+        return control_reply(client, "ERROR shutting down\n");
+    }
+
+    uint64_t begin = now_ms();
+    int before = template->instance_count;
+    int started = scale_service(sup, template, count);
+    unsigned long long elapsed = now_ms() - begin;
+    printf("[%s] Scaled %s from %d to %d replicas in %llu ms\n", timestamp(),
+           template->name, before, template->instance_count, elapsed);
+    if (template->instance_count < count) {
+        return control_reply(client, "ERROR %s: only %d of %ld replicas could be added\n",
+                             template->name, template->instance_count, count);
+    }
+    return control_reply(client, "OK %s %d replicas, %d started, %d stopping, %llu ms\n",
+                         template->name, template->instance_count, started,
+                         before > count ? before - (int)count : 0, elapsed);
+}
 
-    // Monitor loop
+// Run the commands a control client has sent. It is closed at end of
+// file, on errors, and for a line longer than CONTROL_LINE_MAX.
+void control_input(supervisor_t *sup, control_client_t *client) {
     while (1) {
-        struct pollfd fds[2];
-        fds[0].fd = local_pidfd;
-        fds[0].events = POLLIN;
-        fds[1].fd = agent_pidfd;
-        fds[1].events = POLLIN;
+        ssize_t n = recv(client->fd, client->line + client->length,
+                         sizeof(client->line) - client->length, 0);
+        if (n == -1 && errno == EAGAIN) {
+            return;
+        }
+        if (n <= 0) {
+            close_control_client(sup, client);
+            return;
+        }
+        client->length += n;
 
-        printf("Monitoring processes (restart count: %d)...\n", restart_count);
+        char *start = client->line, *end;
+        while ((end = memchr(start, '\n', client->line + client->length - start)) != NULL) {
+            *end = '\0';
+            if (control_command(sup, client, start) == -1) {
+                close_control_client(sup, client);
+                return;
+            }
+            start = end + 1;
+        }
+        client->length -= start - client->line;
+        memmove(client->line, start, client->length);
+        if (client->length == sizeof(client->line)) {
+            control_reply(client, "ERROR line too long\n");
+            close_control_client(sup, client);
+            return;
+        }
+    }
+}
+
+// Restart services as they exit, until none is left running or waiting
+// for a restart, or with a control socket, until shut down
+void run_supervisor(supervisor_t *sup) {
+    struct epoll_event events[MAX_EVENTS];
+    // A service finishes at most once per wakeup
+    service_t **restart = NULL;
+    int restart_capacity = 0;
+    // Control clients with input, served once the restarts are done
+    control_client_t *clients[MAX_EVENTS];
+    // On-demand services with a connection waiting
+    service_t *activated[MAX_EVENTS];
+
+    while ((sup->running > 0 || sup->timer_count > 0 ||
+            (!sup->shutting_down && (sup->controlfd != -1 || sup->waiting > 0))) &&
+           !sup->detached) {
+        if (restart_capacity <= sup->count) {
+            service_t **grown = realloc(restart, (sup->count + 1) * sizeof(*grown));
+            if (grown == NULL) {
+                perror("realloc");
+                break;
+            }
+            restart = grown;
+            restart_capacity = sup->count + 1;
+        }
+        printf("Monitoring %d processes (restart count: %d)...\n",
+               sup->running, sup->restart_count);
 
-        int ret = poll(fds, 2, -1);  // Block indefinitely
-        if (ret == -1) {
+        // Reports read while waiting for a reply are already queued
+        int timeout = sup->agent.queued != NULL ? 0 : -1;
+        int nfds = epoll_wait(sup->epfd, events, MAX_EVENTS, timeout);
+        if (nfds == -1) {
             if (errno == EINTR) {
                 continue;  // Interrupted by signal, continue monitoring
             }
-            perror("poll");
+            perror("epoll_wait");
             break;
         }
 
-        time_t now = time(NULL);
+        int count = 0, client_count = 0, activated_count = 0;
+        for (int i = 0; i < nfds; i++) {
+            void *ptr = events[i].data.ptr;
+            if (ptr == NULL) {
+                // Restart timer; the due restarts are collected below
+                uint64_t expirations;
+                if (read(sup->timerfd, &expirations, sizeof(expirations)) == -1 &&
+                    errno != EAGAIN) {
+                    perror("read timerfd");
+                }
+                sup->timer_armed = 0;
+                continue;
+            }
+            if (ptr == &sup->agent) {
+                continue;  // reports are collected below
+            }
+            if (ptr == &sup->signalfd) {
+                struct signalfd_siginfo info;
+                if (read(sup->signalfd, &info, sizeof(info)) != sizeof(info)) {
+                    continue;
+                }
+                if (info.ssi_signo == SIGUSR1) {
+                    print_service_stats(sup);
+                } else if (info.ssi_signo != SIGUSR2) {
+                    shutdown_services(sup);
+                } else if (sup->fd_store) {
+                    sup->detached = 1;
+                } else {
+                    fprintf(stderr, "Ignoring SIGUSR2: the agent's descriptor store "
+                            "is disabled\n");
+                }
+                continue;
+            }
+            if (ptr == &sup->stop_timerfd) {
+                stop_timer_fired(sup);
+                continue;
+            }
+            if (ptr == &sup->controlfd) {
+                accept_control_clients(sup);
+                continue;
+            }
 
-        // Check if local process died
-        if (fds[0].revents & POLLIN) {
-            char *time_str = ctime(&now);
-            time_str[strlen(time_str) - 1] = '\0'; // Remove newline
-            printf("[%s] Local process died, restarting...\n", time_str);
-            close(local_pidfd);
-            local_pidfd = spawn_local_process(local_args[0], local_args);
-            if (local_pidfd == -1) {
-                fprintf(stderr, "Failed to restart local process\n");
+            switch (*(watch_kind_t *)ptr) {
+            case WATCH_OUTPUT:
+                forward_output(ptr);
+                continue;
+            case WATCH_NOTIFY:
+                notify_received(((service_watch_t *)ptr)->service);
+                continue;
+            case WATCH_TIMER:
+                service_timer_fired(sup, ((service_watch_t *)ptr)->service);
+                continue;
+            case WATCH_CHECK:
+                check_finished(sup, ((service_watch_t *)ptr)->service);
+                continue;
+            case WATCH_CONTROL:
+                clients[client_count++] = ptr;
+                continue;
+            case WATCH_LISTEN:
+                if (connection_arrived(sup, ptr)) {
+                    activated[activated_count++] = ((service_listener_t *)ptr)->service;
+                }
+                continue;
+            case WATCH_IDLE:
+                idle_timer_fired(sup, ((service_watch_t *)ptr)->service);
+                continue;
+            case WATCH_SERVICE:
                 break;
             }
-            restart_count++;
+
+            service_t *service = ptr;
+            if (service_exited(sup, service)) {
+                restart[count++] = service;
+            }
+        }
+        count += collect_agent_reports(sup, restart + count);
+        if (sup->shutting_down) {
+            count = 0;  // exited before the shutdown began, stays down
         }
 
-        // Check if agent process died
-        if (fds[1].revents & POLLIN) {
-            char *time_str = ctime(&now);
-            time_str[strlen(time_str) - 1] = '\0'; // Remove newline
-            printf("[%s] Agent process died, restarting...\n", time_str);
-            close(agent_pidfd);
-            agent_pidfd = spawn_agent_process(agent_args[0], agent_args);
-            if (agent_pidfd == -1) {
-                fprintf(stderr, "Failed to restart agent process\n");
-                break;
+        // Restart everything that exited in this wakeup together, then
+        // whatever is due on the timer
+        sup->restart_count += start_services(sup, restart, count);
+        uint64_t now = now_ms();
+        do {
+            count = 0;
+            service_t *service;
+            while (count < MAX_EVENTS && (service = next_due_restart(sup, now)) != NULL) {
+                restart[count++] = service;
             }
-            restart_count++;
+            sup->restart_count += start_services(sup, restart, count);
+        } while (count == MAX_EVENTS);
+        start_services(sup, activated, activated_count);
+
+        // Scaling only once nothing refers to the services that exited
+        for (int i = 0; i < client_count; i++) {
+            control_input(sup, clients[i]);
+        }
+        free_retired(sup);
+        arm_restart_timer(sup);
+    }
+    free(restart);
+}
+
+// tdestroy() callback for trees pointing to services freed elsewhere
+void noop_free(void *node) {
+    (void)node;
+}
+
+void free_services(supervisor_t *sup) {
+    // Replicas first, their templates hold their settings
+    for (int i = 0; i < sup->count; i++) {
+        free_service(sup, sup->services[i]);
+    }
+    for (int i = 0; i < sup->template_count; i++) {
+        free_service(sup, sup->templates[i]);
+    }
+    tdestroy(sup->reports, noop_free);
+    free(sup->services);
+    free(sup->templates);
+    free(sup->timers);
+}
+
+void print_usage(const char *prog_name) {
+    printf("Holden PID File Descriptor Process Orchestrator\n");
+    printf("Usage: %s [--attach-output] <local_cmd> <agent_cmd>\n", prog_name);
+    printf("       %s --config <services.conf> [--control <socket>]\n", prog_name);
+    printf("\n");
+    printf("This program supervises processes through their pidfds by:\n");
+    printf("1. Spawning <local_cmd> locally and getting its pidfd\n");
+    printf("2. Spawning <agent_cmd> via the holden agent and receiving its pidfd\n");
+    printf("3. Watching all pidfds in a single epoll set\n");
+    printf("4. Automatically restarting processes when they die\n");
+    printf("\n");
+    printf("Options:\n");
+    printf("  --attach-output  Hand our stdout/stderr to the agent-spawned process\n");
+    printf("  --config FILE    Supervise the services defined in FILE instead\n");
+    printf("  --control PATH   Take commands on this Unix socket, e.g. to scale\n");
+    printf("                   services with REPLICAS\n");
+    printf("\n");
+    printf("Example: %s 'sleep 5' 'sleep 10'\n", prog_name);
+    printf("Environment Variables:\n");
+    printf("  HOLDEN_SOCKET_PATH - Path to agent socket (default: %s)\n", SOCKET_PATH);
+}
+
+int main(int argc, char *argv[]) {
+    supervisor_t sup = {.epfd = -1, .timerfd = -1, .signalfd = -1, .stop_timerfd = -1,
+                        .controlfd = -1, .agent = {.fd = -1}};
+    if (load_defaults(&sup) == -1) {
+        return 1;
+    }
+
+    const char *control_path = NULL;
+    if (argc == 5 && strcmp(argv[1], "--config") == 0 &&
+        strcmp(argv[3], "--control") == 0) {
+        control_path = argv[4];
+        argc = 3;
+    }
+    if (argc == 3 && strcmp(argv[1], "--config") == 0) {
+        if (load_services(&sup, argv[2]) == -1) {
+            free_services(&sup);
+            return 1;
+        }
+        printf("Starting pidfd orchestrator with %d services from %s...\n",
+               sup.count, argv[2]);
+    } else {
+        int attach_output = 0;
+        if (argc > 1 && strcmp(argv[1], "--attach-output") == 0) {
+            attach_output = 1;
+            argv++;
+            argc--;
         }
 
-        // Small delay to avoid tight restart loops
-        usleep(100000);  // 100ms
+        if (argc != 3) {
+            print_usage(argv[0]);
+            return 1;
+        }
+
+        service_t *local = add_service(&sup, "local");
+        service_t *agent = add_service(&sup, "agent");
+        if (local == NULL || agent == NULL) {
+            free_services(&sup);
+            return 1;
+        }
+        local->mode = SERVICE_LOCAL;
+        local->args = split_command(argv[1]);
+        agent->args = split_command(argv[2]);
+        agent->attach_output = attach_output;
+        if (local->args == NULL || agent->args == NULL) {
+            fprintf(stderr, "Invalid command\n");
+            free_services(&sup);
+            return 1;
+        }
+
+        printf("Starting pidfd orchestrator demo...\n");
+        printf("Local command: %s\n", argv[1]);
+        printf("Agent command: %s\n", argv[2]);
+    }
+    printf("Press Ctrl+C to stop the services\n\n");
+
+    sup.epfd = epoll_create1(EPOLL_CLOEXEC);
+    sup.timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    sup.stop_timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+    struct epoll_event stop_ev = {.events = EPOLLIN, .data.ptr = &sup.stop_timerfd};
+    if (sup.epfd == -1 || sup.timerfd == -1 || sup.stop_timerfd == -1 ||
+        epoll_ctl(sup.epfd, EPOLL_CTL_ADD, sup.timerfd, &ev) == -1 ||
+        epoll_ctl(sup.epfd, EPOLL_CTL_ADD, sup.stop_timerfd, &stop_ev) == -1) {
+        perror("epoll/timerfd");
+        free_services(&sup);
+        return 1;
+    }
+    srandom(time(NULL) ^ getpid());
+
+    // SIGUSR1 prints the per-service counters; SIGTERM and SIGINT stop the
+    // services, and a second one kills them; SIGUSR2 exits and leaves them
+    // to the next orchestrator
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    sigaddset(&mask, SIGUSR2);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGINT);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    sup.signalfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    ev.data.ptr = &sup.signalfd;
+    if (sup.signalfd == -1 ||
+        epoll_ctl(sup.epfd, EPOLL_CTL_ADD, sup.signalfd, &ev) == -1) {
+        perror("signalfd");
+    }
+
+    if (control_path != NULL) {
+        sup.controlfd = open_control_socket(control_path);
+        ev.data.ptr = &sup.controlfd;
+        if (sup.controlfd == -1 ||
+            epoll_ctl(sup.epfd, EPOLL_CTL_ADD, sup.controlfd, &ev) == -1) {
+            free_services(&sup);
+            return 1;
+        }
+        printf("Control socket on %s\n", control_path);
+    }
+
+    // Processes a previous orchestrator left running are taken over
+    // rather than started again
+    int adopted = adopt_services(&sup);
+    free_retired(&sup);
+
+    for (int i = 0; i < sup.count; i++) {
+        if (sup.services[i]->log_file != NULL &&
+            open_service_output(&sup, sup.services[i]) == -1) {
+            free_services(&sup);
+            return 1;
+        }
+        if (open_service_health(&sup, sup.services[i]) == -1 ||
+            open_service_sockets(&sup, sup.services[i]) == -1) {
+            free_services(&sup);
+            return 1;
+        }
+    }
+
+    // Initial spawn
+    service_t **initial = malloc(sup.count * sizeof(*initial));
+    if (initial == NULL) {
+        perror("malloc");
+        free_services(&sup);
+        return 1;
+    }
+    int count = 0;
+    for (int i = 0; i < sup.count; i++) {
+        if (sup.services[i]->adopted) {
+            watch_adopted(&sup, sup.services[i]);
+        } else if (sup.services[i]->on_demand) {
+            printf("Service %s waits for a connection\n", sup.services[i]->name);
+            wait_for_connection(&sup, sup.services[i]);
+        } else {
+            initial[count++] = sup.services[i];
+        }
+    }
+    int started = start_services(&sup, initial, count);
+    free(initial);
+    if (started < count) {
+        fprintf(stderr, "Failed to start %d of %d services\n", count - started, count);
+    }
+    started += adopted;
+
+    run_supervisor(&sup);
+    if (sup.detached) {
+        // The store requests are all handled once this is answered
+        message_t ping = {.header.type = MSG_PING};
+        uint32_t request_id;
+        if (ensure_agent(&sup.agent) == 0 &&
+            agent_send(&sup.agent, &ping, NULL, 0, &request_id) == 0) {
+            agent_reply_free(agent_wait(&sup.agent, request_id));
+        }
+        message_free(&ping);
+        printf("Detached, leaving %d services running\n", sup.running);
+    } else {
+        // Nobody is left to take connections
+        for (int i = 0; i < sup.count; i++) {
+            store_listeners(&sup, sup.services[i], 0);
+        }
     }
 
     // Cleanup
-    if (local_pidfd != -1) {
-        close(local_pidfd);
+    int restart_count = sup.restart_count;
+    int failed = started == 0 && count + adopted > 0;
+    print_service_stats(&sup);
+    if (sup.signalfd != -1) {
+        close(sup.signalfd);
+    }
+    while (sup.clients != NULL) {
+        close_control_client(&sup, sup.clients);
     }
-    if (agent_pidfd != -1) {
-        close(agent_pidfd);
+    if (sup.controlfd != -1) {
+        close(sup.controlfd);
+        unlink(control_path);
     }
+    close(sup.timerfd);
+    close(sup.stop_timerfd);
+    close(sup.epfd);
+    agent_disconnect(&sup.agent);
+    free_services(&sup);
 
     printf("Monitor exiting after %d restarts\n", restart_count);
-    return 0;
-}
\ No newline at end of file
+    return failed;
+}
@@ -0,0 +1,125 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "pool.h"
+#include "spawn.h"
+
+// Start one parked process
+static int start_member(pool_t *pool, pool_member_t *member) {
+    int go[2];
+    if (pipe2(go, O_CLOEXEC) == -1) {
+        return -1;
+    }
+
+    spawn_fd_t fds[] = {{.fd = go[0], .target = POOL_GO_FD}};
+    spawn_attr_t attr = {
+        .file = pool->argv[0],
+        .argv = pool->argv,
+        .fds = fds,
+        .fd_count = 1,
+    };
+    member->pidfd = spawn_process(&attr, &member->pid);
+    int saved_errno = errno;
+    close(go[0]);
+    if (member->pidfd == -1) {
+        close(go[1]);
+        errno = saved_errno;
+        return -1;
+    }
+    member->go_fd = go[1];
+    return 0;
+}
+
+static void release_member(pool_member_t *member) {
+    close(member->go_fd);
+    close(member->pidfd);
+}
+
+int pool_fill(pool_t *pool) {
+    if (pool->members == NULL) {
+        pool->members = calloc(pool->size, sizeof(*pool->members));
+        if (pool->members == NULL) {
+            return -1;
+        }
+    }
+
+    int started = 0;
+    while (pool->count < pool->size) {
+        if (start_member(pool, &pool->members[pool->count]) == -1) {
+            fprintf(stderr, "Failed to prestart %s for profile %s: %s\n",
+                    pool->argv[0], pool->name, strerror(errno));
+            return started > 0 ? started : -1;
+        }
+        pool->count++;
+        started++;
+    }
+    return started;
+}
+
+int pool_prune(pool_t *pool) {
+    int dropped = 0;
+    for (int i = 0; i < pool->count; ) {
+        pool_member_t *member = &pool->members[i];
+        struct pollfd pfd = {.fd = member->pidfd, .events = POLLIN};
+        if (poll(&pfd, 1, 0) == 0) {
+            i++;
+            continue;
+        }
+        waitpid(member->pid, NULL, WNOHANG);
+        release_member(member);
+        memmove(member, member + 1, (--pool->count - i) * sizeof(*member));
+        dropped++;
+    }
+    return dropped;
+}
+
+int pool_take(pool_t *pool, pid_t *pid) {
+    pool_member_t member;
+
+    while (1) {
+        if (pool->count == 0) {
+            // Pool drained faster than it's refilled: start one now
+            if (start_member(pool, &member) == -1) {
+                return -1;
+            }
+            break;
+        }
+
+        // Oldest first, so they're all used in turn
+        member = pool->members[0];
+        memmove(pool->members, pool->members + 1,
+                --pool->count * sizeof(*pool->members));
+
+        // Skip (and reap) processes that died while parked
+        struct pollfd pfd = {.fd = member.pidfd, .events = POLLIN};
+        if (poll(&pfd, 1, 0) == 0) {
+            break;
+        }
+        waitpid(member.pid, NULL, WNOHANG);
+        release_member(&member);
+    }
+
+    // The pidfd goes to the caller, the go pipe is no longer needed
+    if (write(member.go_fd, "", 1) == -1) {
+        // It closed POOL_GO_FD itself; hand it out anyway
+    }
+    close(member.go_fd);
+    *pid = member.pid;
+    return member.pidfd;
+}
+
+void pool_free(pool_t *pool) {
+    for (int i = 0; i < pool->count; i++) {
+        release_member(&pool->members[i]);
+    }
+    free(pool->members);
+    free(pool->argv);
+    free(pool->name);
+    memset(pool, 0, sizeof(*pool));
+}
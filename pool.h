@@ -0,0 +1,47 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <sys/types.h>
+
+// Descriptor on which a pooled process waits to be handed out
+#define POOL_GO_FD 3
+
+// A process started ahead of time and parked: POOL_GO_FD is the read
+// end of a pipe that stays silent until the process is handed out
+typedef struct {
+    pid_t pid;
+    int pidfd;
+    int go_fd;          // write end of the pipe
+} pool_member_t;
+
+// A profile: a command kept prestarted so that taking a process skips
+// fork, exec, dynamic loading and whatever initialization the program
+// does before it reads POOL_GO_FD.
+//
+// The program has to cooperate: once ready, it reads one byte from
+// POOL_GO_FD. A byte means it has been handed out and should start its
+// work; EOF means the agent went away and it should exit.
+typedef struct {
+    char *name;
+    char **argv;        // from split_command()
+    int size;           // processes to keep parked
+    pool_member_t *members;
+    int count;
+} pool_t;
+
+// Start parked processes until the pool is full. Returns the number
+// started, or -1 if none could be.
+int pool_fill(pool_t *pool);
+
+// Drop and reap parked processes that have died, so that pool_fill()
+// replaces them. Returns the number dropped.
+int pool_prune(pool_t *pool);
+
+// Hand out a process: a parked one if any is still alive, otherwise one
+// started on the spot. Returns its pidfd and PID, or -1 with errno set.
+int pool_take(pool_t *pool, pid_t *pid);
+
+// Release the pool; parked processes see EOF and exit
+void pool_free(pool_t *pool);
+
+#endif
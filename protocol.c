@@ -1,56 +1,979 @@
+#define _GNU_SOURCE
 #include "protocol.h"
+#include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <sys/socket.h>
 
-int send_message(int sockfd, const message_t *msg) {
-    ssize_t bytes_sent = 0;
-    ssize_t total_size = sizeof(message_header_t) + msg->header.length;
-    const char *data = (const char *)msg;
+#define HEADER_SIZE sizeof(message_header_t)
 
-    while (bytes_sent < total_size) {
-        ssize_t result = write(sockfd, data + bytes_sent, total_size - bytes_sent);
-        if (result <= 0) {
-            if (result == -1 && errno == EINTR) {
-                continue;
-            }
+// Bounds-checked cursor over a received payload, plus the scratch space
+// after it where decoded vectors and arrays are placed
+typedef struct {
+    const char *pos;
+    size_t left;
+    char *scratch;
+    size_t scratch_left;
+} reader_t;
+
+void message_free(message_t *msg) {
+    free(msg->buf);
+    msg->buf = NULL;
+    msg->capacity = 0;
+}
+
+static int reserve(message_t *msg, size_t size) {
+    if (size <= msg->capacity) {
+        return 0;
+    }
+
+    size_t capacity = msg->capacity ? msg->capacity : 256;
+    while (capacity < size) {
+        capacity *= 2;
+    }
+    char *buf = realloc(msg->buf, capacity);
+    if (buf == NULL) {
+        return -1;
+    }
+    msg->buf = buf;
+    msg->capacity = capacity;
+    return 0;
+}
+
+static int put_bytes(message_t *msg, const void *data, size_t size) {
+    size_t used = HEADER_SIZE + msg->header.length;
+    if (msg->header.length + size > MAX_MESSAGE_SIZE) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if (reserve(msg, used + size) == -1) {
+        return -1;
+    }
+    memcpy(msg->buf + used, data, size);
+    msg->header.length += size;
+    return 0;
+}
+
+static int put_u32(message_t *msg, uint32_t value) {
+    return put_bytes(msg, &value, sizeof(value));
+}
+
+static int put_i32(message_t *msg, int32_t value) {
+    return put_bytes(msg, &value, sizeof(value));
+}
+
+static int put_u64(message_t *msg, uint64_t value) {
+    return put_bytes(msg, &value, sizeof(value));
+}
+
+static int put_string(message_t *msg, const char *s) {
+    return put_bytes(msg, s, strlen(s) + 1);
+}
+
+static int put_strv(message_t *msg, char *const *strv) {
+    uint32_t count = 0;
+    while (strv != NULL && strv[count] != NULL) {
+        count++;
+    }
+    if (put_u32(msg, count) == -1) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        if (put_string(msg, strv[i]) == -1) {
             return -1;
         }
-        bytes_sent += result;
     }
+    return 0;
+}
 
+static int get_bytes(reader_t *r, void *out, size_t size) {
+    if (r->left < size) {
+        errno = EPROTO;
+        return -1;
+    }
+    memcpy(out, r->pos, size);
+    r->pos += size;
+    r->left -= size;
     return 0;
 }
 
-int recv_message(int sockfd, message_t *msg) {
-    ssize_t bytes_received = 0;
-    char *data = (char *)msg;
-
-    while (bytes_received < sizeof(message_header_t)) {
-        ssize_t result = read(sockfd, data + bytes_received,
-                             sizeof(message_header_t) - bytes_received);
-        if (result <= 0) {
-            if (result == -1 && errno == EINTR) {
-                continue;
+static int get_u32(reader_t *r, uint32_t *value) {
+    return get_bytes(r, value, sizeof(*value));
+}
+
+static int get_i32(reader_t *r, int32_t *value) {
+    return get_bytes(r, value, sizeof(*value));
+}
+
+static int get_u64(reader_t *r, uint64_t *value) {
+    return get_bytes(r, value, sizeof(*value));
+}
+
+static int get_string(reader_t *r, const char **s) {
+    const char *end = memchr(r->pos, '\0', r->left);
+    if (end == NULL) {
+        errno = EPROTO;
+        return -1;
+    }
+    *s = r->pos;
+    r->left -= end + 1 - r->pos;
+    r->pos = end + 1;
+    return 0;
+}
+
+static void *get_scratch(reader_t *r, size_t size) {
+    size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    if (size > r->scratch_left) {
+        errno = EPROTO;
+        return NULL;
+    }
+    void *p = r->scratch;
+    r->scratch += size;
+    r->scratch_left -= size;
+    return p;
+}
+
+// Decode a string table into a NULL-terminated vector in scratch space
+static int get_strv(reader_t *r, char *const **strv) {
+    uint32_t count;
+    if (get_u32(r, &count) == -1) {
+        return -1;
+    }
+    if (count > r->left) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    char **table = get_scratch(r, (count + 1) * sizeof(char *));
+    if (table == NULL) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        const char *s;
+        if (get_string(r, &s) == -1) {
+            return -1;
+        }
+        table[i] = (char *)s;
+    }
+    table[count] = NULL;
+    *strv = table;
+    return 0;
+}
+
+static int put_stored_fds(message_t *msg, const stored_fds_t *entry) {
+    if (entry->fd_count > MAX_STORED_FDS || entry->metadata_length > MAX_STORED_METADATA) {
+        errno = EINVAL;
+        return -1;
+    }
+    int result = put_string(msg, entry->name);
+    if (result == 0) {
+        result = put_u32(msg, entry->fd_count);
+    }
+    if (result == 0) {
+        result = put_u32(msg, entry->metadata_length);
+    }
+    if (result == 0 && entry->metadata_length > 0) {
+        result = put_bytes(msg, entry->metadata, entry->metadata_length);
+    }
+    return result;
+}
+
+static int get_stored_fds(reader_t *r, stored_fds_t *entry) {
+    int result = get_string(r, &entry->name);
+    if (result == 0) {
+        result = get_u32(r, &entry->fd_count);
+    }
+    if (result == 0) {
+        result = get_u32(r, &entry->metadata_length);
+    }
+    if (result == 0 && (entry->fd_count > MAX_STORED_FDS ||
+                        entry->metadata_length > MAX_STORED_METADATA ||
+                        entry->metadata_length > r->left)) {
+        errno = EPROTO;
+        return -1;
+    }
+    if (result == 0) {
+        entry->metadata = r->pos;
+        r->pos += entry->metadata_length;
+        r->left -= entry->metadata_length;
+    }
+    return result;
+}
+
+static int put_process(message_t *msg, const start_process_msg_t *req) {
+    if (req->fd_count > MAX_PASSED_FDS) {
+        errno = EINVAL;
+        return -1;
+    }
+    int result = put_u32(msg, req->fd_count);
+    for (uint32_t i = 0; i < req->fd_count && result == 0; i++) {
+        result = put_i32(msg, req->fd_targets[i]);
+    }
+    if (result == 0) {
+        result = put_strv(msg, req->argv);
+    }
+    if (result == 0) {
+        result = put_u32(msg, req->options);
+    }
+    if (result == 0 && (req->options & SPAWN_OPT_MEMORY_MAX)) {
+        result = put_u64(msg, req->memory_max);
+    }
+    if (result == 0 && (req->options & SPAWN_OPT_CPU_MAX)) {
+        result = put_u32(msg, req->cpu_quota);
+        if (result == 0) {
+            result = put_u32(msg, req->cpu_period);
+        }
+    }
+    if (result == 0 && (req->options & SPAWN_OPT_PIDS_MAX)) {
+        result = put_u64(msg, req->pids_max);
+    }
+    if (result == 0 && (req->options & SPAWN_OPT_PROFILE)) {
+        result = put_string(msg, req->profile);
+    }
+    if (result == 0 && (req->options & SPAWN_OPT_ENV)) {
+        result = put_strv(msg, req->envp);
+    }
+    if (result == 0 && (req->options & SPAWN_OPT_CWD)) {
+        result = put_string(msg, req->cwd);
+    }
+    if (result == 0 && (req->options & SPAWN_OPT_CREDENTIALS)) {
+        result = put_u32(msg, req->uid);
+        if (result == 0) {
+            result = put_u32(msg, req->gid);
+        }
+    }
+    if (result == 0 && (req->options & SPAWN_OPT_RLIMITS)) {
+        if (req->rlimit_count > MAX_SPAWN_RLIMITS) {
+            errno = EINVAL;
+            return -1;
+        }
+        result = put_u32(msg, req->rlimit_count);
+        for (uint32_t i = 0; i < req->rlimit_count && result == 0; i++) {
+            result = put_u32(msg, req->rlimits[i].resource);
+            if (result == 0) {
+                result = put_u64(msg, req->rlimits[i].soft);
+            }
+            if (result == 0) {
+                result = put_u64(msg, req->rlimits[i].hard);
+            }
+        }
+    }
+    if (result == 0 && (req->options & SPAWN_OPT_NICE)) {
+        result = put_i32(msg, req->nice);
+    }
+    if (result == 0 && (req->options & SPAWN_OPT_IOPRIO)) {
+        result = put_u32(msg, req->ioprio);
+    }
+    if (result == 0 && (req->options & SPAWN_OPT_AFFINITY)) {
+        if (req->cpu_count > MAX_SPAWN_CPUS) {
+            errno = EINVAL;
+            return -1;
+        }
+        result = put_u32(msg, req->cpu_count);
+        for (uint32_t i = 0; i < req->cpu_count && result == 0; i++) {
+            result = put_u32(msg, req->cpus[i]);
+        }
+    }
+    if (result == 0 && (req->options & SPAWN_OPT_LISTEN_FDS)) {
+        result = put_u32(msg, req->listen_fds);
+    }
+    return result;
+}
+
+static int get_process(reader_t *r, start_process_msg_t *req) {
+    int result = get_u32(r, &req->fd_count);
+    if (result == 0 && req->fd_count > MAX_PASSED_FDS) {
+        errno = EPROTO;
+        return -1;
+    }
+    for (uint32_t i = 0; i < req->fd_count && result == 0; i++) {
+        result = get_i32(r, &req->fd_targets[i]);
+    }
+    if (result == 0) {
+        result = get_strv(r, &req->argv);
+    }
+    if (result == 0) {
+        result = get_u32(r, &req->options);
+    }
+    if (result == 0 && (req->options & ~SPAWN_OPT_ALL)) {
+        errno = EPROTO;  // from a newer client
+        return -1;
+    }
+    if (result == 0 && (req->options & SPAWN_OPT_MEMORY_MAX)) {
+        result = get_u64(r, &req->memory_max);
+    }
+    if (result == 0 && (req->options & SPAWN_OPT_CPU_MAX)) {
+        result = get_u32(r, &req->cpu_quota);
+        if (result == 0) {
+            result = get_u32(r, &req->cpu_period);
+        }
+    }
+    if (result == 0 && (req->options & SPAWN_OPT_PIDS_MAX)) {
+        result = get_u64(r, &req->pids_max);
+    }
+    if (result == 0 && (req->options & SPAWN_OPT_PROFILE)) {
+        result = get_string(r, &req->profile);
+    }
+    if (result == 0 && (req->options & SPAWN_OPT_ENV)) {
+        result = get_strv(r, &req->envp);
+    }
+    if (result == 0 && (req->options & SPAWN_OPT_CWD)) {
+        result = get_string(r, &req->cwd);
+    }
+    if (result == 0 && (req->options & SPAWN_OPT_CREDENTIALS)) {
+        result = get_u32(r, &req->uid);
+        if (result == 0) {
+            result = get_u32(r, &req->gid);
+        }
+    }
+    if (result == 0 && (req->options & SPAWN_OPT_RLIMITS)) {
+        result = get_u32(r, &req->rlimit_count);
+        if (result == 0 && req->rlimit_count > MAX_SPAWN_RLIMITS) {
+            errno = EPROTO;
+            return -1;
+        }
+        process_rlimit_t *rlimits = NULL;
+        if (result == 0) {
+            rlimits = get_scratch(r, req->rlimit_count * sizeof(*rlimits));
+            if (rlimits == NULL) {
+                return -1;
+            }
+        }
+        for (uint32_t i = 0; i < req->rlimit_count && result == 0; i++) {
+            result = get_u32(r, &rlimits[i].resource);
+            if (result == 0) {
+                result = get_u64(r, &rlimits[i].soft);
+            }
+            if (result == 0) {
+                result = get_u64(r, &rlimits[i].hard);
+            }
+        }
+        req->rlimits = rlimits;
+    }
+    if (result == 0 && (req->options & SPAWN_OPT_NICE)) {
+        result = get_i32(r, &req->nice);
+    }
+    if (result == 0 && (req->options & SPAWN_OPT_IOPRIO)) {
+        result = get_u32(r, &req->ioprio);
+    }
+    if (result == 0 && (req->options & SPAWN_OPT_AFFINITY)) {
+        result = get_u32(r, &req->cpu_count);
+        if (result == 0 && (req->cpu_count > MAX_SPAWN_CPUS ||
+                            req->cpu_count > r->left / sizeof(uint32_t))) {
+            errno = EPROTO;
+            return -1;
+        }
+        uint32_t *cpus = NULL;
+        if (result == 0) {
+            cpus = get_scratch(r, req->cpu_count * sizeof(*cpus));
+            if (cpus == NULL) {
+                return -1;
             }
+        }
+        for (uint32_t i = 0; i < req->cpu_count && result == 0; i++) {
+            result = get_u32(r, &cpus[i]);
+        }
+        req->cpus = cpus;
+    }
+    if (result == 0 && (req->options & SPAWN_OPT_LISTEN_FDS)) {
+        result = get_u32(r, &req->listen_fds);
+        if (result == 0 && req->listen_fds > MAX_PASSED_FDS) {
+            errno = EPROTO;
             return -1;
         }
-        bytes_received += result;
     }
+    if (result == 0 && req->argv[0] == NULL && !(req->options & SPAWN_OPT_PROFILE)) {
+        errno = EPROTO;
+        return -1;
+    }
+    return result;
+}
+
+static int encode_message(message_t *msg) {
+    int result = 0;
+
+    msg->header.length = 0;
+    if (reserve(msg, HEADER_SIZE) == -1) {
+        return -1;
+    }
+
+    switch (msg->header.type) {
+        case MSG_START_PROCESS:
+            result = put_process(msg, &msg->data.start_process);
+            break;
+
+        case MSG_START_BATCH: {
+            const start_batch_msg_t *batch = &msg->data.start_batch;
+            if (batch->count > MAX_BATCH_SIZE) {
+                errno = EINVAL;
+                return -1;
+            }
+            result = put_u32(msg, batch->count);
+            for (uint32_t i = 0; i < batch->count && result == 0; i++) {
+                result = put_process(msg, &batch->processes[i]);
+            }
+            break;
+        }
+
+        case MSG_BATCH_STARTED: {
+            const batch_started_msg_t *batch = &msg->data.batch_started;
+            result = put_u32(msg, batch->count);
+            for (uint32_t i = 0; i < batch->count && result == 0; i++) {
+                result = put_i32(msg, batch->results[i].error);
+                if (result == 0) {
+                    result = put_i32(msg, batch->results[i].host_pid);
+                }
+                if (result == 0) {
+                    result = put_i32(msg, batch->results[i].container_pid);
+                }
+            }
+            break;
+        }
+
+        case MSG_PROCESS_STARTED:
+            result = put_i32(msg, msg->data.process_started.host_pid);
+            if (result == 0) {
+                result = put_i32(msg, msg->data.process_started.container_pid);
+            }
+            break;
+
+        case MSG_PROCESS_EXITED: {
+            const process_exited_msg_t *exited = &msg->data.process_exited;
+            result = put_i32(msg, exited->pid);
+            if (result == 0) {
+                result = put_i32(msg, exited->status);
+            }
+            if (result == 0) {
+                result = put_u64(msg, exited->utime_us);
+            }
+            if (result == 0) {
+                result = put_u64(msg, exited->stime_us);
+            }
+            if (result == 0) {
+                result = put_u64(msg, exited->maxrss_kb);
+            }
+            break;
+        }
+
+        case MSG_STATS:
+            result = put_string(msg, msg->data.stats.text);
+            break;
+
+        case MSG_STORE_FDS:
+            result = put_stored_fds(msg, &msg->data.store_fds);
+            break;
+
+        case MSG_RETRIEVE_FDS:
+            result = put_u32(msg, msg->data.retrieve_fds.first);
+            break;
+
+        case MSG_STORED_FDS: {
+            const stored_fds_msg_t *stored = &msg->data.stored_fds;
+            if (stored->count > MAX_BATCH_SIZE) {
+                errno = EINVAL;
+                return -1;
+            }
+            result = put_u32(msg, stored->total);
+            if (result == 0) {
+                result = put_u32(msg, stored->count);
+            }
+            for (uint32_t i = 0; i < stored->count && result == 0; i++) {
+                result = put_stored_fds(msg, &stored->entries[i]);
+            }
+            break;
+        }
+
+        case MSG_PROCESS_ERROR:
+            msg->data.process_error.error[MAX_ERROR_MSG - 1] = '\0';
+            result = put_string(msg, msg->data.process_error.error);
+            break;
+
+        case MSG_STOP_PROCESS:
+            result = put_i32(msg, msg->data.stop_process.pid);
+            break;
+
+        case MSG_PROCESS_STOPPED:
+            result = put_i32(msg, msg->data.process_stopped.pid);
+            break;
+
+        case MSG_APPLY_CONSTRAINTS:
+            result = put_i32(msg, msg->data.apply_constraints.pid);
+            if (result == 0) {
+                result = put_u64(msg, msg->data.apply_constraints.memory_limit);
+            }
+            if (result == 0) {
+                result = put_u64(msg, msg->data.apply_constraints.cpu_limit);
+            }
+            break;
+
+        case MSG_CONSTRAINTS_APPLIED:
+            result = put_i32(msg, msg->data.constraints_applied.pid);
+            break;
+
+        default:
+            // Types without a payload (ping, pong, ...)
+            break;
+    }
+
+    if (result == 0) {
+        memcpy(msg->buf, &msg->header, HEADER_SIZE);
+    }
+    return result;
+}
+
+// Decode the payload sitting in msg->buf into msg->data
+static int decode_message(message_t *msg) {
+    // Make room after the payload for decoded vectors and arrays. There
+    // can't be more strings than NUL bytes in the payload, nor more
+    // string tables than uint32_t counts.
+    size_t strings = 0;
+    const char *p = msg->buf + HEADER_SIZE;
+    const char *end = p + msg->header.length;
+    while ((p = memchr(p, '\0', end - p)) != NULL) {
+        strings++;
+        p++;
+    }
+    size_t scratch_size = (strings + msg->header.length / sizeof(uint32_t) + 1) *
+                          sizeof(char *);
+    if (msg->header.type == MSG_START_BATCH) {
+        scratch_size += MAX_BATCH_SIZE * sizeof(start_process_msg_t);
+    } else if (msg->header.type == MSG_BATCH_STARTED) {
+        scratch_size += MAX_BATCH_SIZE * sizeof(batch_result_t);
+    } else if (msg->header.type == MSG_STORED_FDS) {
+        scratch_size += MAX_BATCH_SIZE * sizeof(stored_fds_t);
+    }
+    size_t scratch_offset = (HEADER_SIZE + msg->header.length + sizeof(void *) - 1) &
+                            ~(sizeof(void *) - 1);
+    if (reserve(msg, scratch_offset + scratch_size) == -1) {
+        return -1;
+    }
+
+    reader_t r = {
+        .pos = msg->buf + HEADER_SIZE,
+        .left = msg->header.length,
+        .scratch = msg->buf + scratch_offset,
+        .scratch_left = scratch_size,
+    };
+    int result = 0;
+    memset(&msg->data, 0, sizeof(msg->data));
+
+    switch (msg->header.type) {
+        case MSG_START_PROCESS:
+            result = get_process(&r, &msg->data.start_process);
+            break;
 
-    if (msg->header.length > 0) {
-        while (bytes_received < sizeof(message_header_t) + msg->header.length) {
-            ssize_t result = read(sockfd, data + bytes_received,
-                                 sizeof(message_header_t) + msg->header.length - bytes_received);
-            if (result <= 0) {
-                if (result == -1 && errno == EINTR) {
-                    continue;
+        case MSG_START_BATCH: {
+            start_batch_msg_t *batch = &msg->data.start_batch;
+            result = get_u32(&r, &batch->count);
+            if (result == 0 && batch->count > MAX_BATCH_SIZE) {
+                errno = EPROTO;
+                return -1;
+            }
+            if (result == 0) {
+                batch->processes = get_scratch(&r, batch->count *
+                                               sizeof(start_process_msg_t));
+                if (batch->processes == NULL) {
+                    return -1;
                 }
+            }
+            for (uint32_t i = 0; i < batch->count && result == 0; i++) {
+                memset(&batch->processes[i], 0, sizeof(start_process_msg_t));
+                result = get_process(&r, &batch->processes[i]);
+            }
+            if (result == 0 && message_fd_count(msg) > MAX_FDS_PER_MESSAGE) {
+                errno = EPROTO;
+                return -1;
+            }
+            break;
+        }
+
+        case MSG_BATCH_STARTED: {
+            batch_started_msg_t *batch = &msg->data.batch_started;
+            result = get_u32(&r, &batch->count);
+            if (result == 0 && batch->count > MAX_BATCH_SIZE) {
+                errno = EPROTO;
                 return -1;
             }
-            bytes_received += result;
+            if (result == 0) {
+                batch->results = get_scratch(&r, batch->count * sizeof(batch_result_t));
+                if (batch->results == NULL) {
+                    return -1;
+                }
+            }
+            for (uint32_t i = 0; i < batch->count && result == 0; i++) {
+                int32_t error = 0, host_pid = 0, container_pid = 0;
+                result = get_i32(&r, &error);
+                if (result == 0) {
+                    result = get_i32(&r, &host_pid);
+                }
+                if (result == 0) {
+                    result = get_i32(&r, &container_pid);
+                }
+                batch->results[i].error = error;
+                batch->results[i].host_pid = host_pid;
+                batch->results[i].container_pid = container_pid;
+            }
+            break;
+        }
+
+        case MSG_PROCESS_STARTED: {
+            int32_t host_pid = 0, container_pid = 0;
+            result = get_i32(&r, &host_pid);
+            if (result == 0) {
+                result = get_i32(&r, &container_pid);
+            }
+            msg->data.process_started.host_pid = host_pid;
+            msg->data.process_started.container_pid = container_pid;
+            break;
         }
+
+        case MSG_PROCESS_EXITED: {
+            process_exited_msg_t *exited = &msg->data.process_exited;
+            result = get_i32(&r, &exited->pid);
+            if (result == 0) {
+                result = get_i32(&r, &exited->status);
+            }
+            if (result == 0) {
+                result = get_u64(&r, &exited->utime_us);
+            }
+            if (result == 0) {
+                result = get_u64(&r, &exited->stime_us);
+            }
+            if (result == 0) {
+                result = get_u64(&r, &exited->maxrss_kb);
+            }
+            break;
+        }
+
+        case MSG_STATS:
+            result = get_string(&r, &msg->data.stats.text);
+            break;
+
+        case MSG_STORE_FDS:
+            result = get_stored_fds(&r, &msg->data.store_fds);
+            break;
+
+        case MSG_RETRIEVE_FDS:
+            result = get_u32(&r, &msg->data.retrieve_fds.first);
+            break;
+
+        case MSG_STORED_FDS: {
+            stored_fds_msg_t *stored = &msg->data.stored_fds;
+            result = get_u32(&r, &stored->total);
+            if (result == 0) {
+                result = get_u32(&r, &stored->count);
+            }
+            if (result == 0 && stored->count > MAX_BATCH_SIZE) {
+                errno = EPROTO;
+                return -1;
+            }
+            if (result == 0) {
+                stored->entries = get_scratch(&r, stored->count * sizeof(stored_fds_t));
+                if (stored->entries == NULL) {
+                    return -1;
+                }
+            }
+            for (uint32_t i = 0; i < stored->count && result == 0; i++) {
+                result = get_stored_fds(&r, &stored->entries[i]);
+            }
+            if (result == 0 && message_fd_count(msg) > MAX_FDS_PER_MESSAGE) {
+                errno = EPROTO;
+                return -1;
+            }
+            break;
+        }
+
+        case MSG_PROCESS_ERROR: {
+            const char *error;
+            result = get_string(&r, &error);
+            if (result == 0) {
+                snprintf(msg->data.process_error.error, MAX_ERROR_MSG, "%s", error);
+            }
+            break;
+        }
+
+        case MSG_STOP_PROCESS:
+            result = get_i32(&r, &msg->data.stop_process.pid);
+            break;
+
+        case MSG_PROCESS_STOPPED:
+            result = get_i32(&r, &msg->data.process_stopped.pid);
+            break;
+
+        case MSG_APPLY_CONSTRAINTS:
+            result = get_i32(&r, &msg->data.apply_constraints.pid);
+            if (result == 0) {
+                result = get_u64(&r, &msg->data.apply_constraints.memory_limit);
+            }
+            if (result == 0) {
+                result = get_u64(&r, &msg->data.apply_constraints.cpu_limit);
+            }
+            break;
+
+        case MSG_CONSTRAINTS_APPLIED:
+            result = get_i32(&r, &msg->data.constraints_applied.pid);
+            break;
+
+        default:
+            // Unknown or payload-less types are left for the caller to judge
+            break;
     }
 
+    return result;
+}
+
+int message_fd_count(const message_t *msg) {
+    int count = 0;
+
+    switch (msg->header.type) {
+        case MSG_START_PROCESS:
+            count = msg->data.start_process.fd_count;
+            break;
+
+        case MSG_START_BATCH:
+            for (uint32_t i = 0; i < msg->data.start_batch.count; i++) {
+                count += msg->data.start_batch.processes[i].fd_count;
+            }
+            break;
+
+        case MSG_PROCESS_STARTED:
+            count = 1;
+            break;
+
+        case MSG_BATCH_STARTED:
+            for (uint32_t i = 0; i < msg->data.batch_started.count; i++) {
+                if (msg->data.batch_started.results[i].error == 0) {
+                    count++;
+                }
+            }
+            break;
+
+        case MSG_STORE_FDS:
+            count = msg->data.store_fds.fd_count;
+            break;
+
+        case MSG_STORED_FDS:
+            for (uint32_t i = 0; i < msg->data.stored_fds.count; i++) {
+                count += msg->data.stored_fds.entries[i].fd_count;
+            }
+            break;
+
+        default:
+            break;
+    }
+
+    return count;
+}
+
+// Move the descriptors carried by a received msghdr into fds/*fd_count,
+// closing them instead when fds is NULL. Fails with EPROTO if more than
+// MAX_FDS_PER_MESSAGE arrived or some were lost to truncation.
+static int collect_fds(struct msghdr *mh, int *fds, int *fd_count) {
+    int result = (mh->msg_flags & MSG_CTRUNC) ? -1 : 0;
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(mh); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(mh, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        const char *data = (const char *)CMSG_DATA(cmsg);
+        for (int i = 0; i < n; i++) {
+            int fd;
+            memcpy(&fd, data + i * sizeof(int), sizeof(int));
+            if (fds != NULL && *fd_count < MAX_FDS_PER_MESSAGE) {
+                fds[(*fd_count)++] = fd;
+            } else {
+                close(fd);
+                if (fds != NULL) {
+                    result = -1;
+                }
+            }
+        }
+    }
+
+    if (result == -1) {
+        errno = EPROTO;
+    }
+    return result;
+}
+
+static void close_fds(int *fds, int *fd_count) {
+    for (int i = 0; i < *fd_count; i++) {
+        close(fds[i]);
+    }
+    *fd_count = 0;
+}
+
+int message_recv_prepare(message_t *msg, size_t offset, struct msghdr *mh,
+                         struct iovec *iov, fd_control_t *control) {
+    // The header first, then exactly the payload it announces
+    size_t size = offset < HEADER_SIZE ? HEADER_SIZE : HEADER_SIZE + msg->header.length;
+    if (reserve(msg, size) == -1) {
+        return -1;
+    }
+    iov->iov_base = msg->buf + offset;
+    iov->iov_len = size - offset;
+    memset(mh, 0, sizeof(*mh));
+    mh->msg_iov = iov;
+    mh->msg_iovlen = 1;
+    mh->msg_control = control->buf;
+    mh->msg_controllen = sizeof(control->buf);
+    return 0;
+}
+
+int message_recv_complete(message_t *msg, struct msghdr *mh, ssize_t result,
+                          size_t *offset, int *fds, int *fd_count) {
+    int ignored_count = 0;
+    if (fds == NULL) {
+        fd_count = &ignored_count;
+    }
+    if (result == 0) {
+        errno = ECONNRESET;
+        return -1;
+    }
+    if (*offset == 0) {
+        *fd_count = 0;
+    }
+    if (collect_fds(mh, fds, fd_count) == -1) {
+        return -1;
+    }
+
+    *offset += result;
+    if (*offset < HEADER_SIZE) {
+        return 0;
+    }
+    if (*offset - result < HEADER_SIZE) {
+        memcpy(&msg->header, msg->buf, HEADER_SIZE);
+        if (msg->header.length > MAX_MESSAGE_SIZE) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+    }
+    if (*offset < HEADER_SIZE + msg->header.length) {
+        return 0;
+    }
+
+    if (decode_message(msg) == -1) {
+        if (fds != NULL) {
+            close_fds(fds, fd_count);
+        }
+        return -1;
+    }
+    if (fds != NULL && *fd_count != message_fd_count(msg)) {
+        close_fds(fds, fd_count);
+        errno = EPROTO;
+        return -1;
+    }
+    return 1;
+}
+
+int recv_message_nb(int sockfd, message_t *msg, int *fds, int *fd_count,
+                    size_t *offset) {
+    while (1) {
+        fd_control_t control;
+        struct iovec iov;
+        struct msghdr mh;
+        if (message_recv_prepare(msg, *offset, &mh, &iov, &control) == -1) {
+            return -1;
+        }
+
+        ssize_t result = recvmsg(sockfd, &mh, MSG_CMSG_CLOEXEC);
+        if (result == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            return -1;
+        }
+        result = message_recv_complete(msg, &mh, result, offset, fds, fd_count);
+        if (result != 0) {
+            return result;
+        }
+    }
+}
+
+int message_send_prepare(message_t *msg, size_t offset, const int *fds, int fd_count,
+                         struct msghdr *mh, struct iovec *iov, fd_control_t *control) {
+    if (fd_count < 0 || fd_count > MAX_FDS_PER_MESSAGE) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (offset == 0 && encode_message(msg) == -1) {
+        return -1;
+    }
+
+    iov->iov_base = msg->buf + offset;
+    iov->iov_len = HEADER_SIZE + msg->header.length - offset;
+    memset(mh, 0, sizeof(*mh));
+    mh->msg_iov = iov;
+    mh->msg_iovlen = 1;
+
+    // The descriptors ride on the first byte of the message
+    if (offset == 0 && fd_count > 0) {
+        mh->msg_control = control->buf;
+        mh->msg_controllen = CMSG_SPACE(sizeof(int) * fd_count);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(mh);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fd_count);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * fd_count);
+    }
     return 0;
-}
\ No newline at end of file
+}
+
+int message_send_complete(const message_t *msg, ssize_t result, size_t *offset) {
+    *offset += result;
+    return *offset == HEADER_SIZE + msg->header.length;
+}
+
+int send_message_nb(int sockfd, message_t *msg, const int *fds, int fd_count,
+                    size_t *offset) {
+    while (1) {
+        fd_control_t control;
+        struct iovec iov;
+        struct msghdr mh;
+        if (message_send_prepare(msg, *offset, fds, fd_count, &mh, &iov, &control) == -1) {
+            return -1;
+        }
+
+        ssize_t result = sendmsg(sockfd, &mh, MSG_NOSIGNAL);
+        if (result == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            return -1;
+        }
+        if (message_send_complete(msg, result, offset)) {
+            return 1;
+        }
+    }
+}
+
+// On a blocking socket the non-blocking variants only return 0 when a
+// receive/send timeout expired, which is an error for these callers
+int send_message_with_fds(int sockfd, message_t *msg, const int *fds, int fd_count) {
+    size_t offset = 0;
+    return send_message_nb(sockfd, msg, fds, fd_count, &offset) == 1 ? 0 : -1;
+}
+
+int recv_message_with_fds(int sockfd, message_t *msg, int *fds, int *fd_count) {
+    size_t offset = 0;
+    return recv_message_nb(sockfd, msg, fds, fd_count, &offset) == 1 ? 0 : -1;
+}
+
+int send_message(int sockfd, message_t *msg) {
+    return send_message_with_fds(sockfd, msg, NULL, 0);
+}
+
+int recv_message(int sockfd, message_t *msg) {
+    return recv_message_with_fds(sockfd, msg, NULL, NULL);
+}
+
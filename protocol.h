@@ -1,13 +1,20 @@
 #ifndef PROTOCOL_H
 #define PROTOCOL_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include <sys/types.h>
+#include <sys/socket.h>
 
-#define MAX_PROCESS_NAME 256
-#define MAX_ARGS 32
-#define MAX_ARG_LEN 256
 #define MAX_ERROR_MSG 512
+#define MAX_PASSED_FDS 16       // per process
+#define MAX_FDS_PER_MESSAGE 253  // SCM_MAX_FD
+#define MAX_BATCH_SIZE 250       // pidfds of a batch fit in one message
+#define MAX_MESSAGE_SIZE (1024 * 1024)  // largest payload accepted
+#define MAX_SPAWN_RLIMITS 16     // RLIM_NLIMITS
+#define MAX_SPAWN_CPUS 1024      // CPU_SETSIZE
+#define MAX_STORED_FDS 8         // per descriptor store entry
+#define MAX_STORED_METADATA 4096 // bytes per descriptor store entry
 #define SOCKET_PATH "/tmp/process_orchestrator.sock"
 
 typedef enum {
@@ -22,76 +29,288 @@ typedef enum {
     MSG_APPLY_CONSTRAINTS,
     MSG_CONSTRAINTS_APPLIED,
     MSG_PING,
-    MSG_PONG
+    MSG_PONG,
+    MSG_START_BATCH,
+    MSG_BATCH_STARTED,
+    MSG_PROCESS_EXITED,
+    MSG_GET_STATS,
+    MSG_STATS,
+    MSG_STORE_FDS,
+    MSG_RETRIEVE_FDS,
+    MSG_STORED_FDS
 } message_type_t;
 
+// On the wire a message is a message_header_t followed by header.length
+// bytes of payload. Payload fields are packed in the order listed for
+// each type, in host byte order: integers at their natural width,
+// strings NUL-terminated, string tables as a uint32_t count followed by
+// that many strings.
 typedef struct {
     uint32_t type;
     uint32_t length;
+    // Chosen by the client, echoed in the reply so that requests can be
+    // pipelined on one connection. 0 is never used for a request.
+    uint32_t request_id;
 } message_header_t;
 
+// Optional settings of a spawn request, flagged in options
+#define SPAWN_OPT_MEMORY_MAX (1U << 0)
+#define SPAWN_OPT_CPU_MAX    (1U << 1)
+#define SPAWN_OPT_PIDS_MAX   (1U << 2)
+#define SPAWN_OPT_PROFILE    (1U << 3)
+#define SPAWN_OPT_NOTIFY_EXIT (1U << 4)
+#define SPAWN_OPT_ENV        (1U << 5)
+#define SPAWN_OPT_CWD        (1U << 6)
+#define SPAWN_OPT_CREDENTIALS (1U << 7)
+#define SPAWN_OPT_RLIMITS    (1U << 8)
+#define SPAWN_OPT_NICE       (1U << 9)
+#define SPAWN_OPT_IOPRIO     (1U << 10)
+#define SPAWN_OPT_AFFINITY   (1U << 11)
+#define SPAWN_OPT_LISTEN_FDS (1U << 12)
+#define SPAWN_OPT_ALL        ((1U << 13) - 1)
+
+// A resource limit to set in the child
 typedef struct {
-    char name[MAX_PROCESS_NAME];
-    char args[MAX_ARGS][MAX_ARG_LEN];
-    int arg_count;
+    uint32_t resource;      // RLIMIT_*
+    uint64_t soft;          // RLIM_INFINITY for none
+    uint64_t hard;
+} process_rlimit_t;
+
+// MSG_START_PROCESS: uint32_t fd_count, int32_t fd_targets[fd_count],
+// string table argv, uint32_t options, then the fields of each option
+// set, in bit order: uint64_t memory_max; uint32_t cpu_quota, uint32_t
+// cpu_period; uint64_t pids_max; string profile; (SPAWN_OPT_NOTIFY_EXIT
+// has no field); string table envp; string cwd; uint32_t uid, uint32_t
+// gid; uint32_t rlimit_count, then rlimit_count times uint32_t resource,
+// uint64_t soft, uint64_t hard; int32_t nice; uint32_t ioprio; uint32_t
+// cpu_count, uint32_t cpus[cpu_count]; uint32_t listen_fds.
+typedef struct {
+    char *const *argv;      // NULL-terminated, argv[0] is the program
+    // Descriptors for the child travel with the message; fd_targets[i]
+    // is the number the i-th one gets in the child
+    uint32_t fd_count;
+    int32_t fd_targets[MAX_PASSED_FDS];
+    uint32_t options;       // SPAWN_OPT_*
+    // cgroup v2 limits (memory.max, cpu.max, pids.max); the process is
+    // started inside its own cgroup with them already applied
+    uint64_t memory_max;    // bytes
+    uint32_t cpu_quota;     // microseconds of CPU time per cpu_period
+    uint32_t cpu_period;    // microseconds
+    uint64_t pids_max;
+    // Take a prestarted process from the agent's pool for this profile
+    // instead of spawning argv, which may then be empty. Can't be
+    // combined with descriptors or limits.
+    const char *profile;
+    // With SPAWN_OPT_NOTIFY_EXIT, the agent reports the process's exit
+    // with a MSG_PROCESS_EXITED on the connection that started it
+
+    // Set up in the child before exec, so that no wrapper (env, sh -c,
+    // nice, taskset...) is needed
+    char *const *envp;      // the whole environment, NULL-terminated
+    const char *cwd;        // working directory
+    uint32_t uid;           // switched to, supplementary groups dropped
+    uint32_t gid;
+    uint32_t rlimit_count;  // at most MAX_SPAWN_RLIMITS
+    const process_rlimit_t *rlimits;
+    int32_t nice;
+    uint32_t ioprio;        // ioprio_set() value: class << 13 | level
+    uint32_t cpu_count;     // CPUs to run on, at most MAX_SPAWN_CPUS
+    const uint32_t *cpus;
+    // Socket activation: the first listen_fds descriptors from fd 3 on
+    // are listening sockets, announced in LISTEN_FDS and LISTEN_PID
+    uint32_t listen_fds;
 } start_process_msg_t;
 
+// MSG_START_BATCH: uint32_t count, then count entries laid out like
+// MSG_START_PROCESS. The descriptors of all entries travel with the
+// message, in entry order.
+typedef struct {
+    uint32_t count;         // at most MAX_BATCH_SIZE
+    start_process_msg_t *processes;
+} start_batch_msg_t;
+
+// Outcome of one entry of a batch
+typedef struct {
+    int32_t error;          // 0 if started, errno of the failure otherwise
+    pid_t host_pid;
+    pid_t container_pid;
+} batch_result_t;
+
+// MSG_BATCH_STARTED: uint32_t count, then count times int32_t error,
+// int32_t host_pid, int32_t container_pid. The pidfds of the started
+// entries travel with the message, in entry order.
+typedef struct {
+    uint32_t count;
+    batch_result_t *results;
+} batch_started_msg_t;
+
+// MSG_PROCESS_STARTED: int32_t host_pid, int32_t container_pid. The
+// pidfd travels with the message.
 typedef struct {
     pid_t host_pid;
     pid_t container_pid;  // PID as seen inside container namespace
 } process_started_msg_t;
 
+// MSG_PROCESS_EXITED: int32_t pid, int32_t status, uint64_t utime_us,
+// uint64_t stime_us, uint64_t maxrss_kb. Not a reply: it comes with
+// request_id 0, after the reply that started the process.
 typedef struct {
-    char error[MAX_ERROR_MSG];
-} process_error_msg_t;
+    pid_t pid;
+    int32_t status;         // in waitpid() format
+    uint64_t utime_us;      // CPU time in user mode
+    uint64_t stime_us;      // CPU time in kernel mode
+    uint64_t maxrss_kb;     // peak resident set size
+} process_exited_msg_t;
 
+// MSG_STATS, the reply to MSG_GET_STATS (no payload): string text, the
+// agent's counters and latency histograms in the Prometheus text
+// exposition format
 typedef struct {
-    uint32_t request_id;
-} ack_msg_t;
+    const char *text;
+} stats_msg_t;
+
+// The agent's descriptor store (FD_STORE_MAX in agent.conf) keeps
+// descriptors for a client across its restarts, like systemd's FDSTORE:
+// an orchestrator deposits the pidfds of its services, and a new instance
+// retrieves them and adopts the processes instead of respawning them.
+//
+// MSG_STORE_FDS: string name, uint32_t fd_count, uint32_t
+// metadata_length, then metadata_length bytes of metadata. The fd_count
+// descriptors travel with the message and replace whatever was stored
+// under name; with none, the entry is removed. Answered with MSG_ACK.
+//
+// In MSG_STORED_FDS, the same fields describe each entry retrieved.
+typedef struct {
+    const char *name;
+    uint32_t fd_count;      // at most MAX_STORED_FDS
+    uint32_t metadata_length;  // at most MAX_STORED_METADATA
+    const void *metadata;   // opaque to the agent
+} stored_fds_t;
+
+// MSG_RETRIEVE_FDS: uint32_t first, the index of the first entry wanted
+typedef struct {
+    uint32_t first;
+} retrieve_fds_msg_t;
+
+// MSG_STORED_FDS, the reply to MSG_RETRIEVE_FDS: uint32_t total, the
+// number of entries in the store, uint32_t count, then count entries laid
+// out like MSG_STORE_FDS. The descriptors of all entries travel with the
+// message, in entry order. A reply holds as many entries as fit in one
+// message's descriptors; ask again from first + count for the rest.
+typedef struct {
+    uint32_t total;
+    uint32_t count;         // at most MAX_BATCH_SIZE
+    stored_fds_t *entries;
+} stored_fds_msg_t;
+
+// MSG_PROCESS_ERROR: string error
+typedef struct {
+    char error[MAX_ERROR_MSG];
+} process_error_msg_t;
 
+// MSG_STOP_PROCESS: int32_t pid
 typedef struct {
     pid_t pid;
 } stop_process_msg_t;
 
+// MSG_PROCESS_STOPPED: int32_t pid
 typedef struct {
     pid_t pid;
 } process_stopped_msg_t;
 
+// MSG_APPLY_CONSTRAINTS: int32_t pid, uint64_t memory_limit,
+// uint64_t cpu_limit
 typedef struct {
     pid_t pid;
     uint64_t memory_limit;
     uint64_t cpu_limit;
 } apply_constraints_msg_t;
 
+// MSG_CONSTRAINTS_APPLIED: int32_t pid
 typedef struct {
     pid_t pid;
 } constraints_applied_msg_t;
 
-typedef struct {
-    int count;
-    struct {
-        pid_t host_pid;
-        pid_t container_pid;  // PID as seen inside container namespace
-        char name[MAX_PROCESS_NAME];
-    } processes[64];
-} process_list_msg_t;
-
+// A message: its header, the decoded fields for header.type, and the
+// buffer holding the encoded form. Pointers in data returned by
+// recv_message() point into buf and stay valid until the next receive
+// into the same message_t. A zero-initialized message_t is ready to use;
+// release it with message_free().
 typedef struct {
     message_header_t header;
     union {
         start_process_msg_t start_process;
         process_started_msg_t process_started;
         process_error_msg_t process_error;
-        ack_msg_t ack;
         stop_process_msg_t stop_process;
         process_stopped_msg_t process_stopped;
         apply_constraints_msg_t apply_constraints;
         constraints_applied_msg_t constraints_applied;
-        process_list_msg_t process_list;
+        start_batch_msg_t start_batch;
+        batch_started_msg_t batch_started;
+        process_exited_msg_t process_exited;
+        stats_msg_t stats;
+        stored_fds_t store_fds;
+        retrieve_fds_msg_t retrieve_fds;
+        stored_fds_msg_t stored_fds;
     } data;
+    char *buf;
+    size_t capacity;
 } message_t;
 
-int send_message(int sockfd, const message_t *msg);
+void message_free(message_t *msg);
+
+// send_message() encodes data according to header.type (header.length is
+// computed) and writes it. recv_message() reads a message, rejecting
+// payloads over MAX_MESSAGE_SIZE, and decodes it; malformed payloads fail
+// with EPROTO. Both return 0 on success, -1 on error.
+int send_message(int sockfd, message_t *msg);
 int recv_message(int sockfd, message_t *msg);
 
-#endif
\ No newline at end of file
+// Same, with up to MAX_FDS_PER_MESSAGE descriptors attached to the
+// message as SCM_RIGHTS, so that a message and its descriptors take one
+// sendmsg() and arrive together. Received descriptors are close-on-exec;
+// fds must have room for MAX_FDS_PER_MESSAGE. A message whose descriptor
+// count doesn't match message_fd_count() is rejected with EPROTO.
+int send_message_with_fds(int sockfd, message_t *msg, const int *fds, int fd_count);
+int recv_message_with_fds(int sockfd, message_t *msg, int *fds, int *fd_count);
+
+// Non-blocking variants for event-driven callers. *offset carries the
+// number of bytes already transferred between calls (start at 0; the
+// message is encoded when *offset is 0). Return 1 once the whole message
+// is done, 0 if the socket would block, -1 on error or EOF. fds may be
+// NULL, in which case received descriptors are closed.
+int send_message_nb(int sockfd, message_t *msg, const int *fds, int fd_count,
+                    size_t *offset);
+int recv_message_nb(int sockfd, message_t *msg, int *fds, int *fd_count,
+                    size_t *offset);
+
+// Control buffer able to hold a full SCM_RIGHTS payload
+typedef union {
+    char buf[CMSG_SPACE(sizeof(int) * MAX_FDS_PER_MESSAGE)];
+    struct cmsghdr align;
+} fd_control_t;
+
+// The steps of the non-blocking variants, for callers that issue the
+// recvmsg()/sendmsg() themselves (the agent's io_uring loop). The
+// prepare functions point mh, with iov and control as its storage, at
+// what is left of the message at offset: message_recv_prepare() at the
+// rest of the header, then at the payload it announces (receive with
+// MSG_CMSG_CLOEXEC); message_send_prepare() encodes the message when
+// offset is 0 and attaches fds to its first byte. Given what the system
+// call returned, message_recv_complete() advances *offset and collects
+// the descriptors, returning like recv_message_nb() except that 0 means
+// more bytes are needed; message_send_complete() returns 1 once the whole
+// message is sent, 0 otherwise.
+int message_recv_prepare(message_t *msg, size_t offset, struct msghdr *mh,
+                         struct iovec *iov, fd_control_t *control);
+int message_recv_complete(message_t *msg, struct msghdr *mh, ssize_t result,
+                          size_t *offset, int *fds, int *fd_count);
+int message_send_prepare(message_t *msg, size_t offset, const int *fds, int fd_count,
+                         struct msghdr *mh, struct iovec *iov, fd_control_t *control);
+int message_send_complete(const message_t *msg, ssize_t result, size_t *offset);
+
+// Number of descriptors that travel with a decoded message
+int message_fd_count(const message_t *msg);
+
+#endif
@@ -0,0 +1,507 @@
+#define _GNU_SOURCE
+#include "spawn.h"
+#include <sched.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#ifndef CLONE_PIDFD
+#define CLONE_PIDFD 0x00001000
+#endif
+#ifndef CLOSE_RANGE_CLOEXEC
+#define CLOSE_RANGE_CLOEXEC (1U << 2)
+#endif
+
+// PIDFD_GET_INFO (Linux 6.13+, exit information since 6.15); the first
+// version of struct pidfd_info, the kernel fills in what we ask for
+#ifndef PIDFD_GET_INFO
+struct pidfd_info {
+    uint64_t mask;
+    uint64_t cgroupid;
+    uint32_t pid, tgid, ppid;
+    uint32_t ruid, rgid, euid, egid, suid, sgid, fsuid, fsgid;
+    int32_t exit_code;
+};
+#define PIDFD_GET_INFO _IOWR(0xFF, 11, struct pidfd_info)
+#define PIDFD_INFO_EXIT (1UL << 3)
+#endif
+
+#ifndef CLONE_INTO_CGROUP
+#define CLONE_INTO_CGROUP 0x200000000ULL
+#endif
+
+// clone3() arguments, up to the cgroup field (CLONE_ARGS_SIZE_VER2)
+struct spawn_clone_args {
+    uint64_t flags;
+    uint64_t pidfd;
+    uint64_t child_tid;
+    uint64_t parent_tid;
+    uint64_t exit_signal;
+    uint64_t stack;
+    uint64_t stack_size;
+    uint64_t tls;
+    uint64_t set_tid;
+    uint64_t set_tid_size;
+    uint64_t cgroup;
+};
+
+// Room for the child before exec; execvp() builds candidate paths and,
+// for scripts, a new argv on this stack
+#define SPAWN_STACK_SIZE (64 * 1024)
+
+extern char **environ;
+
+// Set once clone() has rejected CLONE_PIDFD, so we stop trying
+static int clone_pidfd_unsupported = 0;
+// Set once clone3() turned out to be missing
+static int clone3_unsupported = 0;
+
+// Shared with the child through CLONE_VM
+typedef struct {
+    const spawn_attr_t *attr;
+    sigset_t oldmask;
+    int error;          // errno of a failed exec, set by the child
+    int error_pipe;     // where to report it instead without CLONE_VM
+} spawn_child_t;
+
+int pidfd_open(pid_t pid, unsigned int flags) {
+    return syscall(SYS_pidfd_open, pid, flags);
+}
+
+int pidfd_signal(int pidfd, int sig) {
+    return syscall(SYS_pidfd_send_signal, pidfd, sig, NULL, 0);
+}
+
+int pidfd_exit_status(int pidfd, int *status) {
+    struct pidfd_info info = {.mask = PIDFD_INFO_EXIT};
+    if (ioctl(pidfd, PIDFD_GET_INFO, &info) == -1) {
+        return -1;
+    }
+    if (!(info.mask & PIDFD_INFO_EXIT)) {
+        errno = ENODATA;  // still running, or an older kernel
+        return -1;
+    }
+    *status = info.exit_code;
+    return 0;
+}
+
+// Mark [first, last] close-on-exec, one syscall on kernels with
+// CLOSE_RANGE_CLOEXEC (5.11+)
+static void cloexec_range(unsigned int first, unsigned int last) {
+    if (syscall(SYS_close_range, first, last, CLOSE_RANGE_CLOEXEC) == 0) {
+        return;
+    }
+
+    long limit = sysconf(_SC_OPEN_MAX);
+    if (limit < 0) {
+        limit = 1024;
+    }
+    if ((unsigned long)limit > (unsigned long)last + 1) {
+        limit = (long)last + 1;
+    }
+    for (long fd = first; fd < limit; fd++) {
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+}
+
+// Install attr->fds at their target numbers and leave every other
+// descriptor above stderr close-on-exec
+static int setup_child_fds(const spawn_attr_t *attr) {
+    int max_target = 2;
+    for (int i = 0; i < attr->fd_count; i++) {
+        if (attr->fds[i].target > max_target) {
+            max_target = attr->fds[i].target;
+        }
+    }
+
+    // Park the sources above every target first, so that installing one
+    // can't clobber a source that is still needed. dup2() clears
+    // close-on-exec on the target.
+    int parked[attr->fd_count > 0 ? attr->fd_count : 1];
+    for (int i = 0; i < attr->fd_count; i++) {
+        parked[i] = fcntl(attr->fds[i].fd, F_DUPFD_CLOEXEC, max_target + 1);
+        if (parked[i] == -1) {
+            return -1;
+        }
+    }
+    for (int i = 0; i < attr->fd_count; i++) {
+        if (dup2(parked[i], attr->fds[i].target) == -1) {
+            return -1;
+        }
+    }
+
+    // Mark the gaps between the targets
+    unsigned int first = 3;
+    while (1) {
+        unsigned int next = ~0U;
+        for (int i = 0; i < attr->fd_count; i++) {
+            unsigned int target = attr->fds[i].target;
+            if (target >= first && target < next) {
+                next = target;
+            }
+        }
+        if (next == ~0U) {
+            cloexec_range(first, ~0U);
+            return 0;
+        }
+        if (next > first) {
+            cloexec_range(first, next - 1);
+        }
+        first = next + 1;
+    }
+}
+
+// Apply the process setup of attr to the calling child
+static int setup_child_process(const spawn_attr_t *attr) {
+    for (int i = 0; i < attr->rlimit_count; i++) {
+        if (setrlimit(attr->rlimits[i].resource, &attr->rlimits[i].limit) == -1) {
+            return -1;
+        }
+    }
+    if ((attr->flags & SPAWN_NICE) && setpriority(PRIO_PROCESS, 0, attr->nice) == -1) {
+        return -1;
+    }
+    // IOPRIO_WHO_PROCESS, ourselves
+    if ((attr->flags & SPAWN_IOPRIO) &&
+        syscall(SYS_ioprio_set, 1, 0, attr->ioprio) == -1) {
+        return -1;
+    }
+    if (attr->affinity != NULL &&
+        sched_setaffinity(0, sizeof(*attr->affinity), attr->affinity) == -1) {
+        return -1;
+    }
+    if (attr->flags & SPAWN_CREDENTIALS) {
+        // Raw system calls: the libc wrappers apply the change to every
+        // thread they know of, which in a clone()d child are the
+        // parent's. Dropping supplementary groups needs privilege, which
+        // an unprivileged caller staying itself doesn't have.
+        if ((geteuid() == 0 && syscall(SYS_setgroups, 0, NULL) == -1) ||
+            syscall(SYS_setresgid, attr->gid, attr->gid, attr->gid) == -1 ||
+            syscall(SYS_setresuid, attr->uid, attr->uid, attr->uid) == -1) {
+            return -1;
+        }
+    }
+    if (attr->cwd != NULL && chdir(attr->cwd) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+static size_t count_strings(char *const *strings) {
+    size_t count = 0;
+    while (strings[count] != NULL) {
+        count++;
+    }
+    return count;
+}
+
+// Exec the child's program. With listen_fds, its environment gets
+// LISTEN_FDS and LISTEN_PID instead of any it had; only the child knows
+// its PID, so the new environment is built here, on the child's stack.
+static void exec_child(const spawn_attr_t *attr) {
+    char *const *envp = attr->envp != NULL ? attr->envp : environ;
+    if (attr->listen_fds == 0) {
+        execvpe(attr->file, attr->argv, envp);
+        return;
+    }
+
+    char *env[count_strings(envp) + 3];
+    char listen_fds[32], listen_pid[32];
+    size_t count = 0;
+    for (size_t i = 0; envp[i] != NULL; i++) {
+        if (strncmp(envp[i], "LISTEN_FDS=", 11) != 0 &&
+            strncmp(envp[i], "LISTEN_PID=", 11) != 0 &&
+            strncmp(envp[i], "LISTEN_FDNAMES=", 15) != 0) {
+            env[count++] = envp[i];
+        }
+    }
+    snprintf(listen_fds, sizeof(listen_fds), "LISTEN_FDS=%d", attr->listen_fds);
+    snprintf(listen_pid, sizeof(listen_pid), "LISTEN_PID=%d", (int)getpid());
+    env[count++] = listen_fds;
+    env[count++] = listen_pid;
+    env[count] = NULL;
+    execvpe(attr->file, attr->argv, env);
+}
+
+// Runs in the child until it execs or exits: on its own stack, sharing
+// memory with the suspended parent, or in a copy of it for the cgroup path
+static int spawn_child(void *arg) {
+    spawn_child_t *child = arg;
+    struct sigaction sa;
+
+    // Handlers live in memory we share with the parent: never run them
+    // here, reset them to the default before unblocking signals
+    for (int sig = 1; sig < NSIG; sig++) {
+        if (sigaction(sig, NULL, &sa) == 0 &&
+            sa.sa_handler != SIG_DFL && sa.sa_handler != SIG_IGN) {
+            sa.sa_handler = SIG_DFL;
+            sa.sa_flags = 0;
+            sigaction(sig, &sa, NULL);
+        }
+    }
+    const spawn_attr_t *attr = child->attr;
+    sigprocmask(SIG_SETMASK, attr->sigmask != NULL ? attr->sigmask : &child->oldmask,
+                NULL);
+
+    if (setup_child_fds(attr) == 0 && setup_child_process(attr) == 0) {
+        exec_child(attr);
+    }
+    child->error = errno;
+    if (child->error_pipe != -1) {
+        write(child->error_pipe, &child->error, sizeof(child->error));
+    }
+    _exit(127);
+}
+
+static size_t spawn_stack_size(const spawn_attr_t *attr) {
+    size_t argc = count_strings(attr->argv);
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t size = SPAWN_STACK_SIZE + (argc + 2) * sizeof(char *);
+    if (attr->listen_fds > 0) {
+        // The environment exec_child() builds
+        size += (count_strings(attr->envp != NULL ? attr->envp : environ) + 3) *
+                sizeof(char *);
+    }
+    return (size + page - 1) & ~(page - 1);
+}
+
+// posix_spawn() + pidfd_open() for kernels without CLONE_PIDFD. There is
+// a PID reuse window between the two, acceptable as a fallback only.
+static int spawn_fallback(const spawn_attr_t *attr, pid_t *pid) {
+    if (attr->rlimit_count > 0 || attr->affinity != NULL || attr->listen_fds > 0 ||
+        (attr->flags & (SPAWN_CREDENTIALS | SPAWN_NICE | SPAWN_IOPRIO))) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+
+    // File actions run in order, so install private copies parked above
+    // every target (see setup_child_fds())
+    int max_target = 2;
+    for (int i = 0; i < attr->fd_count; i++) {
+        if (attr->fds[i].target > max_target) {
+            max_target = attr->fds[i].target;
+        }
+    }
+    int parked[attr->fd_count > 0 ? attr->fd_count : 1];
+    int nparked = 0;
+    int result = 0;
+    for (int i = 0; i < attr->fd_count && result == 0; i++) {
+        parked[i] = fcntl(attr->fds[i].fd, F_DUPFD_CLOEXEC, max_target + 1);
+        if (parked[i] == -1) {
+            result = errno;
+            break;
+        }
+        nparked++;
+        result = posix_spawn_file_actions_adddup2(&actions, parked[i],
+                                                  attr->fds[i].target);
+    }
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 34)
+    if (result == 0) {
+        result = posix_spawn_file_actions_addclosefrom_np(&actions, max_target + 1);
+    }
+#endif
+    if (result == 0 && attr->cwd != NULL) {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 29)
+        result = posix_spawn_file_actions_addchdir_np(&actions, attr->cwd);
+#else
+        result = EOPNOTSUPP;
+#endif
+    }
+
+    posix_spawnattr_t spawnattr;
+    posix_spawnattr_init(&spawnattr);
+    if (result == 0 && attr->sigmask != NULL) {
+        posix_spawnattr_setsigmask(&spawnattr, attr->sigmask);
+        posix_spawnattr_setflags(&spawnattr, POSIX_SPAWN_SETSIGMASK);
+    }
+
+    if (result == 0) {
+        result = posix_spawnp(pid, attr->file, &actions, &spawnattr, attr->argv,
+                              attr->envp != NULL ? attr->envp : environ);
+    }
+    posix_spawnattr_destroy(&spawnattr);
+    posix_spawn_file_actions_destroy(&actions);
+    for (int i = 0; i < nparked; i++) {
+        close(parked[i]);
+    }
+    if (result != 0) {
+        errno = result;
+        return -1;
+    }
+
+    int pidfd = pidfd_open(*pid, 0);
+    if (pidfd == -1) {
+        int saved_errno = errno;
+        kill(*pid, SIGKILL);
+        errno = saved_errno;
+        return -1;
+    }
+    return pidfd;
+}
+
+// clone3() a child with its own copy of our memory, fork()-style, that
+// reports a failed exec through a close-on-exec pipe. Sharing memory as
+// spawn_process() does would need clone3() to switch stacks, and can't
+// outlive the call. Returns the pidfd, and the non-blocking read end of
+// the pipe in *status_fd.
+static int spawn_forked(const spawn_attr_t *attr, uint64_t flags, pid_t *pid,
+                        int *status_fd) {
+    int error_pipe[2];
+    if (pipe2(error_pipe, O_CLOEXEC | O_NONBLOCK) == -1) {
+        return -1;
+    }
+
+    spawn_child_t child = {.attr = attr, .error = 0, .error_pipe = error_pipe[1]};
+    sigset_t all;
+    sigfillset(&all);
+    sigprocmask(SIG_BLOCK, &all, &child.oldmask);
+
+    int pidfd = -1;
+    struct spawn_clone_args args = {
+        .flags = flags | CLONE_PIDFD,
+        .pidfd = (uintptr_t)&pidfd,
+        .exit_signal = SIGCHLD,
+    };
+    if (attr->flags & SPAWN_CGROUP) {
+        args.flags |= CLONE_INTO_CGROUP;
+        args.cgroup = attr->cgroup_fd;
+    }
+    pid_t child_pid = syscall(SYS_clone3, &args, sizeof(args));
+    if (child_pid == 0) {
+        spawn_child(&child);
+    }
+    int saved_errno = errno;
+
+    sigprocmask(SIG_SETMASK, &child.oldmask, NULL);
+    close(error_pipe[1]);
+
+    if (child_pid == -1) {
+        close(error_pipe[0]);
+        errno = saved_errno;
+        return -1;
+    }
+
+    *pid = child_pid;
+    *status_fd = error_pipe[0];
+    return pidfd;
+}
+
+int spawn_status(int status_fd, int *error) {
+    ssize_t n = read(status_fd, error, sizeof(*error));
+    if (n == 0) {
+        *error = 0;  // closed on exec
+        return 1;
+    }
+    if (n == sizeof(*error)) {
+        return 1;
+    }
+    if (n == -1 && (errno == EAGAIN || errno == EINTR)) {
+        return 0;
+    }
+    if (n != -1) {
+        errno = EPROTO;
+    }
+    return -1;
+}
+
+// CLONE_VFORK: the child has exec'd or exited when clone3() returns, so
+// the status pipe can be read right away
+static int spawn_into_cgroup(const spawn_attr_t *attr, pid_t *pid) {
+    int status_fd;
+    int pidfd = spawn_forked(attr, CLONE_VFORK, pid, &status_fd);
+    if (pidfd == -1) {
+        return -1;
+    }
+
+    int error;
+    if (spawn_status(status_fd, &error) != 1) {
+        error = errno;
+    }
+    close(status_fd);
+    if (error != 0) {
+        waitpid(*pid, NULL, 0);
+        close(pidfd);
+        errno = error;
+        return -1;
+    }
+    return pidfd;
+}
+
+int spawn_process_async(const spawn_attr_t *attr, pid_t *pid, int *status_fd) {
+    if (!clone3_unsupported) {
+        int pidfd = spawn_forked(attr, 0, pid, status_fd);
+        if (pidfd != -1 || errno != ENOSYS) {
+            return pidfd;
+        }
+        clone3_unsupported = 1;
+    }
+
+    // Pre-5.3 kernel: no CLONE_INTO_CGROUP either, so this fails for
+    // SPAWN_CGROUP
+    *status_fd = -1;
+    return spawn_process(attr, pid);
+}
+
+int spawn_process(const spawn_attr_t *attr, pid_t *pid) {
+    if (attr->flags & SPAWN_CGROUP) {
+        return spawn_into_cgroup(attr, pid);
+    }
+    if (clone_pidfd_unsupported) {
+        return spawn_fallback(attr, pid);
+    }
+
+    size_t stack_size = spawn_stack_size(attr);
+    char *stack = mmap(NULL, stack_size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (stack == MAP_FAILED) {
+        return -1;
+    }
+
+    spawn_child_t child = {.attr = attr, .error = 0, .error_pipe = -1};
+    sigset_t all;
+    sigfillset(&all);
+    sigprocmask(SIG_BLOCK, &all, &child.oldmask);
+
+    // CLONE_VFORK suspends us until the child has exec'd or exited, so
+    // child.error is final once clone() returns
+    int pidfd = -1;
+    pid_t child_pid = clone(spawn_child, stack + stack_size,
+                            CLONE_VM | CLONE_VFORK | CLONE_PIDFD | SIGCHLD,
+                            &child, &pidfd);
+    int saved_errno = errno;
+
+    sigprocmask(SIG_SETMASK, &child.oldmask, NULL);
+    munmap(stack, stack_size);
+
+    if (child_pid == -1) {
+        if (saved_errno == EINVAL) {
+            clone_pidfd_unsupported = 1;
+            return spawn_fallback(attr, pid);
+        }
+        errno = saved_errno;
+        return -1;
+    }
+
+    if (child.error != 0) {
+        // The child already exited; reap it unless a SIGCHLD handler beat us
+        waitpid(child_pid, NULL, 0);
+        close(pidfd);
+        errno = child.error;
+        return -1;
+    }
+
+    *pid = child_pid;
+    return pidfd;
+}
@@ -0,0 +1,103 @@
+#ifndef SPAWN_H
+#define SPAWN_H
+
+#include <sched.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+
+// A descriptor handed to the child, and the number it gets there
+typedef struct {
+    int fd;
+    int target;
+} spawn_fd_t;
+
+// A resource limit to set in the child
+typedef struct {
+    int resource;           // RLIMIT_*
+    struct rlimit limit;
+} spawn_rlimit_t;
+
+// spawn_attr_t flags
+#define SPAWN_CGROUP      0x1   // start the child in cgroup_fd
+#define SPAWN_CREDENTIALS 0x2   // switch to uid/gid
+#define SPAWN_NICE        0x4   // set the nice value
+#define SPAWN_IOPRIO      0x8   // set the I/O priority
+
+// Description of a process to spawn
+typedef struct {
+    const char *file;       // program, looked up in PATH like execvp()
+    char *const *argv;      // NULL-terminated, argv[0] included
+    const spawn_fd_t *fds;  // descriptors to install in the child
+    int fd_count;
+    unsigned int flags;     // SPAWN_*
+    int cgroup_fd;          // cgroup v2 directory, with SPAWN_CGROUP
+    // Process setup, done in the child before exec; in the order below,
+    // so that limits and priorities are set while still privileged
+    char *const *envp;      // environment, NULL to inherit ours
+    const spawn_rlimit_t *rlimits;
+    int rlimit_count;
+    int nice;               // with SPAWN_NICE
+    int ioprio;             // ioprio_set() value, with SPAWN_IOPRIO
+    const cpu_set_t *affinity;  // CPUs to run on, NULL to inherit
+    uid_t uid;              // with SPAWN_CREDENTIALS; supplementary
+    gid_t gid;              // groups are dropped
+    const char *cwd;        // working directory, NULL to inherit
+    // Socket activation: fds 3 to 3 + listen_fds - 1 are listening
+    // sockets, announced to the child in LISTEN_FDS and LISTEN_PID (its
+    // own PID) as sd_listen_fds() expects. 0 for none.
+    int listen_fds;
+    // Signal mask of the child, NULL to inherit ours. Callers that block
+    // signals to read them from a signalfd pass an empty set, or their
+    // children start with those signals blocked too.
+    const sigset_t *sigmask;
+} spawn_attr_t;
+
+// pidfd_open system call wrapper
+int pidfd_open(pid_t pid, unsigned int flags);
+
+// pidfd_send_signal system call wrapper, without siginfo or flags
+int pidfd_signal(int pidfd, int sig);
+
+// Exit status, in waitpid() format, of an exited process. Works for any
+// process we hold a pidfd to, including ones we aren't the parent of, on
+// kernels with PIDFD_GET_INFO exit information (6.15+). Returns 0, or -1
+// with errno set if the status can't be obtained.
+int pidfd_exit_status(int pidfd, int *status);
+
+// Spawn a process and return its pidfd, storing its PID in *pid.
+// The child is created with clone(CLONE_VM | CLONE_VFORK | CLONE_PIDFD),
+// so the cost does not grow with the caller's memory footprint and the
+// pidfd is obtained atomically with the process. Kernels without
+// CLONE_PIDFD fall back to posix_spawn() + pidfd_open().
+//
+// The child keeps stdin/stdout/stderr and the descriptors listed in
+// attr->fds; everything else is closed on exec. A failure to set up the
+// child as attr asks counts as a failed exec.
+//
+// With SPAWN_CGROUP the child is created directly inside attr->cgroup_fd
+// by clone3(CLONE_INTO_CGROUP) (Linux 5.7+), so it never runs outside the
+// cgroup's limits. This path copies the page tables like fork().
+//
+// Kernels without CLONE_PIDFD only support envp and cwd among the
+// process setup fields (EOPNOTSUPP otherwise), and not listen_fds.
+//
+// Returns -1 with errno set on failure, including when the exec in the
+// child fails.
+int spawn_process(const spawn_attr_t *attr, pid_t *pid);
+
+// Like spawn_process(), but returns as soon as the child exists instead
+// of waiting for its exec, so that a slow exec doesn't hold up the
+// caller. The child gets a copy of our memory, fork()-style, and
+// *status_fd is a non-blocking, close-on-exec pipe that becomes readable
+// once the exec has succeeded or failed; see spawn_status(). *status_fd
+// is -1 when the outcome is already known (kernels without clone3()).
+int spawn_process_async(const spawn_attr_t *attr, pid_t *pid, int *status_fd);
+
+// Read the outcome of spawn_process_async() from its status_fd. Returns
+// 1 once known, with *error 0 if the exec succeeded or the errno it
+// failed with (the child then exits with status 127); 0 while pending;
+// -1 on error.
+int spawn_status(int status_fd, int *error);
+
+#endif
@@ -0,0 +1,104 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <time.h>
+#include "stats.h"
+
+uint64_t stats_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void stats_add(uint64_t *counter, uint64_t n) {
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+uint64_t stats_read(const uint64_t *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+void stats_observe(stats_histogram_t *histogram, uint64_t value) {
+    int bucket = 0;
+    while (bucket < STATS_BUCKETS - 1 && value > (1ULL << bucket)) {
+        bucket++;
+    }
+    stats_add(&histogram->buckets[bucket], 1);
+    stats_add(&histogram->sum, value);
+    stats_add(&histogram->count, 1);
+}
+
+static int put_text(stats_text_t *text, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static int put_text(stats_text_t *text, const char *format, ...) {
+    while (1) {
+        size_t left = text->capacity - text->length;
+        va_list ap;
+        va_start(ap, format);
+        int n = vsnprintf(text->data + text->length, left, format, ap);
+        va_end(ap);
+        if (n < 0) {
+            return -1;
+        }
+        if ((size_t)n < left) {
+            text->length += n;
+            return 0;
+        }
+
+        size_t capacity = text->capacity ? text->capacity * 2 : 4096;
+        while (capacity - text->length <= (size_t)n) {
+            capacity *= 2;
+        }
+        char *data = realloc(text->data, capacity);
+        if (data == NULL) {
+            return -1;
+        }
+        text->data = data;
+        text->capacity = capacity;
+    }
+}
+
+int stats_put_header(stats_text_t *text, const char *name, const char *type,
+                     const char *help) {
+    return put_text(text, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+int stats_put_value(stats_text_t *text, const char *name, const char *labels,
+                    uint64_t value) {
+    if (labels == NULL) {
+        return put_text(text, "%s %llu\n", name, (unsigned long long)value);
+    }
+    return put_text(text, "%s{%s} %llu\n", name, labels, (unsigned long long)value);
+}
+
+int stats_put_histogram(stats_text_t *text, const char *name, const char *labels,
+                        const stats_histogram_t *histogram, double scale) {
+    const char *sep = labels != NULL ? "," : "";
+    if (labels == NULL) {
+        labels = "";
+    }
+
+    // Prometheus buckets are cumulative
+    uint64_t cumulative = 0;
+    for (int i = 0; i < STATS_BUCKETS - 1; i++) {
+        cumulative += stats_read(&histogram->buckets[i]);
+        if (put_text(text, "%s_bucket{%s%sle=\"%g\"} %llu\n", name, labels, sep,
+                     (double)(1ULL << i) * scale, (unsigned long long)cumulative) == -1) {
+            return -1;
+        }
+    }
+    cumulative += stats_read(&histogram->buckets[STATS_BUCKETS - 1]);
+    const char *braces_open = *labels != '\0' ? "{" : "";
+    const char *braces_close = *labels != '\0' ? "}" : "";
+    if (put_text(text, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, sep,
+                 (unsigned long long)cumulative) == -1 ||
+        put_text(text, "%s_sum%s%s%s %g\n", name, braces_open, labels, braces_close,
+                 stats_read(&histogram->sum) * scale) == -1 ||
+        put_text(text, "%s_count%s%s%s %llu\n", name, braces_open, labels, braces_close,
+                 (unsigned long long)stats_read(&histogram->count)) == -1) {
+        return -1;
+    }
+    return 0;
+}
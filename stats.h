@@ -0,0 +1,48 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Histogram buckets: bucket i counts values up to 2^i, the last one
+// everything larger. Latencies are recorded in microseconds, so the
+// buckets span 1 us to about 4 s.
+#define STATS_BUCKETS 23
+
+// Counters and histograms are updated with relaxed atomic operations, so
+// any thread may record into them without locking. A reader sees every
+// field consistent on its own, not all of them at one instant.
+typedef struct {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t buckets[STATS_BUCKETS];
+} stats_histogram_t;
+
+// Monotonic clock in microseconds, for latencies
+uint64_t stats_now_us(void);
+
+void stats_add(uint64_t *counter, uint64_t n);
+uint64_t stats_read(const uint64_t *counter);
+void stats_observe(stats_histogram_t *histogram, uint64_t value);
+
+// Growing text buffer for the Prometheus text exposition format. A
+// zero-initialized one is empty; release it with free(buf->data).
+typedef struct {
+    char *data;
+    size_t length;
+    size_t capacity;
+} stats_text_t;
+
+// Append the # HELP and # TYPE lines of a metric
+int stats_put_header(stats_text_t *text, const char *name, const char *type,
+                     const char *help);
+// Append one sample; labels is the inside of {} or NULL
+int stats_put_value(stats_text_t *text, const char *name, const char *labels,
+                    uint64_t value);
+// Append the _bucket/_sum/_count samples of a histogram; bucket bounds
+// and the sum are multiplied by scale (1e-6 to show microseconds as
+// seconds)
+int stats_put_histogram(stats_text_t *text, const char *name, const char *labels,
+                        const stats_histogram_t *histogram, double scale);
+
+#endif
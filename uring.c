@@ -0,0 +1,148 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "uring.h"
+
+static int setup(unsigned entries, struct io_uring_params *params, unsigned flags) {
+    memset(params, 0, sizeof(*params));
+    params->flags = flags | IORING_SETUP_CQSIZE;
+    params->cq_entries = entries * 4;
+    return syscall(SYS_io_uring_setup, entries, params);
+}
+
+// Map the rings and the submission entries of a ring set up with params
+static int map_rings(uring_t *ring, const struct io_uring_params *params) {
+    ring->sq_ring_size = params->sq_off.array + params->sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params->cq_off.cqes +
+                         params->cq_entries * sizeof(struct io_uring_cqe);
+    if (params->features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = 0;
+    }
+
+    void *sq = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) {
+        return -1;
+    }
+    ring->sq_ring = sq;
+    void *cq = sq;
+    if (ring->cq_ring_size > 0) {
+        cq = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) {
+            return -1;
+        }
+    }
+    ring->cq_ring = cq;
+    ring->sqes_size = params->sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        return -1;
+    }
+    ring->sqes = sqes;
+
+    ring->sq_entries = params->sq_entries;
+    ring->sq_head = (unsigned *)((char *)sq + params->sq_off.head);
+    ring->sq_tail = (unsigned *)((char *)sq + params->sq_off.tail);
+    ring->sq_mask = (unsigned *)((char *)sq + params->sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)sq + params->sq_off.array);
+    ring->sqe_tail = *ring->sq_tail;
+    ring->cq_head = (unsigned *)((char *)cq + params->cq_off.head);
+    ring->cq_tail = (unsigned *)((char *)cq + params->cq_off.tail);
+    ring->cq_mask = (unsigned *)((char *)cq + params->cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)cq + params->cq_off.cqes);
+    return 0;
+}
+
+int uring_init(uring_t *ring, unsigned entries) {
+    memset(ring, 0, sizeof(*ring));
+
+    // Completions are only ever reaped by the thread that submits, so
+    // the kernel can run their task work when we wait instead of
+    // interrupting us (Linux 6.1); older kernels get a plain ring
+    struct io_uring_params params;
+    ring->fd = setup(entries, &params,
+                     IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN);
+    if (ring->fd == -1 && errno == EINVAL) {
+        ring->fd = setup(entries, &params, 0);
+    }
+    if (ring->fd == -1) {
+        return -1;
+    }
+
+    if (map_rings(ring, &params) == -1) {
+        int saved_errno = errno;
+        uring_free(ring);
+        errno = saved_errno;
+        return -1;
+    }
+    return 0;
+}
+
+void uring_free(uring_t *ring) {
+    if (ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring != NULL) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    if (ring->fd != -1) {
+        close(ring->fd);
+    }
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+struct io_uring_sqe *uring_get_sqe(uring_t *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sqe_tail - head == ring->sq_entries) {
+        if (uring_submit(ring, 0) == -1) {
+            return NULL;
+        }
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if (ring->sqe_tail - head == ring->sq_entries) {
+            errno = EBUSY;
+            return NULL;
+        }
+    }
+
+    unsigned index = ring->sqe_tail++ & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    return sqe;
+}
+
+int uring_submit(uring_t *ring, unsigned wait_nr) {
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+    // Entries left over by an interrupted call go with these
+    unsigned to_submit = ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+    if (to_submit == 0 && wait_nr == 0) {
+        return 0;
+    }
+    return syscall(SYS_io_uring_enter, ring->fd, to_submit, wait_nr, flags, NULL, 0) == -1
+           ? -1 : 0;
+}
+
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uring_cqe_seen(uring_t *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,50 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+// A minimal io_uring instance on the raw system calls, for the agent's
+// io_uring event loop (make IO_URING=1). Not thread-safe: each worker
+// sets up and drives its own.
+typedef struct {
+    int fd;
+    unsigned sq_entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sqe_tail;      // sqes handed out, submitted or not
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;          // sq_ring with IORING_FEAT_SINGLE_MMAP
+    size_t cq_ring_size;
+    size_t sqes_size;
+} uring_t;
+
+// Set up a ring with room for entries submissions and four times as many
+// completions. Returns 0, or -1 with errno set (ENOSYS, or EPERM where
+// io_uring is disabled or filtered, as in many containers).
+int uring_init(uring_t *ring, unsigned entries);
+
+void uring_free(uring_t *ring);
+
+// A zeroed submission entry to fill in, submitting the queued ones first
+// if the submission queue is full. Returns NULL with errno set on error.
+struct io_uring_sqe *uring_get_sqe(uring_t *ring);
+
+// Submit the queued entries and wait until at least wait_nr completions
+// are available. Returns 0, or -1 with errno set (EINTR included).
+int uring_submit(uring_t *ring, unsigned wait_nr);
+
+// The oldest completion not yet consumed, or NULL; uring_cqe_seen()
+// consumes it
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring);
+void uring_cqe_seen(uring_t *ring);
+
+#endif